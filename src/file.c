@@ -6,13 +6,32 @@
 
 /* Standard Library */
 
-#ifndef WZ_NO_THRD
-#  ifdef WZ_WINDOWS
-#    include <Windows.h>
+#ifdef WZ_WINDOWS
+#  include <Windows.h>
+#  include <io.h>
+#  ifndef WZ_NO_THRD
 #    include <process.h>
-#  else
+#  endif
+#else
+#  ifdef WZ_MACOS
+#    include <mach/mach_time.h>
+#  endif
+#  include <unistd.h>
+#  include <fcntl.h>
+#  ifndef WZ_NO_THRD
 #    include <pthread.h>
 #  endif
+#  if !defined(WZ_NO_MMAP) || (defined(__linux__) && !defined(WZ_NO_URING))
+#    include <sys/mman.h>
+#  endif
+#  if defined(__linux__) && !defined(WZ_NO_URING)
+#    include <sys/syscall.h>
+#    include <linux/io_uring.h>
+#    include <errno.h>
+#    if defined(WZ_GCC) && defined(IORING_FEAT_RW_CUR_POS) /* 5.6 */
+#      define WZ_URING
+#    endif
+#  endif
 #endif
 #include <ctype.h>
 #include <stdio.h>
@@ -20,8 +39,23 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 
+/* Instruction Set */
+
+#if !defined(WZ_NO_SIMD) && \
+    (defined(__SSE2__) || defined(_M_X64) || \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#  include <emmintrin.h>
+#  define WZ_SSE2
+#elif !defined(WZ_NO_SIMD) && \
+      (defined(__ARM_NEON) || defined(__ARM_NEON__)) && \
+      !defined(__ARM_BIG_ENDIAN)
+#  include <arm_neon.h>
+#  define WZ_NEON
+#endif
+
 /* Third Party Library */
 
 #include <aes256.h>
@@ -36,6 +70,9 @@
 #include "wz.h"
 #include "type.h"
 #include "byteorder.h"
+#ifndef WZ_RUNTIME_KEYS
+#  include "wz_keys.h" /* generated by gen_keys */
+#endif
 
 #define WZ_IS_LV0_NIL(type)  ((type) == 0x01)
 #define WZ_IS_LV0_LINK(type) ((type) == 0x02)
@@ -51,13 +88,6 @@
 #define WZ_IS_LV1_STR(type) ((type) == 0x08)
 #define WZ_IS_LV1_OBJ(type) ((type) == 0x09)
 
-#define WZ_IS_LV1_ARY(type) (!strcmp((char *) (type), "Property"))
-#define WZ_IS_LV1_IMG(type) (!strcmp((char *) (type), "Canvas"))
-#define WZ_IS_LV1_VEX(type) (!strcmp((char *) (type), "Shape2D#Convex2D"))
-#define WZ_IS_LV1_VEC(type) (!strcmp((char *) (type), "Shape2D#Vector2D"))
-#define WZ_IS_LV1_AO(type)  (!strcmp((char *) (type), "Sound_DX8"))
-#define WZ_IS_LV1_UOL(type) (!strcmp((char *) (type), "UOL"))
-
 typedef struct {
   wz_uint8_t   b;
   wz_uint8_t   g;
@@ -229,6 +259,7 @@ typedef struct wzary {
 } wzary;
 
 typedef struct wzimg {
+  wz_uint64_t  pos; /* of the compressed data */
   wz_uint32_t  w;
   wz_uint32_t  h;
   wz_uint8_t * data;
@@ -249,6 +280,7 @@ typedef struct wzvex {
 } wzvex;
 
 typedef struct wzao {
+  wz_uint64_t  pos; /* of the audio without header */
   wz_uint32_t  size;
   wz_uint32_t  ms;
   wz_uint16_t  format;
@@ -256,34 +288,76 @@ typedef struct wzao {
   wz_uint8_t * data;
 } wzao;
 
-struct wzfile {
-  struct wzctx * ctx;
-  FILE *       raw;
-  wz_uint32_t  pos;
-  wz_uint32_t  size;
-  wz_uint32_t  start;
-  wz_uint32_t  hash;
-  wz_uint8_t   key;
-  wz_uint8_t   _[8 - 1]; /* padding */
-  wznode       root;
+enum {
+  WZ_CACHE_BLOCK_LEN = 0x10000, /* bytes of an aligned block */
+  WZ_CACHE_SLOTS_LEN = 8,       /* fetches kept in the cache */
+  WZ_CACHE_AHEAD_MAX = 4,       /* blocks of a fetch if reading sequentially */
+  WZ_DROP_IMG_MIN    = 0x100000 /* bytes of an image dropped after freed */
 };
 
-struct wzctx {
-  wz_uint8_t * keys;
+typedef struct {
+  wz_uint64_t  pos;  /* position of the first block */
+  wz_uint32_t  len;  /* 0 if the slot is empty */
+  wz_uint32_t  used; /* tick of the last lookup */
+  wz_uint8_t * bytes;
+} wzslot;
+
+typedef struct { /* a mutex of the structures shared by threads */
+#if defined(WZ_NO_THRD)
+  wz_uint8_t   _[sizeof(void *)]; /* padding, nothing to lock */
+#elif defined(WZ_WINDOWS)
+  HANDLE       raw;
+#else
+  pthread_mutex_t raw;
+#endif
+} wzmutex;
+
+typedef struct { /* lru of blocks for the files which are not in memory */
+  wzmutex      mutex;
+  wzslot       slots[WZ_CACHE_SLOTS_LEN];
+  wz_uint64_t  next;   /* position right after the last fetch */
+  wz_uint64_t  hits;
+  wz_uint64_t  misses;
+  wz_uint64_t  bytes;  /* read from the backend */
+  wz_uint32_t  tick;
+  wz_uint32_t  ahead;  /* blocks of the next fetch */
+  wz_uint32_t  ahead_max; /* 1 if the file is read randomly */
+  wz_uint8_t   _[4]; /* padding */
+} wzcache;
+
+enum {
+  WZ_NAMES_SLOTS_MIN = 0x400,  /* slots of the table when it is created */
+  WZ_NAMES_CHUNK_LEN = 0x10000 /* bytes of a chunk of the arena */
 };
 
-typedef union {
-  wz_uint8_t        * u8;
-  wz_uint16_t       * u16;
-  wz_uint32_t       * u32;
-  wz_uint64_t       * u64;
-  const wz_uint8_t  * c8;
-  const wz_uint16_t * c16;
-  const wz_uint32_t * c32;
-  const wz_uint64_t * c64;
-  wznode            * n;
-  wzstr             * s;
-} wzptr;
+typedef struct { /* the names shared by the nodes of a file */
+  wzmutex      mutex;
+  wz_uint8_t ** slots; /* open addressing, NULL if the slot is empty */
+  wz_uint8_t * chunk;  /* the last chunk, led by the pointer to the previous */
+  wz_uint32_t  capa;   /* of the slots, a power of 2 */
+  wz_uint32_t  len;    /* of the names */
+  wz_uint32_t  used;   /* bytes of the last chunk */
+  wz_uint8_t   _[4]; /* padding */
+} wznames;
+
+enum {
+  WZ_REFS_SLOTS_BIT = 9,    /* strings kept, mapped by their positions */
+  WZ_REFS_SLOTS_LEN = 1 << WZ_REFS_SLOTS_BIT,
+  WZ_REFS_BYTES_MAX = 0x24  /* bytes of the longest string kept */
+};
+
+typedef struct {
+  wz_uint64_t  pos; /* of the string referenced, 0 if the slot is empty */
+  wz_uint8_t   key;
+  wz_uint8_t   enc;
+  wz_uint8_t   len;
+  wz_uint8_t   bytes[WZ_REFS_BYTES_MAX + 1]; /* utf8 */
+} wzref;
+
+typedef struct { /* the strings referenced by images, decoded already */
+  wzmutex      mutex;
+  wzref        slots[WZ_REFS_SLOTS_LEN];
+} wzrefs;
 
 static const wz_uint8_t wz_aes_key[32 / 4] = {
   /* These value would be expanded to aes key */
@@ -315,11 +389,92 @@ enum {
   WZ_KEY_UTF8_MAX_LEN  = 0x12000
 };
 
+typedef struct { /* the keys of a region expanded from its aes key and ivs */
+  size_t       len;   /* bytes of each key expanded so far */
+  const wz_uint8_t * bytes; /* keys of WZ_KEY_UTF8_MAX_LEN bytes */
+  const wz_uint8_t * ascii; /* mask ^ key of WZ_KEY_ASCII_MAX_LEN bytes */
+  const wz_uint8_t * utf16; /* per key and the empty key, for each encoding */
+  wz_uint32_t  ivs[WZ_KEYS_LEN];
+  wz_uint8_t   aes_key[32];
+  wz_uint8_t   full;  /* expanded by gen_keys, never expanded at runtime */
+  wz_uint8_t   _[sizeof(size_t) - 1]; /* padding */
+  wzmutex      mutex;
+} wzkeys;
+
+typedef struct { /* the keys of a region and their fingerprints */
+  wzkeys *     keys;
+  wz_uint8_t   prints[WZ_KEY_EMPTY + 1]; /* see wz_print_name */
+  wz_uint8_t   _[sizeof(void *) - WZ_KEY_EMPTY - 1]; /* padding */
+} wzprofile;
+
+struct wzfile {
+  struct wzctx * ctx;
+  wzkeys *     keys; /* of the region, matched by wz_init_file */
+  wzio         io;
+  const wz_uint8_t * map; /* whole file in memory or NULL if not */
+  wzcache *    cache; /* NULL if the file is in memory */
+  wz_uint64_t  size;
+  wz_uint64_t  start;
+  wz_uint64_t  read_end; /* position right after the last read */
+  struct wz_io_stats stats;
+  wz_uint32_t  hash;
+  wz_uint8_t   key;
+  wz_uint8_t   raw; /* skip canvases and audio, see wz_keep_raw */
+  wz_uint8_t   intern; /* share the names read, see wz_intern_names */
+  wz_uint8_t   _[4 - 3]; /* padding */
+  wznames *    names; /* NULL if the names were never interned */
+  wzrefs *     refs; /* NULL if the referenced strings are read each time */
+  wznode       root;
+};
+
+typedef struct { /* a read position; reads never touch shared file state */
+  wzfile *     file;
+  wz_uint64_t  pos;
+} wzcur;
+
+typedef struct { /* the default backend of wz_open_file */
+  FILE *       raw;
+  const wz_uint8_t * map; /* whole file mapped in memory or NULL if not */
+#if defined(WZ_WINDOWS) && !defined(WZ_NO_MMAP)
+  HANDLE       map_handle;
+#endif
+  wz_uint64_t  size;
+} wzstdio;
+
+typedef struct { /* the backend of wz_open_mem */
+  const wz_uint8_t * buf;
+  wz_uint64_t  size;
+  wz_uint8_t   own; /* free the buffer on close */
+  wz_uint8_t   _[sizeof(void *) - 1]; /* padding */
+} wzmem;
+
+struct wzctx {
+  wzprofile *  profiles;  /* the keys built in, then the ones added */
+  wz_uint8_t   profiles_len;
+  wz_uint8_t   _[sizeof(void *) - 1]; /* padding */
+  int       (* open)(wzio * io, const char * filename, void * user);
+  void *       open_user;
+};
+
+typedef union {
+  wz_uint8_t        * u8;
+  wz_uint16_t       * u16;
+  wz_uint32_t       * u32;
+  wz_uint64_t       * u64;
+  const wz_uint8_t  * c8;
+  const wz_uint16_t * c16;
+  const wz_uint32_t * c32;
+  const wz_uint64_t * c64;
+  wznode            * n;
+  wzstr             * s;
+} wzptr;
+
 enum { /* bit fields of wznode->info */
   WZ_TYPE  = 0x0f,
   WZ_LEVEL = 0x10,
   WZ_LEAF  = 0x20, /* is it a leaf in level 0 or not */
-  WZ_EMBED = 0x40
+  WZ_EMBED = 0x40,
+  WZ_INTERN = 0x80 /* the name is in wzfile->names, not freed with it */
 };
 
 enum {
@@ -337,123 +492,1617 @@ enum {
   WZ_LV1_TYPENAME_OR_STR
 };
 
-enum {
-  WZ_AUDIO_WAV_SIZE = 18, /* sizeof(packed wzwav) */
-  WZ_AUDIO_PCM_SIZE = 44  /* sizeof(packed wzpcm) */
-};
+enum {
+  WZ_AUDIO_WAV_SIZE = 18, /* sizeof(packed wzwav) */
+  WZ_AUDIO_PCM_SIZE = 44  /* sizeof(packed wzpcm) */
+};
+
+#ifdef WZ_MSVC
+#  define WZ_ONCE \
+    __pragma(warning(push)) \
+    __pragma(warning(disable: 4127)) \
+    while (0) \
+    __pragma(warning(pop))
+#else
+#  define WZ_ONCE while (0)
+#endif
+#define WZ_ERR \
+    fprintf(stderr, "Error: %s at %s:%d\n", __func__, __FILE__, __LINE__)
+#define WZ_ERR_GOTO(x) do { WZ_ERR; goto x; } WZ_ONCE
+#define WZ_ERR_RET(x) do { WZ_ERR; return x; } WZ_ONCE
+/*
+#define malloc(x) \
+    (printf("malloc(%zu) at %s:%s:%d\n", \
+            (size_t) x, __func__, __FILE__, __LINE__), \
+     malloc(x))
+#define realloc(ptr, x) \
+    (printf("realloc(%p, %zu) at %s:%s:%d\n", \
+            (void *) ptr, (size_t) x, __func__, __FILE__, __LINE__), \
+     realloc(ptr, x))
+#define free(ptr) \
+    (printf("free(%p) at %s:%s:%d\n", \
+            (void *) ptr, __func__, __FILE__, __LINE__), \
+     free(ptr))
+*/
+
+static void
+wz_error(const char * format, ...) {
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "Error: ");
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+static int
+wz_stdio_read_at(void * user, void * buf, wz_uint32_t len, wz_uint64_t pos) {
+  wzstdio * stdio = user;
+  wz_uint8_t * dst = buf;
+#if defined(WZ_WINDOWS)
+  HANDLE raw;
+  if ((raw = (HANDLE) _get_osfhandle(_fileno(stdio->raw))) ==
+      INVALID_HANDLE_VALUE)
+    WZ_ERR_RET(1);
+  while (len) {
+    OVERLAPPED overlapped;
+    DWORD read;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD) pos;
+    overlapped.OffsetHigh = (DWORD) (pos >> 32);
+    if (ReadFile(raw, dst, len, &read, &overlapped) == FALSE || !read)
+      WZ_ERR_RET(1);
+    dst += read, pos += read, len -= read;
+  }
+#else
+  int raw = fileno(stdio->raw);
+  while (len) {
+    ssize_t read;
+    if ((read = pread(raw, dst, len, (off_t) pos)) <= 0)
+      WZ_ERR_RET(1);
+    dst += read;
+    pos += (wz_uint64_t) read;
+    len -= (wz_uint32_t) read;
+  }
+#endif
+  return 0;
+}
+
+static int
+wz_stdio_size(void * user, wz_uint64_t * size) {
+  wzstdio * stdio = user;
+  return * size = stdio->size, 0;
+}
+
+static const void *
+wz_stdio_map(void * user) {
+  wzstdio * stdio = user;
+  return stdio->map;
+}
+
+static int /* pass the hint to the kernel, ignored if it is not supported */
+wz_stdio_advise(void * user, wz_uint64_t pos, wz_uint64_t len, int advice) {
+#if defined(WZ_WINDOWS) || !defined(POSIX_FADV_NORMAL)
+  (void) user;
+  (void) pos;
+  (void) len;
+  (void) advice;
+  return 0;
+#else
+  wzstdio * stdio = user;
+  int fadv;
+# ifndef WZ_NO_MMAP
+  int madv;
+# endif
+  switch (advice) {
+  case WZ_ADVICE_SEQUENTIAL: fadv = POSIX_FADV_SEQUENTIAL; break;
+  case WZ_ADVICE_RANDOM:     fadv = POSIX_FADV_RANDOM;     break;
+  case WZ_ADVICE_WILLNEED:   fadv = POSIX_FADV_WILLNEED;   break;
+  case WZ_ADVICE_DONTNEED:   fadv = POSIX_FADV_DONTNEED;   break;
+  default:                   fadv = POSIX_FADV_NORMAL;     break;
+  }
+# ifndef WZ_NO_MMAP
+  if (stdio->map != NULL) { /* page faults follow madvise, not fadvise */
+    union { const wz_uint8_t * c8; void * ptr; } addr;
+    wz_uint64_t mask = (wz_uint64_t) sysconf(_SC_PAGESIZE) - 1;
+    wz_uint64_t begin = pos & ~mask;
+    wz_uint64_t end = len ? pos + len : stdio->size;
+    switch (advice) {
+    case WZ_ADVICE_SEQUENTIAL: madv = POSIX_MADV_SEQUENTIAL; break;
+    case WZ_ADVICE_RANDOM:     madv = POSIX_MADV_RANDOM;     break;
+    case WZ_ADVICE_WILLNEED:   madv = POSIX_MADV_WILLNEED;   break;
+    case WZ_ADVICE_DONTNEED:   madv = POSIX_MADV_DONTNEED;   break;
+    default:                   madv = POSIX_MADV_NORMAL;     break;
+    }
+    addr.c8 = stdio->map + begin;
+    if (posix_madvise(addr.ptr, (size_t) (end - begin), madv))
+      WZ_ERR_RET(1);
+  }
+# endif
+  if (posix_fadvise(fileno(stdio->raw), (off_t) pos, (off_t) len, fadv))
+    WZ_ERR_RET(1);
+  return 0;
+#endif
+}
+
+static int /* map the whole file, return 1 if it cannot be mapped */
+wz_map_stdio(wzstdio * stdio) {
+#if defined(WZ_NO_MMAP)
+  (void) stdio;
+  return 1;
+#elif defined(WZ_WINDOWS)
+  HANDLE raw;
+  HANDLE handle;
+  void * map;
+  if (!stdio->size || stdio->size > (size_t) -1) /* too large to address */
+    return 1;
+  if ((raw = (HANDLE) _get_osfhandle(_fileno(stdio->raw))) ==
+      INVALID_HANDLE_VALUE)
+    return 1;
+  if ((handle = CreateFileMapping(raw, NULL, PAGE_READONLY,
+                                  0, 0, NULL)) == NULL)
+    return 1;
+  if ((map = MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0)) == NULL) {
+    CloseHandle(handle);
+    return 1;
+  }
+  stdio->map = map;
+  stdio->map_handle = handle;
+  return 0;
+#else
+  void * map;
+  if (!stdio->size || stdio->size > (size_t) -1) /* too large to address */
+    return 1;
+  if ((map = mmap(NULL, (size_t) stdio->size, PROT_READ, MAP_PRIVATE,
+                  fileno(stdio->raw), 0)) == MAP_FAILED)
+    return 1;
+  stdio->map = map;
+  return 0;
+#endif
+}
+
+static int
+wz_unmap_stdio(wzstdio * stdio) {
+  int ret = 0;
+#ifndef WZ_NO_MMAP
+  union { const wz_uint8_t * c8; void * ptr; } map;
+  if ((map.c8 = stdio->map) == NULL)
+    return ret;
+# ifdef WZ_WINDOWS
+  if (UnmapViewOfFile(map.ptr) == FALSE ||
+      CloseHandle(stdio->map_handle) == FALSE)
+    ret = 1;
+# else
+  if (munmap(map.ptr, (size_t) stdio->size))
+    ret = 1;
+# endif
+#endif
+  stdio->map = NULL;
+  return ret;
+}
+
+static int
+wz_stdio_close(void * user) {
+  wzstdio * stdio = user;
+  int ret = 0;
+  if (wz_unmap_stdio(stdio))
+    ret = 1;
+  if (fclose(stdio->raw))
+    ret = 1;
+  free(stdio);
+  return ret;
+}
+
+static int /* open the file by stdio and map it if possible */
+wz_open_stdio(wzio * io, const char * filename, void * user) {
+  int ret = 1;
+  FILE * raw;
+#if defined(WZ_WINDOWS)
+  __int64 size;
+#else
+  off_t size;
+#endif
+  wzstdio * stdio;
+  (void) user;
+  if ((raw = fopen(filename, "rb")) == NULL) {
+    perror(filename);
+    return ret;
+  }
+#if defined(WZ_WINDOWS)
+  if (_fseeki64(raw, 0, SEEK_END)) {
+    perror(filename);
+    goto close_raw;
+  }
+  if ((size = _ftelli64(raw)) < 0) {
+    perror(filename);
+    goto close_raw;
+  }
+#else
+  if (fseeko(raw, 0, SEEK_END)) {
+    perror(filename);
+    goto close_raw;
+  }
+  if ((size = ftello(raw)) < 0) {
+    perror(filename);
+    goto close_raw;
+  }
+#endif
+  if ((stdio = malloc(sizeof(* stdio))) == NULL)
+    WZ_ERR_GOTO(close_raw);
+  stdio->raw = raw;
+  stdio->map = NULL;
+  stdio->size = (wz_uint64_t) size;
+  (void) wz_map_stdio(stdio);
+  io->user = stdio;
+  io->read_at = wz_stdio_read_at;
+  io->size = wz_stdio_size;
+  io->map = wz_stdio_map;
+  io->advise = wz_stdio_advise;
+  io->close = wz_stdio_close;
+  ret = 0;
+close_raw:
+  if (ret)
+    fclose(raw);
+  return ret;
+}
+
+static int
+wz_mem_read_at(void * user, void * buf, wz_uint32_t len, wz_uint64_t pos) {
+  wzmem * mem = user;
+  if (pos > mem->size || len > mem->size - pos)
+    WZ_ERR_RET(1);
+  memcpy(buf, mem->buf + pos, len);
+  return 0;
+}
+
+static int
+wz_mem_size(void * user, wz_uint64_t * size) {
+  wzmem * mem = user;
+  return * size = mem->size, 0;
+}
+
+static const void *
+wz_mem_map(void * user) {
+  wzmem * mem = user;
+  return mem->buf;
+}
+
+static int
+wz_mem_close(void * user) {
+  wzmem * mem = user;
+  if (mem->own) {
+    wzptr buf;
+    buf.c8 = mem->buf;
+    free(buf.u8);
+  }
+  free(mem);
+  return 0;
+}
+
+static int
+wz_init_mutex(wzmutex * mutex) {
+#if defined(WZ_NO_THRD)
+  (void) mutex;
+  return 0;
+#elif defined(WZ_WINDOWS)
+  return (mutex->raw = CreateMutex(NULL, FALSE, NULL)) == NULL;
+#else
+  return pthread_mutex_init(&mutex->raw, NULL) != 0;
+#endif
+}
+
+static int
+wz_free_mutex(wzmutex * mutex) {
+#if defined(WZ_NO_THRD)
+  (void) mutex;
+  return 0;
+#elif defined(WZ_WINDOWS)
+  return CloseHandle(mutex->raw) == FALSE;
+#else
+  return pthread_mutex_destroy(&mutex->raw) != 0;
+#endif
+}
+
+static int
+wz_lock_mutex(wzmutex * mutex) {
+#if defined(WZ_NO_THRD)
+  (void) mutex;
+  return 0;
+#elif defined(WZ_WINDOWS)
+  return WaitForSingleObject(mutex->raw, INFINITE) != WAIT_OBJECT_0;
+#else
+  return pthread_mutex_lock(&mutex->raw) != 0;
+#endif
+}
+
+static int
+wz_unlock_mutex(wzmutex * mutex) {
+#if defined(WZ_NO_THRD)
+  (void) mutex;
+  return 0;
+#elif defined(WZ_WINDOWS)
+  return ReleaseMutex(mutex->raw) == FALSE;
+#else
+  return pthread_mutex_unlock(&mutex->raw) != 0;
+#endif
+}
+
+static wzcache *
+wz_init_cache(void) {
+  wzcache * cache;
+  wz_uint8_t i;
+  if ((cache = malloc(sizeof(* cache))) == NULL)
+    WZ_ERR_RET(NULL);
+  if (wz_init_mutex(&cache->mutex))
+    return free(cache), NULL;
+  for (i = 0; i < WZ_CACHE_SLOTS_LEN; i++) {
+    cache->slots[i].len = 0;
+    cache->slots[i].used = 0;
+    cache->slots[i].bytes = NULL;
+  }
+  cache->next = (wz_uint64_t) -1;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->bytes = 0;
+  cache->tick = 0;
+  cache->ahead = 1;
+  cache->ahead_max = WZ_CACHE_AHEAD_MAX;
+  return cache;
+}
+
+static int
+wz_free_cache(wzcache * cache) {
+  int ret = 0;
+  wz_uint8_t i;
+  for (i = 0; i < WZ_CACHE_SLOTS_LEN; i++)
+    free(cache->slots[i].bytes);
+  if (wz_free_mutex(&cache->mutex))
+    ret = 1;
+  free(cache);
+  return ret;
+}
+
+static wznames *
+wz_init_names(void) {
+  wznames * names;
+  wz_uint32_t i;
+  if ((names = malloc(sizeof(* names))) == NULL)
+    WZ_ERR_RET(NULL);
+  if ((names->slots = malloc(WZ_NAMES_SLOTS_MIN *
+                             sizeof(* names->slots))) == NULL)
+    return free(names), NULL;
+  if (wz_init_mutex(&names->mutex))
+    return free(names->slots), free(names), NULL;
+  for (i = 0; i < WZ_NAMES_SLOTS_MIN; i++)
+    names->slots[i] = NULL;
+  names->chunk = NULL;
+  names->capa = WZ_NAMES_SLOTS_MIN;
+  names->len = 0;
+  names->used = 0;
+  return names;
+}
+
+static int
+wz_free_names(wznames * names) {
+  int ret = 0;
+  wz_uint8_t * chunk = names->chunk;
+  while (chunk != NULL) {
+    wz_uint8_t * prev;
+    memcpy(&prev, chunk, sizeof(prev));
+    free(chunk);
+    chunk = prev;
+  }
+  free(names->slots);
+  if (wz_free_mutex(&names->mutex))
+    ret = 1;
+  free(names);
+  return ret;
+}
+
+static wz_uint8_t ** /* the slot of the name, or the empty slot it would be */
+wz_find_name(wz_uint8_t ** slots, wz_uint32_t capa,
+             const wz_uint8_t * bytes, wz_uint32_t len) {
+  wz_uint32_t hash = 0x811c9dc5; /* fnv-1a */
+  wz_uint32_t i;
+  for (i = 0; i < len; i++)
+    hash = (hash ^ bytes[i]) * 0x01000193;
+  for (i = hash & (capa - 1);; i = (i + 1) & (capa - 1)) {
+    wz_uint8_t * name = slots[i];
+    if (name == NULL ||
+        (name[-1] == len && !memcmp(name, bytes, len)))
+      return slots + i;
+  }
+}
+
+static int /* double the slots, which are kept at most 3/4 full */
+wz_grow_names(wznames * names) {
+  wz_uint8_t ** slots;
+  wz_uint32_t capa = names->capa * 2;
+  wz_uint32_t i;
+  if ((slots = malloc(capa * sizeof(* slots))) == NULL)
+    WZ_ERR_RET(1);
+  for (i = 0; i < capa; i++)
+    slots[i] = NULL;
+  for (i = 0; i < names->capa; i++) {
+    wz_uint8_t * name = names->slots[i];
+    if (name != NULL)
+      * wz_find_name(slots, capa, name, name[-1]) = name;
+  }
+  free(names->slots);
+  names->slots = slots;
+  names->capa = capa;
+  return 0;
+}
+
+static int /* the only copy of the name in the file, which never moves */
+wz_intern_name(wz_uint8_t ** ret_name,
+               const wz_uint8_t * bytes, wz_uint32_t len, wznames * names) {
+  int ret = 1;
+  wz_uint8_t ** slot;
+  wz_uint8_t * name;
+  if (len > WZ_UINT8_MAX)
+    WZ_ERR_RET(ret);
+  if (wz_lock_mutex(&names->mutex))
+    WZ_ERR_RET(ret);
+  slot = wz_find_name(names->slots, names->capa, bytes, len);
+  if ((name = * slot) == NULL) {
+    wz_uint32_t size = 1 + len + 1; /* the length, the bytes and '\0' */
+    if ((names->len + 1) * 4 > names->capa * 3) {
+      if (wz_grow_names(names))
+        WZ_ERR_GOTO(unlock_names);
+      slot = wz_find_name(names->slots, names->capa, bytes, len);
+    }
+    if (names->chunk == NULL || names->used + size > WZ_NAMES_CHUNK_LEN) {
+      wz_uint8_t * chunk;
+      if ((chunk = malloc(WZ_NAMES_CHUNK_LEN)) == NULL)
+        WZ_ERR_GOTO(unlock_names);
+      memcpy(chunk, &names->chunk, sizeof(names->chunk));
+      names->chunk = chunk;
+      names->used = sizeof(names->chunk);
+    }
+    name = names->chunk + names->used + 1;
+    name[-1] = (wz_uint8_t) len;
+    memcpy(name, bytes, len);
+    name[len] = '\0';
+    names->used += size;
+    names->len++;
+    * slot = name;
+  }
+  * ret_name = name;
+  ret = 0;
+unlock_names:
+  if (wz_unlock_mutex(&names->mutex))
+    ret = 1;
+  return ret;
+}
+
+static int /* the name interned already, or NULL if there is not */
+wz_lookup_name(const wz_uint8_t ** ret_name,
+               const wz_uint8_t * bytes, wz_uint32_t len, wznames * names) {
+  if (wz_lock_mutex(&names->mutex))
+    WZ_ERR_RET(1);
+  * ret_name = * wz_find_name(names->slots, names->capa, bytes, len);
+  if (wz_unlock_mutex(&names->mutex))
+    WZ_ERR_RET(1);
+  return 0;
+}
+
+static wzrefs *
+wz_init_refs(void) {
+  wzrefs * refs;
+  wz_uint32_t i;
+  if ((refs = malloc(sizeof(* refs))) == NULL)
+    WZ_ERR_RET(NULL);
+  if (wz_init_mutex(&refs->mutex))
+    return free(refs), NULL;
+  for (i = 0; i < WZ_REFS_SLOTS_LEN; i++)
+    refs->slots[i].pos = 0;
+  return refs;
+}
+
+static int
+wz_free_refs(wzrefs * refs) {
+  int ret = 0;
+  if (wz_free_mutex(&refs->mutex))
+    ret = 1;
+  free(refs);
+  return ret;
+}
+
+static wzref * /* the only slot the string at pos may be kept in */
+wz_find_ref(wzrefs * refs, wz_uint64_t pos) {
+  wz_uint32_t hash = (wz_uint32_t) (pos ^ (pos >> 32)) * 0x9e3779b1;
+  return refs->slots + (hash >> (32 - WZ_REFS_SLOTS_BIT));
+}
+
+static int /* copy the string at pos decoded by key if it is kept */
+wz_get_ref(wz_uint8_t * ret_found, wz_uint8_t * ret_bytes,
+           wz_uint32_t * ret_len, wz_uint8_t * ret_enc,
+           wz_uint64_t pos, wz_uint8_t key, wzrefs * refs) {
+  wzref * ref;
+  if (wz_lock_mutex(&refs->mutex))
+    WZ_ERR_RET(1);
+  ref = wz_find_ref(refs, pos);
+  if ((* ret_found = ref->pos == pos && ref->key == key) != 0) {
+    memcpy(ret_bytes, ref->bytes, ref->len + 1U);
+    * ret_len = ref->len;
+    * ret_enc = ref->enc;
+  }
+  if (wz_unlock_mutex(&refs->mutex))
+    WZ_ERR_RET(1);
+  return 0;
+}
+
+static int /* keep the string at pos, replacing the one in its slot */
+wz_put_ref(const wz_uint8_t * bytes, wz_uint32_t len, wz_uint8_t enc,
+           wz_uint64_t pos, wz_uint8_t key, wzrefs * refs) {
+  wzref * ref;
+  if (len > WZ_REFS_BYTES_MAX)
+    return 0;
+  if (wz_lock_mutex(&refs->mutex))
+    WZ_ERR_RET(1);
+  ref = wz_find_ref(refs, pos);
+  ref->pos = pos;
+  ref->key = key;
+  ref->enc = enc;
+  ref->len = (wz_uint8_t) len;
+  memcpy(ref->bytes, bytes, len);
+  ref->bytes[len] = '\0';
+  if (wz_unlock_mutex(&refs->mutex))
+    WZ_ERR_RET(1);
+  return 0;
+}
+
+static wz_uint64_t /* monotonic nanoseconds, 0 if the clock failed */
+wz_get_ns(void) {
+#if defined(WZ_WINDOWS)
+  LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (QueryPerformanceFrequency(&freq) == FALSE ||
+      QueryPerformanceCounter(&now) == FALSE)
+    return 0;
+  return (wz_uint64_t) (now.QuadPart / freq.QuadPart * 1000000000 +
+                        now.QuadPart % freq.QuadPart * 1000000000 /
+                        freq.QuadPart);
+#elif defined(WZ_MACOS)
+  mach_timebase_info_data_t info;
+  if (mach_timebase_info(&info) != KERN_SUCCESS)
+    return 0;
+  return mach_absolute_time() * info.numer / info.denom;
+#else
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now))
+    return 0;
+  return (wz_uint64_t) now.tv_sec * 1000000000 + (wz_uint64_t) now.tv_nsec;
+#endif
+}
+
+#if !defined(WZ_NO_THRD) && \
+    !((defined(WZ_GCC) && WZ_GCC >= 40700) || defined(WZ_CLANG)) && \
+    !defined(WZ_WINDOWS)
+static pthread_mutex_t wz_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static wz_uint64_t /* swap a counter read by every reader of the file */
+wz_swap_stat(wz_uint64_t * stat, wz_uint64_t val) {
+#if defined(WZ_NO_THRD)
+  wz_uint64_t old = * stat;
+  * stat = val;
+  return old;
+#elif (defined(WZ_GCC) && WZ_GCC >= 40700) || defined(WZ_CLANG)
+  return __atomic_exchange_n(stat, val, __ATOMIC_RELAXED);
+#elif defined(WZ_WINDOWS)
+  return (wz_uint64_t) InterlockedExchange64((volatile LONG64 *) stat,
+                                             (LONG64) val);
+#else
+  wz_uint64_t old;
+  (void) pthread_mutex_lock(&wz_stats_mutex);
+  old = * stat;
+  * stat = val;
+  (void) pthread_mutex_unlock(&wz_stats_mutex);
+  return old;
+#endif
+}
+
+static void /* add to a counter updated by every reader of the file */
+wz_add_stat(wz_uint64_t * stat, wz_uint64_t val) {
+#if defined(WZ_NO_THRD)
+  * stat += val;
+#elif (defined(WZ_GCC) && WZ_GCC >= 40700) || defined(WZ_CLANG)
+  (void) __atomic_fetch_add(stat, val, __ATOMIC_RELAXED);
+#elif defined(WZ_WINDOWS)
+  (void) InterlockedExchangeAdd64((volatile LONG64 *) stat, (LONG64) val);
+#else
+  (void) pthread_mutex_lock(&wz_stats_mutex);
+  * stat += val;
+  (void) pthread_mutex_unlock(&wz_stats_mutex);
+#endif
+}
+
+static wz_uint64_t
+wz_load_stat(wz_uint64_t * stat) {
+#if defined(WZ_NO_THRD)
+  return * stat;
+#elif (defined(WZ_GCC) && WZ_GCC >= 40700) || defined(WZ_CLANG)
+  return __atomic_load_n(stat, __ATOMIC_RELAXED);
+#elif defined(WZ_WINDOWS)
+  return (wz_uint64_t) InterlockedCompareExchange64((volatile LONG64 *) stat,
+                                                    0, 0);
+#else
+  wz_uint64_t val;
+  (void) pthread_mutex_lock(&wz_stats_mutex);
+  val = * stat;
+  (void) pthread_mutex_unlock(&wz_stats_mutex);
+  return val;
+#endif
+}
+
+static void /* count a read of the backend and the seek before it */
+wz_count_read(wz_uint32_t len, wz_uint64_t pos, wzfile * file) {
+  struct wz_io_stats * stats = &file->stats;
+  wz_uint64_t end = wz_swap_stat(&file->read_end, pos + len);
+  if (pos != end) {
+    wz_uint64_t dist;
+    wz_uint8_t i = 0;
+    if (pos > end)
+      dist = pos - end, wz_add_stat(&stats->forward, 1);
+    else
+      dist = end - pos, wz_add_stat(&stats->backward, 1);
+    while ((dist >>= 4) && i < WZ_IO_SEEKS_LEN - 1)
+      i++;
+    wz_add_stat(&stats->seeks[i], 1);
+  }
+  wz_add_stat(&stats->reads, 1);
+  wz_add_stat(&stats->bytes, len);
+}
+
+static int /* read from the backend and count the time it takes */
+wz_read_io(void * bytes, wz_uint32_t len, wz_uint64_t pos, wzfile * file) {
+  wz_uint64_t start = wz_get_ns();
+  int ret = file->io.read_at(file->io.user, bytes, len, pos);
+  wz_add_stat(&file->stats.ns, wz_get_ns() - start);
+  if (!ret)
+    wz_count_read(len, pos, file);
+  return ret;
+}
+
+static int /* fetch the blocks at pos into the least recently used slot */
+wz_fill_cache(wzslot ** ret_slot, wz_uint64_t pos, wzfile * file) {
+  wzcache * cache = file->cache;
+  wzslot * slot = cache->slots;
+  wz_uint64_t start = pos & ~(wz_uint64_t) (WZ_CACHE_BLOCK_LEN - 1);
+  wz_uint64_t len;
+  wz_uint8_t i;
+  for (i = 1; i < WZ_CACHE_SLOTS_LEN; i++)
+    if (cache->slots[i].used < slot->used)
+      slot = cache->slots + i;
+  if (start == cache->next) { /* sequential, read further ahead */
+    if (cache->ahead < cache->ahead_max)
+      cache->ahead <<= 1;
+  } else {
+    cache->ahead = 1;
+  }
+  len = (wz_uint64_t) cache->ahead * WZ_CACHE_BLOCK_LEN;
+  if (len > file->size - start)
+    len = file->size - start;
+  if (slot->bytes == NULL &&
+      (slot->bytes = malloc(WZ_CACHE_AHEAD_MAX * WZ_CACHE_BLOCK_LEN)) == NULL)
+    WZ_ERR_RET(1);
+  slot->len = 0;
+  if (wz_read_io(slot->bytes, (wz_uint32_t) len, start, file))
+    WZ_ERR_RET(1);
+  slot->pos = start;
+  slot->len = (wz_uint32_t) len;
+  cache->next = start + len;
+  cache->misses++;
+  cache->bytes += len;
+  * ret_slot = slot;
+  return 0;
+}
+
+static int
+wz_read_cache(void * bytes, wz_uint32_t len, wz_uint64_t pos,
+              wzfile * file) {
+  int ret = 1;
+  wzcache * cache = file->cache;
+  wz_uint8_t * dst = bytes;
+  if (len >= WZ_CACHE_BLOCK_LEN) { /* large blobs bypass the cache */
+    if (wz_read_io(bytes, len, pos, file) ||
+        wz_lock_mutex(&cache->mutex))
+      WZ_ERR_RET(ret);
+    cache->misses++;
+    cache->bytes += len;
+    return wz_unlock_mutex(&cache->mutex);
+  }
+  if (wz_lock_mutex(&cache->mutex))
+    WZ_ERR_RET(ret);
+  while (len) {
+    wzslot * slot = NULL;
+    wz_uint32_t off;
+    wz_uint32_t n;
+    wz_uint8_t i;
+    for (i = 0; i < WZ_CACHE_SLOTS_LEN; i++) {
+      wzslot * s = cache->slots + i;
+      if (s->len && pos >= s->pos && pos - s->pos < s->len) {
+        slot = s;
+        break;
+      }
+    }
+    if (slot != NULL)
+      cache->hits++;
+    else if (wz_fill_cache(&slot, pos, file))
+      WZ_ERR_GOTO(unlock);
+    slot->used = ++cache->tick;
+    off = (wz_uint32_t) (pos - slot->pos);
+    if ((n = slot->len - off) > len)
+      n = len;
+    memcpy(dst, slot->bytes + off, n);
+    dst += n, pos += n, len -= n;
+  }
+  ret = 0;
+unlock:
+  if (wz_unlock_mutex(&cache->mutex))
+    ret = 1;
+  return ret;
+}
+
+static int /* read from the map, the cache or the backend */
+wz_read_at(void * bytes, wz_uint32_t len, wz_uint64_t pos, wzfile * file) {
+  if (file->map != NULL)
+    return memcpy(bytes, file->map + pos, len), 0;
+  if (file->cache != NULL)
+    return wz_read_cache(bytes, len, pos, file);
+  return wz_read_io(bytes, len, pos, file);
+}
+
+static int
+wz_read_bytes(void * bytes, wz_uint32_t len, wzcur * cur) {
+  wzfile * file = cur->file;
+  if (len > file->size - cur->pos) WZ_ERR_RET(1);
+  if (!len) return 0;
+  if (wz_read_at(bytes, len, cur->pos, file))
+    WZ_ERR_RET(1);
+  return cur->pos += len, 0;
+}
+
+static int
+wz_read_byte(wz_uint8_t * byte, wzcur * cur) {
+  wzfile * file = cur->file;
+  if (1 > file->size - cur->pos) WZ_ERR_RET(1);
+  if (file->map != NULL)
+    * byte = file->map[cur->pos];
+  else if (wz_read_at(byte, 1, cur->pos, file))
+    WZ_ERR_RET(1);
+  return cur->pos += 1, 0;
+}
+
+static int
+wz_read_le16(wz_uint16_t * le16, wzcur * cur) {
+  if (wz_read_bytes(le16, 2, cur)) WZ_ERR_RET(1);
+  * le16 = WZ_LE16TOH(* le16);
+  return 0;
+}
+
+static int
+wz_read_le32(wz_uint32_t * le32, wzcur * cur) {
+  if (wz_read_bytes(le32, 4, cur)) WZ_ERR_RET(1);
+  * le32 = WZ_LE32TOH(* le32);
+  return 0;
+}
+
+static int
+wz_read_le64(wz_uint64_t * le64, wzcur * cur) {
+  if (wz_read_bytes(le64, 8, cur)) WZ_ERR_RET(1);
+  * le64 = WZ_LE64TOH(* le64);
+  return 0;
+}
+
+static int /* read packed integer (int8 or int32) */
+wz_read_int32(wz_uint32_t * int32, wzcur * cur) {
+  wz_int8_t byte;
+  if (wz_read_byte((wz_uint8_t *) &byte, cur)) WZ_ERR_RET(1);
+  if (byte == WZ_INT8_MIN) return wz_read_le32(int32, cur);
+  return * (wz_int32_t *) int32 = byte, 0;
+}
+
+static int /* read packed long (int8 or int64) */
+wz_read_int64(wz_uint64_t * int64, wzcur * cur) {
+  wz_int8_t byte;
+  if (wz_read_byte((wz_uint8_t *) &byte, cur)) WZ_ERR_RET(1);
+  if (byte == WZ_INT8_MIN) return wz_read_le64(int64, cur);
+  return * (wz_int64_t *) int64 = byte, 0;
+}
+
+static int
+wz_seek(wz_uint64_t pos, int origin, wzcur * cur) {
+  switch (origin) {
+  case SEEK_CUR:
+    if (pos > cur->file->size - cur->pos)
+      WZ_ERR_RET(1);
+    cur->pos += pos;
+    break;
+  case SEEK_SET:
+    if (pos > cur->file->size)
+      WZ_ERR_RET(1);
+    cur->pos = pos;
+    break;
+  default:
+    WZ_ERR_RET(1);
+  }
+  return 0;
+}
+
+enum {
+  WZ_BATCH_THRDS = 4,  /* workers of a batch without io_uring */
+  WZ_URING_DEPTH = 64  /* reads of a batch in flight by io_uring */
+};
+
+typedef struct { /* a read of a batch */
+  wz_uint64_t  pos;
+  wz_uint32_t  len;
+  wz_uint32_t  read;  /* bytes read so far */
+  wz_uint8_t * bytes; /* NULL after the callback takes it */
+  wznode *     node;  /* the canvas waiting for the bytes */
+} wzreq;
+
+typedef struct { /* a worker of a batch, which reads every step-th request */
+  wz_uint64_t  ns;   /* spent waiting for the backend */
+  wzreq *      reqs;
+  wzfile *     file;
+  int       (* done)(wzreq * req, wzfile * file);
+#ifndef WZ_NO_THRD
+# ifdef WZ_WINDOWS
+  HANDLE       thrd;
+# else
+  pthread_t    tid;
+# endif
+#endif
+  wz_uint32_t  len;
+  wz_uint32_t  id;
+  wz_uint32_t  step;
+  wz_uint8_t   err;
+  wz_uint8_t   started;
+  wz_uint8_t   _[2]; /* padding */
+} wzbatch;
+
+static int
+wz_read_reqs(wzbatch * batch) {
+  wzfile * file = batch->file;
+  wz_uint32_t i;
+  for (i = batch->id; i < batch->len; i += batch->step) {
+    wzreq * req = batch->reqs + i;
+    if (file->map != NULL) {
+      memcpy(req->bytes, file->map + req->pos, req->len);
+    } else {
+      wz_uint64_t start = wz_get_ns();
+      int err = file->io.read_at(file->io.user, req->bytes, req->len,
+                                 req->pos); /* batches bypass the cache */
+      batch->ns += wz_get_ns() - start;
+      if (err) {
+        batch->err = 1;
+        WZ_ERR_RET(batch->err);
+      }
+    }
+    req->read = req->len;
+    if (batch->done(req, file))
+      batch->err = 1;
+  }
+  return batch->err;
+}
+
+#ifndef WZ_NO_THRD
+# ifdef WZ_WINDOWS
+static unsigned __stdcall
+wz_read_reqs_thrd(void * batch) {
+  return (unsigned) wz_read_reqs(batch);
+}
+# else
+static void *
+wz_read_reqs_thrd(void * batch) {
+  return wz_read_reqs(batch) ? (void *) (wz_uintptr_t) !NULL : NULL;
+}
+# endif
+#endif
+
+static int /* read by a few workers, the calling thread is one of them */
+wz_read_pool(wzreq * reqs, wz_uint32_t len, wzfile * file,
+             int (* done)(wzreq * req, wzfile * file)) {
+  int ret = 0;
+  wzbatch batches[WZ_BATCH_THRDS];
+  wz_uint32_t step = 1;
+  wz_uint32_t i;
+#ifndef WZ_NO_THRD
+  step = WZ_BATCH_THRDS;
+  if (file->map != NULL) { /* nothing to wait for, just decoding */
+# ifdef WZ_WINDOWS
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    if (info.dwNumberOfProcessors < step)
+      step = info.dwNumberOfProcessors;
+# else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && (unsigned long) cpus < step)
+      step = (wz_uint32_t) cpus;
+# endif
+  }
+  if (len < step)
+    step = len;
+#endif
+  for (i = 0; i < step; i++) {
+    wzbatch * batch = batches + i;
+    batch->ns = 0;
+    batch->reqs = reqs;
+    batch->file = file;
+    batch->done = done;
+    batch->len = len;
+    batch->id = i;
+    batch->step = step;
+    batch->err = 0;
+    batch->started = 0;
+  }
+#ifndef WZ_NO_THRD
+  for (i = 1; i < step; i++) {
+    wzbatch * batch = batches + i;
+# ifdef WZ_WINDOWS
+    batch->started = (batch->thrd = (HANDLE) _beginthreadex(
+        NULL, 0, wz_read_reqs_thrd, batch, 0, NULL)) != NULL;
+# else
+    batch->started = !pthread_create(&batch->tid, NULL,
+                                     wz_read_reqs_thrd, batch);
+# endif
+  }
+#endif
+  for (i = 0; i < step; i++) /* the requests of workers not started */
+    if (!batches[i].started && wz_read_reqs(batches + i))
+      ret = 1;
+#ifndef WZ_NO_THRD
+  for (i = 1; i < step; i++) {
+    wzbatch * batch = batches + i;
+# ifdef WZ_WINDOWS
+    DWORD status;
+    if (!batch->started)
+      continue;
+    if (WaitForSingleObject(batch->thrd, INFINITE) != WAIT_OBJECT_0 ||
+        GetExitCodeThread(batch->thrd, &status) == FALSE ||
+        status ||
+        CloseHandle(batch->thrd) == FALSE)
+      ret = 1;
+# else
+    void * status;
+    if (!batch->started)
+      continue;
+    if (pthread_join(batch->tid, &status) ||
+        status != NULL)
+      ret = 1;
+# endif
+  }
+#endif
+  for (i = 0; i < step; i++)
+    wz_add_stat(&file->stats.ns, batches[i].ns);
+  return ret;
+}
+
+#ifdef WZ_URING
+typedef struct { /* the rings shared with the kernel */
+  void *       sq;
+  void *       cq;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+  wz_uint32_t * sq_head;
+  wz_uint32_t * sq_tail;
+  wz_uint32_t * sq_array;
+  wz_uint32_t * cq_head;
+  wz_uint32_t * cq_tail;
+  size_t       sq_len;
+  size_t       cq_len;
+  size_t       sqes_len;
+  wz_uint32_t  sq_mask;
+  wz_uint32_t  cq_mask;
+  wz_uint32_t  entries;
+  int          fd;
+} wzring;
+
+static int /* return 1 if io_uring is not available, no error is printed */
+wz_init_ring(wzring * ring, wz_uint32_t entries) {
+  struct io_uring_params params;
+  union {
+    wz_uint8_t * u8;
+    wz_uint32_t * u32;
+    struct io_uring_cqe * cqe;
+    void * ptr;
+  } ptr;
+  long fd;
+  memset(&params, 0, sizeof(params));
+  if ((fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+    return 1;
+  ring->fd = (int) fd;
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) /* no IORING_OP_READ */
+    goto close_fd;
+  ring->entries = params.sq_entries;
+  ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(wz_uint32_t);
+  ring->cq_len = params.cq_off.cqes +
+                 params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  if ((ring->sq = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, ring->fd,
+                       (off_t) IORING_OFF_SQ_RING)) == MAP_FAILED)
+    goto close_fd;
+  if ((ring->cq = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, ring->fd,
+                       (off_t) IORING_OFF_CQ_RING)) == MAP_FAILED)
+    goto unmap_sq;
+  if ((ptr.ptr = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, ring->fd,
+                      (off_t) IORING_OFF_SQES)) == MAP_FAILED)
+    goto unmap_cq;
+  ring->sqes = ptr.ptr;
+  ptr.ptr = ring->sq;
+  ptr.u8 += params.sq_off.head,         ring->sq_head  = ptr.u32;
+  ptr.ptr = ring->sq;
+  ptr.u8 += params.sq_off.tail,         ring->sq_tail  = ptr.u32;
+  ptr.ptr = ring->sq;
+  ptr.u8 += params.sq_off.array,        ring->sq_array = ptr.u32;
+  ptr.ptr = ring->sq;
+  ptr.u8 += params.sq_off.ring_mask,    ring->sq_mask  = * ptr.u32;
+  ptr.ptr = ring->cq;
+  ptr.u8 += params.cq_off.head,         ring->cq_head  = ptr.u32;
+  ptr.ptr = ring->cq;
+  ptr.u8 += params.cq_off.tail,         ring->cq_tail  = ptr.u32;
+  ptr.ptr = ring->cq;
+  ptr.u8 += params.cq_off.ring_mask,    ring->cq_mask  = * ptr.u32;
+  ptr.ptr = ring->cq;
+  ptr.u8 += params.cq_off.cqes,         ring->cqes     = ptr.cqe;
+  return 0;
+unmap_cq:
+  munmap(ring->cq, ring->cq_len);
+unmap_sq:
+  munmap(ring->sq, ring->sq_len);
+close_fd:
+  close(ring->fd);
+  return 1;
+}
+
+static int
+wz_free_ring(wzring * ring) {
+  int ret = 0;
+  if (munmap(ring->sqes, ring->sqes_len) ||
+      munmap(ring->cq, ring->cq_len) ||
+      munmap(ring->sq, ring->sq_len))
+    ret = 1;
+  if (close(ring->fd))
+    ret = 1;
+  return ret;
+}
+
+static void /* queue the rest of the request */
+wz_push_ring(wzring * ring, wzreq * req, wz_uint32_t i, int fd) {
+  wz_uint32_t tail = * ring->sq_tail;
+  wz_uint32_t idx = tail & ring->sq_mask;
+  struct io_uring_sqe * sqe = ring->sqes + idx;
+  memset(sqe, 0, sizeof(* sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (wz_uint64_t) (wz_uintptr_t) (req->bytes + req->read);
+  sqe->len = req->len - req->read;
+  sqe->off = req->pos + req->read;
+  sqe->user_data = i;
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int /* keep the queue full and take the completions as they arrive;
+              after an error, wait for the reads the kernel still owns */
+wz_read_ring(wzring * ring, wzreq * reqs, wz_uint32_t len, wzfile * file,
+             int (* done)(wzreq * req, wzfile * file)) {
+  wzstdio * stdio = file->io.user;
+  int fd = fileno(stdio->raw);
+  int err = 0;
+  wz_uint32_t next = 0;   /* the next request to push */
+  wz_uint32_t flight = 0; /* pushed but not completed */
+  wz_uint32_t queued = 0; /* pushed but not submitted */
+  while (flight || (!err && next < len)) {
+    wz_uint32_t head;
+    wz_uint32_t tail;
+    wz_uint64_t start;
+    long n;
+    for (; !err && next < len && flight < ring->entries; next++) {
+      wz_push_ring(ring, reqs + next, next, fd);
+      flight++, queued++;
+    }
+    if (err) { /* the queued ones are never submitted */
+      flight -= queued;
+      queued = 0;
+    }
+    start = wz_get_ns();
+    n = syscall(__NR_io_uring_enter, ring->fd, queued,
+                err ? flight : 1, IORING_ENTER_GETEVENTS, NULL, (size_t) 0);
+    wz_add_stat(&file->stats.ns, wz_get_ns() - start);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (!err)
+        wz_error("io_uring_enter failed: %d\n", errno);
+      err = 1; /* the completions are still posted to the ring */
+    } else {
+      queued -= (wz_uint32_t) n;
+    }
+    head = * ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe * cqe = ring->cqes + (head & ring->cq_mask);
+      wz_uint32_t i = (wz_uint32_t) cqe->user_data;
+      wzreq * req = reqs + i;
+      if (cqe->res <= 0 && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+        flight--, err = 1;
+        continue;
+      }
+      if (cqe->res > 0)
+        req->read += (wz_uint32_t) cqe->res;
+      if (req->read < req->len) { /* interrupted or short read */
+        if (err)
+          flight--;
+        else
+          wz_push_ring(ring, req, i, fd), queued++;
+        continue;
+      }
+      flight--;
+      if (done(req, file))
+        err = 1;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  if (err)
+    WZ_ERR_RET(err);
+  return 0;
+}
+#endif
+
+static int /* read the requests sorted by position and pass each to done */
+wz_read_batch(wzreq * reqs, wz_uint32_t len, wzfile * file,
+              int (* done)(wzreq * req, wzfile * file)) {
+  int ret;
+  wz_uint32_t i;
+#ifdef WZ_URING
+  wzring ring;
+#endif
+  if (!len)
+    return 0;
+#ifdef WZ_URING
+  if (file->map == NULL && file->io.read_at == wz_stdio_read_at &&
+      !wz_init_ring(&ring, WZ_URING_DEPTH)) {
+    ret = wz_read_ring(&ring, reqs, len, file, done);
+    if (wz_free_ring(&ring))
+      ret = 1;
+  } else
+#endif
+  ret = wz_read_pool(reqs, len, file, done);
+  for (i = 0; i < len; i++) /* in order, as if read by the parser */
+    if (reqs[i].read)
+      wz_count_read(reqs[i].read, reqs[i].pos, file);
+  return ret;
+}
+
+static void /* dst = src ^ key, 16 bytes at once if possible */
+wz_xor_key(wz_uint8_t * dst, const wz_uint8_t * src,
+           const wz_uint8_t * key, wz_uint32_t len) {
+  wz_uint32_t i = 0;
+#if defined(WZ_SSE2)
+  for (; i + 16 <= len; i += 16)
+    _mm_storeu_si128((__m128i *) (dst + i),
+                     _mm_xor_si128(_mm_loadu_si128((const __m128i *) (src + i)),
+                                   _mm_loadu_si128((const __m128i *) (key + i))));
+#elif defined(WZ_NEON)
+  for (; i + 16 <= len; i += 16)
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), vld1q_u8(key + i)));
+#endif
+  for (; i < len; i++)
+    dst[i] = src[i] ^ key[i];
+}
+
+static wz_uint8_t /* bytes ^= mask++ ^ key, without key if NULL */
+wz_xor_mask8(wz_uint8_t * bytes, const wz_uint8_t * key,
+             wz_uint32_t len, wz_uint8_t mask) {
+  wz_uint32_t i = 0;
+#if defined(WZ_SSE2)
+  __m128i mask_v = _mm_add_epi8(_mm_set1_epi8((char) mask),
+                                _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8,
+                                              9, 10, 11, 12, 13, 14, 15));
+  for (; i + 16 <= len; i += 16) {
+    __m128i * dst = (__m128i *) (bytes + i);
+    __m128i x = _mm_xor_si128(_mm_loadu_si128(dst), mask_v);
+    if (key != NULL)
+      x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *) (key + i)));
+    _mm_storeu_si128(dst, x);
+    mask_v = _mm_add_epi8(mask_v, _mm_set1_epi8(16));
+  }
+#elif defined(WZ_NEON)
+  static const wz_uint8_t steps[16] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+  };
+  uint8x16_t mask_v = vaddq_u8(vdupq_n_u8(mask), vld1q_u8(steps));
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t x = veorq_u8(vld1q_u8(bytes + i), mask_v);
+    if (key != NULL)
+      x = veorq_u8(x, vld1q_u8(key + i));
+    vst1q_u8(bytes + i, x);
+    mask_v = vaddq_u8(mask_v, vdupq_n_u8(16));
+  }
+#endif
+  mask = (wz_uint8_t) (mask + i);
+  if (key != NULL)
+    for (; i < len; i++)
+      bytes[i] ^= (wz_uint8_t) (mask++ ^ key[i]);
+  else
+    for (; i < len; i++)
+      bytes[i] ^= (wz_uint8_t) mask++;
+  return mask;
+}
+
+static wz_uint16_t /* units ^= mask++ ^ key, without key if NULL */
+wz_xor_mask16(wz_uint8_t * bytes, const wz_uint8_t * key,
+              wz_uint32_t len, wz_uint16_t mask) {
+  wzptr dst;
+  wzptr src;
+  wz_uint32_t i = 0;
+#if defined(WZ_SSE2) /* the lanes are little endian as the units */
+  __m128i mask_v = _mm_add_epi16(_mm_set1_epi16((short) mask),
+                                 _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+  for (; i + 8 <= len; i += 8) {
+    __m128i * dst_v = (__m128i *) (bytes + i * 2);
+    __m128i x = _mm_xor_si128(_mm_loadu_si128(dst_v), mask_v);
+    if (key != NULL)
+      x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *) (key + i * 2)));
+    _mm_storeu_si128(dst_v, x);
+    mask_v = _mm_add_epi16(mask_v, _mm_set1_epi16(8));
+  }
+#elif defined(WZ_NEON)
+  static const wz_uint16_t steps[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+  uint16x8_t mask_v = vaddq_u16(vdupq_n_u16(mask), vld1q_u16(steps));
+  for (; i + 8 <= len; i += 8) {
+    uint8x16_t x = veorq_u8(vld1q_u8(bytes + i * 2),
+                            vreinterpretq_u8_u16(mask_v));
+    if (key != NULL)
+      x = veorq_u8(x, vld1q_u8(key + i * 2));
+    vst1q_u8(bytes + i * 2, x);
+    mask_v = vaddq_u16(mask_v, vdupq_n_u16(8));
+  }
+#endif
+  mask = (wz_uint16_t) (mask + i);
+  dst.u8 = bytes;
+  src.c8 = key;
+  if (key != NULL)
+    for (; i < len; i++)
+      dst.u16[i] = WZ_HTOLE16(WZ_LE16TOH(dst.u16[i]) ^ mask++ ^
+                              WZ_LE16TOH(src.c16[i]));
+  else
+    for (; i < len; i++)
+      dst.u16[i] = WZ_HTOLE16(WZ_LE16TOH(dst.u16[i]) ^ mask++);
+  return mask;
+}
+
+static wz_uint32_t /* copy the leading ascii bytes, return how many */
+wz_copy_ascii8(wz_uint8_t * dst, const wz_uint8_t * src, wz_uint32_t len) {
+  wz_uint32_t i = 0; /* dst is NULL to count only */
+#if defined(WZ_SSE2)
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (src + i));
+    if (_mm_movemask_epi8(x))
+      break;
+    if (dst != NULL)
+      _mm_storeu_si128((__m128i *) (dst + i), x);
+  }
+#elif defined(WZ_NEON)
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t x = vld1q_u8(src + i);
+    uint64x2_t high = vreinterpretq_u64_u8(vandq_u8(x, vdupq_n_u8(0x80)));
+    if (vgetq_lane_u64(high, 0) | vgetq_lane_u64(high, 1))
+      break;
+    if (dst != NULL)
+      vst1q_u8(dst + i, x);
+  }
+#endif
+  for (; i < len && src[i] < 0x80; i++)
+    if (dst != NULL)
+      dst[i] = src[i];
+  return i;
+}
+
+static wz_uint32_t /* narrow the leading ascii units, return how many */
+wz_copy_ascii16(wz_uint8_t * dst, const wz_uint8_t * src, wz_uint32_t len) {
+  wz_uint32_t i = 0; /* dst is NULL to count only */
+#if defined(WZ_SSE2) /* the lanes are little endian as the units */
+  __m128i high = _mm_set1_epi16((short) 0xff80);
+  for (; i + 16 <= len; i += 16) {
+    __m128i lo = _mm_loadu_si128((const __m128i *) (src + i * 2));
+    __m128i hi = _mm_loadu_si128((const __m128i *) (src + i * 2 + 16));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+          _mm_and_si128(_mm_or_si128(lo, hi), high),
+          _mm_setzero_si128())) != 0xffff)
+      break;
+    if (dst != NULL)
+      _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+  }
+#elif defined(WZ_NEON)
+  for (; i + 16 <= len; i += 16) {
+    uint16x8_t lo = vreinterpretq_u16_u8(vld1q_u8(src + i * 2));
+    uint16x8_t hi = vreinterpretq_u16_u8(vld1q_u8(src + i * 2 + 16));
+    uint64x2_t high = vreinterpretq_u64_u16(
+      vandq_u16(vorrq_u16(lo, hi), vdupq_n_u16(0xff80)));
+    if (vgetq_lane_u64(high, 0) | vgetq_lane_u64(high, 1))
+      break;
+    if (dst != NULL)
+      vst1q_u8(dst + i, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+  }
+#endif
+  for (; i < len && src[i * 2] < 0x80 && !src[i * 2 + 1]; i++)
+    if (dst != NULL)
+      dst[i] = src[i * 2];
+  return i;
+}
+
+#if defined(WZ_NO_THRD)
+#  define WZ_LOAD_LEN(keys)       ((keys)->len)
+#  define WZ_STORE_LEN(keys, val) ((keys)->len = (val))
+#elif (defined(WZ_GCC) && WZ_GCC >= 40700) || defined(WZ_CLANG)
+#  define WZ_LOAD_LEN(keys) \
+    __atomic_load_n(&(keys)->len, __ATOMIC_ACQUIRE)
+#  define WZ_STORE_LEN(keys, val) \
+    __atomic_store_n(&(keys)->len, (val), __ATOMIC_RELEASE)
+#elif defined(WZ_MSVC) /* volatile accesses are acquire and release */
+#  define WZ_LOAD_LEN(keys)       (* (volatile size_t *) &(keys)->len)
+#  define WZ_STORE_LEN(keys, val) (* (volatile size_t *) &(keys)->len = (val))
+#else /* always check the length with the lock held */
+#  define WZ_LOAD_LEN(keys)       ((size_t) 0)
+#  define WZ_STORE_LEN(keys, val) ((keys)->len = (val))
+#endif
+
+enum {
+  WZ_KEY_CHUNK_LEN = 0x1000 /* bytes of each key expanded at once */
+};
+
+static void /* aes ofb */
+wz_encode_aes(wz_uint8_t * cipher, wz_uint32_t len,
+              wz_uint8_t * key, const wz_uint8_t * iv) {
+  aes256_context ctx;
+  wzptr cipher_c;
+  wzptr iv_c;
+  wz_uint32_t i;
+  wz_uint8_t j;
+  aes256_init(&ctx, key);
+  cipher_c.u8 = cipher;
+  iv_c.c8 = iv;
+  len >>= 4;
+  for (i = 0; i < len; i++) {
+    for (j = 0; j < 16 / 4; j++)
+      cipher_c.u32[j] = iv_c.c32[j];
+    aes256_encrypt_ecb(&ctx, cipher_c.u8);
+    iv_c = cipher_c, cipher_c.u8 += 16;
+  }
+  aes256_done(&ctx);
+}
+
+static wzkeys * /* the keys are expanded later by wz_get_key */
+wz_init_keys(const wz_uint32_t * ivs, const wz_uint8_t * aes_key) {
+  wzkeys * keys;
+  wz_uint8_t * bytes;
+  wz_uint8_t i;
+  if ((keys = malloc(sizeof(* keys))) == NULL)
+    WZ_ERR_RET(NULL);
+  if ((bytes = malloc(WZ_KEYS_LEN * WZ_KEY_UTF8_MAX_LEN +
+                      (WZ_KEY_EMPTY + 1) * WZ_KEY_ASCII_MAX_LEN * 2)) == NULL)
+    WZ_ERR_GOTO(free_keys);
+  if (wz_init_mutex(&keys->mutex))
+    WZ_ERR_GOTO(free_bytes);
+  keys->len = 0;
+  keys->bytes = bytes;
+  keys->ascii = keys->bytes + WZ_KEYS_LEN * WZ_KEY_UTF8_MAX_LEN;
+  keys->utf16 = keys->ascii + (WZ_KEY_EMPTY + 1) * WZ_KEY_ASCII_MAX_LEN;
+  for (i = 0; i < WZ_KEYS_LEN; i++)
+    keys->ivs[i] = ivs[i];
+  if (aes_key != NULL) {
+    memcpy(keys->aes_key, aes_key, sizeof(keys->aes_key));
+  } else { /* each byte of the default key is expanded to 4 bytes */
+    memset(keys->aes_key, 0, sizeof(keys->aes_key));
+    for (i = 0; i < 32 / 4; i++)
+      keys->aes_key[i * 4] = wz_aes_key[i];
+  }
+  keys->full = 0;
+  return keys;
+free_bytes:
+  free(bytes);
+free_keys:
+  free(keys);
+  return NULL;
+}
+
+static int
+wz_free_keys(wzkeys * keys) {
+  int ret = 0;
+  wzptr bytes;
+  if (wz_free_mutex(&keys->mutex))
+    ret = 1;
+  bytes.c8 = keys->bytes;
+  free(bytes.u8);
+  free(keys);
+  return ret;
+}
+
+static int /* expand every key to at least len bytes, once for all threads */
+wz_expand_keys(wzkeys * keys, wz_uint32_t len) {
+  int ret = 1;
+  wz_uint8_t aes_iv[16];
+  wzptr aes_iv_c;
+  wzptr bytes;
+  wz_uint32_t from;
+  wz_uint8_t i;
+  wz_uint8_t j;
+  if (len > WZ_KEY_UTF8_MAX_LEN)
+    WZ_ERR_RET(ret);
+  if (wz_lock_mutex(&keys->mutex))
+    WZ_ERR_RET(ret);
+  if ((from = (wz_uint32_t) keys->len) >= len) { /* by another thread */
+    ret = 0;
+    goto unlock;
+  }
+  len = (len + WZ_KEY_CHUNK_LEN - 1) & ~(wz_uint32_t) (WZ_KEY_CHUNK_LEN - 1);
+  aes_iv_c.u8 = aes_iv;
+  bytes.c8 = keys->bytes;
+  for (i = 0; i < WZ_KEYS_LEN; i++) {
+    wz_uint8_t * key = bytes.u8 + i * WZ_KEY_UTF8_MAX_LEN;
+    if (from) { /* ofb goes on from the last block */
+      memcpy(aes_iv, key + from - 16, 16);
+    } else {
+      wz_uint32_t aes_iv4 = WZ_HTOLE32(keys->ivs[i]);
+      for (j = 0; j < 16 / 4; j++)
+        aes_iv_c.u32[j] = aes_iv4;
+    }
+    wz_encode_aes(key + from, len - from, keys->aes_key, aes_iv);
+  }
+  if (from < WZ_KEY_ASCII_MAX_LEN) { /* combine the masks with the keys */
+    wz_uint32_t to = len < WZ_KEY_ASCII_MAX_LEN ? len : WZ_KEY_ASCII_MAX_LEN;
+    for (i = 0; i <= WZ_KEY_EMPTY; i++) {
+      const wz_uint8_t * key = i < WZ_KEYS_LEN ?
+        keys->bytes + i * WZ_KEY_UTF8_MAX_LEN + from : NULL;
+      wzptr ascii;
+      wzptr utf16;
+      ascii.c8 = keys->ascii + i * WZ_KEY_ASCII_MAX_LEN + from;
+      utf16.c8 = keys->utf16 + i * WZ_KEY_ASCII_MAX_LEN + from;
+      memset(ascii.u8, 0, to - from);
+      (void) wz_xor_mask8(ascii.u8, key, to - from,
+                          (wz_uint8_t) (0xaa + from));
+      memset(utf16.u8, 0, to - from);
+      (void) wz_xor_mask16(utf16.u8, key, (to - from) >> 1,
+                           (wz_uint16_t) (0xaaaa + (from >> 1)));
+    }
+  }
+  WZ_STORE_LEN(keys, len);
+  ret = 0;
+unlock:
+  if (wz_unlock_mutex(&keys->mutex))
+    ret = 1;
+  return ret;
+}
+
+#ifdef WZ_RUNTIME_KEYS
+static wzkeys * wz_keys_shared; /* by every wzctx of the process */
+static size_t   wz_keys_refs;
+#ifndef WZ_NO_THRD
+# ifdef WZ_WINDOWS
+static volatile LONG wz_keys_busy; /* no static mutex before vista */
+# else
+static pthread_mutex_t wz_keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+# endif
+#endif
 
-#ifdef WZ_MSVC
-#  define WZ_ONCE \
-    __pragma(warning(push)) \
-    __pragma(warning(disable: 4127)) \
-    while (0) \
-    __pragma(warning(pop))
+static int
+wz_lock_shared(void) {
+#if defined(WZ_NO_THRD)
+  return 0;
+#elif defined(WZ_WINDOWS)
+  while (InterlockedCompareExchange(&wz_keys_busy, 1, 0))
+    Sleep(0);
+  return 0;
 #else
-#  define WZ_ONCE while (0)
+  return pthread_mutex_lock(&wz_keys_mutex) != 0;
 #endif
-#define WZ_ERR \
-    fprintf(stderr, "Error: %s at %s:%d\n", __func__, __FILE__, __LINE__)
-#define WZ_ERR_GOTO(x) do { WZ_ERR; goto x; } WZ_ONCE
-#define WZ_ERR_RET(x) do { WZ_ERR; return x; } WZ_ONCE
-/*
-#define malloc(x) \
-    (printf("malloc(%zu) at %s:%s:%d\n", \
-            (size_t) x, __func__, __FILE__, __LINE__), \
-     malloc(x))
-#define realloc(ptr, x) \
-    (printf("realloc(%p, %zu) at %s:%s:%d\n", \
-            (void *) ptr, (size_t) x, __func__, __FILE__, __LINE__), \
-     realloc(ptr, x))
-#define free(ptr) \
-    (printf("free(%p) at %s:%s:%d\n", \
-            (void *) ptr, __func__, __FILE__, __LINE__), \
-     free(ptr))
-*/
+}
 
 static void
-wz_error(const char * format, ...) {
-  va_list args;
-  va_start(args, format);
-  fprintf(stderr, "Error: ");
-  vfprintf(stderr, format, args);
-  va_end(args);
+wz_unlock_shared(void) {
+#if defined(WZ_NO_THRD)
+#elif defined(WZ_WINDOWS)
+  InterlockedExchange(&wz_keys_busy, 0);
+#else
+  (void) pthread_mutex_unlock(&wz_keys_mutex); /* locked by this thread */
+#endif
 }
 
-static int
-wz_read_bytes(void * bytes, wz_uint32_t len, wzfile * file) {
-  if (len > file->size - file->pos) WZ_ERR_RET(1);
-  if (!len) return 0;
-  if (fread(bytes, len, 1, file->raw) != 1) WZ_ERR_RET(1);
-  return file->pos += len, 0;
+static wzkeys * /* the shared keys, created by the first holder */
+wz_hold_keys(void) {
+  wzkeys * keys = NULL;
+  if (wz_lock_shared())
+    WZ_ERR_RET(keys);
+  if (wz_keys_shared == NULL &&
+      (wz_keys_shared = wz_init_keys(wz_aes_ivs, NULL)) == NULL)
+    WZ_ERR_GOTO(unlock);
+  wz_keys_refs++;
+  keys = wz_keys_shared;
+unlock:
+  wz_unlock_shared();
+  return keys;
 }
 
-static int
-wz_read_byte(wz_uint8_t * byte, wzfile * file) {
-  if (1 > file->size - file->pos) WZ_ERR_RET(1);
-  if (fread(byte, 1, 1, file->raw) != 1) WZ_ERR_RET(1);
-  return file->pos += 1, 0;
+static int /* the shared keys, freed by the last holder */
+wz_drop_keys(wzkeys * keys) {
+  int ret = 0;
+  if (wz_lock_shared())
+    WZ_ERR_RET(1);
+  assert(keys == wz_keys_shared && wz_keys_refs);
+  if (!--wz_keys_refs) {
+    ret = wz_free_keys(keys);
+    wz_keys_shared = NULL;
+  }
+  wz_unlock_shared();
+  return ret;
 }
+#else
+static wzkeys wz_keys_gen = { /* generated by gen_keys */
+  WZ_KEY_UTF8_MAX_LEN, wz_keys, wz_keys_ascii, wz_keys_utf16,
+  {0}, {0}, 1, {0},
+# if defined(WZ_NO_THRD)
+  {{0}}
+# elif defined(WZ_WINDOWS)
+  {NULL}
+# else
+  {PTHREAD_MUTEX_INITIALIZER}
+# endif
+};
 
-static int
-wz_read_le16(wz_uint16_t * le16, wzfile * file) {
-  if (2 > file->size - file->pos) WZ_ERR_RET(1);
-  if (fread(le16, 2, 1, file->raw) != 1) WZ_ERR_RET(1);
-  * le16 = WZ_LE16TOH(* le16);
-  return file->pos += 2, 0;
+static wzkeys *
+wz_hold_keys(void) {
+  return &wz_keys_gen; /* shared read-only pages of the library */
 }
 
 static int
-wz_read_le32(wz_uint32_t * le32, wzfile * file) {
-  if (4 > file->size - file->pos) WZ_ERR_RET(1);
-  if (fread(le32, 4, 1, file->raw) != 1) WZ_ERR_RET(1);
-  * le32 = WZ_LE32TOH(* le32);
-  return file->pos += 4, 0;
+wz_drop_keys(wzkeys * keys) {
+  (void) keys;
+  return 0;
 }
+#endif
 
-static int
-wz_read_le64(wz_uint64_t * le64, wzfile * file) {
-  if (8 > file->size - file->pos) WZ_ERR_RET(1);
-  if (fread(le64, 8, 1, file->raw) != 1) WZ_ERR_RET(1);
-  * le64 = WZ_LE64TOH(* le64);
-  return file->pos += 8, 0;
+static const wz_uint8_t * /* the i th key with at least len bytes */
+wz_get_key(wzkeys * keys, wz_uint8_t i, wz_uint32_t len) {
+  if (!keys->full && len > WZ_LOAD_LEN(keys) && wz_expand_keys(keys, len))
+    WZ_ERR_RET(NULL);
+  return keys->bytes + i * WZ_KEY_UTF8_MAX_LEN;
 }
 
-static int /* read packed integer (int8 or int32) */
-wz_read_int32(wz_uint32_t * int32, wzfile * file) {
-  wz_int8_t byte;
-  if (wz_read_byte((wz_uint8_t *) &byte, file)) WZ_ERR_RET(1);
-  if (byte == WZ_INT8_MIN) return wz_read_le32(int32, file);
-  return * (wz_int32_t *) int32 = byte, 0;
+static const wz_uint8_t * /* the mask ^ i th key with at least len bytes */
+wz_get_mask(wzkeys * keys, wz_uint8_t i, wz_uint8_t enc, wz_uint32_t len) {
+  if (!keys->full && len > WZ_LOAD_LEN(keys) && wz_expand_keys(keys, len))
+    WZ_ERR_RET(NULL);
+  return (enc == WZ_ENC_CP1252 ? keys->ascii : keys->utf16) +
+    i * WZ_KEY_ASCII_MAX_LEN;
 }
 
-static int /* read packed long (int8 or int64) */
-wz_read_int64(wz_uint64_t * int64, wzfile * file) {
-  wz_int8_t byte;
-  if (wz_read_byte((wz_uint8_t *) &byte, file)) WZ_ERR_RET(1);
-  if (byte == WZ_INT8_MIN) return wz_read_le64(int64, file);
-  return * (wz_int64_t *) int64 = byte, 0;
+static wz_uint8_t /* the high bits of the first 8 bytes, 0 if printable */
+wz_print_name(const wz_uint8_t * bytes, wz_uint32_t len) {
+  wz_uint8_t print = 0;
+  wz_uint8_t i;
+  for (i = 0; i < len && i < 8; i++)
+    print = (wz_uint8_t) (print | (bytes[i] >> 7) << i);
+  return print;
 }
 
-static int
-wz_seek(wz_uint32_t pos, int origin, wzfile * file) {
-  switch (origin) {
-  case SEEK_CUR:
-    if (pos > file->size - file->pos)
-      WZ_ERR_RET(1);
-    if (fseek(file->raw, pos, origin))
-      WZ_ERR_RET(1);
-    file->pos += pos;
-    break;
-  case SEEK_SET:
-    if (pos > file->size)
-      WZ_ERR_RET(1);
-    if (fseek(file->raw, pos, origin))
+static int /* the fingerprints of every key, taken once for all files */
+wz_init_profile(wzprofile * profile, wzkeys * keys) {
+  wz_uint8_t i;
+  for (i = 0; i <= WZ_KEY_EMPTY; i++) {
+    const wz_uint8_t * mask;
+    if ((mask = wz_get_mask(keys, i, WZ_ENC_CP1252, 8)) == NULL)
       WZ_ERR_RET(1);
-    file->pos = pos;
-    break;
-  default:
-    WZ_ERR_RET(1);
+    profile->prints[i] = wz_print_name(mask, 8);
   }
+  profile->keys = keys;
   return 0;
 }
 
@@ -482,7 +2131,13 @@ wz_cp1252_to_utf8(wz_uint8_t * ret_u8, wz_uint32_t * ret_u8_len,
                   const wz_uint8_t * cp1252, wz_uint32_t cp1252_len) {
   wz_uint8_t * u8 = ret_u8 == NULL ? 0 : ret_u8;
   for (; cp1252_len; cp1252_len--) {
-    wz_uint16_t code = * cp1252++;
+    wz_uint16_t code;
+    wz_uint32_t ascii = wz_copy_ascii8(ret_u8 == NULL ? NULL : u8,
+                                       cp1252, cp1252_len);
+    u8 += ascii, cp1252 += ascii;
+    if (!(cp1252_len -= ascii))
+      break;
+    code = * cp1252++;
     if (code >= 0x80)
       code = wz_cp1252_to_unicode[code - 0x80];
     if (code < 0x80) {
@@ -506,10 +2161,13 @@ wz_cp1252_to_utf8(wz_uint8_t * ret_u8, wz_uint32_t * ret_u8_len,
       WZ_ERR_RET(1);
     }
   }
-  if (ret_u8 == NULL)
+  if (ret_u8 == NULL) {
     * ret_u8_len = (wz_uint32_t) (wz_uintptr_t) u8;
-  else
+  } else {
     * u8 = '\0';
+    if (ret_u8_len != NULL)
+      * ret_u8_len = (wz_uint32_t) (u8 - ret_u8);
+  }
   return 0;
 }
 
@@ -519,6 +2177,11 @@ wz_utf16le_to_utf8(wz_uint8_t * ret_u8, wz_uint32_t * ret_u8_len,
   wz_uint8_t * u8 = ret_u8 == NULL ? 0 : ret_u8;
   while (u16_len) {
     wz_uint32_t code; /* unicode */
+    wz_uint32_t ascii = wz_copy_ascii16(ret_u8 == NULL ? NULL : u8,
+                                        u16, u16_len >> 1);
+    u8 += ascii, u16 += ascii * 2, u16_len -= ascii * 2;
+    if (!u16_len)
+      break;
     if (u16_len < 2)
       WZ_ERR_RET(1);
     if ((u16[1] & 0xfc) == 0xd8) {
@@ -569,64 +2232,51 @@ wz_utf16le_to_utf8(wz_uint8_t * ret_u8, wz_uint32_t * ret_u8_len,
       WZ_ERR_RET(1);
     }
   }
-  if (ret_u8 == NULL)
+  if (ret_u8 == NULL) {
     * ret_u8_len = (wz_uint32_t) (wz_uintptr_t) u8;
-  else
+  } else {
     * u8 = '\0';
+    if (ret_u8_len != NULL)
+      * ret_u8_len = (wz_uint32_t) (u8 - ret_u8);
+  }
   return 0;
 }
 
 static int
 wz_decode_chars(wz_uint8_t * bytes, wz_uint32_t len,
-                wz_uint8_t key_i, const wz_uint8_t * keys, wz_uint8_t enc) {
+                wz_uint8_t key_i, wzkeys * keys, wz_uint8_t enc) {
   wz_uint32_t min_len;
-  wzptr key;
-  wzptr dst;
-  wz_uint8_t mask_8;
-  wz_uint16_t mask_16;
-  wz_uint32_t i;
+  const wz_uint8_t * mask;
+  const wz_uint8_t * key;
   if (enc == WZ_ENC_CP1252) {
-    if (key_i == WZ_KEY_EMPTY) {
-      min_len = 0;
-      key.c8 = NULL;
-    } else {
-      if (len <= WZ_KEY_ASCII_MAX_LEN)
-        min_len = len;
-      else
-        min_len = WZ_KEY_ASCII_MAX_LEN;
-      key.c8 = keys + key_i * WZ_KEY_UTF8_MAX_LEN;
-    }
-    mask_8 = 0xaa;
-    for (i = 0; i < min_len; i++)
-      bytes[i] ^= (wz_uint8_t) (mask_8++ ^ key.c8[i]);
-    for (i = min_len; i < len; i++)
-      bytes[i] ^= (wz_uint8_t) mask_8++;
+    if (len <= WZ_KEY_ASCII_MAX_LEN)
+      min_len = len;
+    else
+      min_len = WZ_KEY_ASCII_MAX_LEN;
+    if ((mask = wz_get_mask(keys, key_i, enc, min_len)) == NULL)
+      WZ_ERR_RET(1);
+    wz_xor_key(bytes, bytes, mask, min_len);
+    (void) wz_xor_mask8(bytes + min_len, NULL, len - min_len,
+                        (wz_uint8_t) (0xaa + min_len));
   } else if (enc == WZ_ENC_UTF16LE) {
-    dst.u8 = bytes;
-    if (key_i == WZ_KEY_EMPTY) {
-      len >>= 1;
-      min_len = 0;
-      key.c8 = NULL;
-    } else {
-      if (len > WZ_KEY_ASCII_MAX_LEN)
-        WZ_ERR_RET(1);
-      len >>= 1;
+    if (key_i != WZ_KEY_EMPTY && len > WZ_KEY_ASCII_MAX_LEN)
+      WZ_ERR_RET(1);
+    len >>= 1;
+    if (len <= WZ_KEY_ASCII_MAX_LEN >> 1)
       min_len = len;
-      key.c8 = keys + key_i * WZ_KEY_UTF8_MAX_LEN;
-    }
-    mask_16 = 0xaaaa;
-    for (i = 0; i < min_len; i++)
-      dst.u16[i] = WZ_HTOLE16(WZ_LE16TOH(dst.u16[i]) ^ mask_16++ ^
-                              WZ_LE16TOH(key.c16[i]));
-    for (i = min_len; i < len; i++)
-      dst.u16[i] = WZ_HTOLE16(WZ_LE16TOH(dst.u16[i]) ^ mask_16++);
+    else
+      min_len = WZ_KEY_ASCII_MAX_LEN >> 1;
+    if ((mask = wz_get_mask(keys, key_i, enc, min_len << 1)) == NULL)
+      WZ_ERR_RET(1);
+    wz_xor_key(bytes, bytes, mask, min_len << 1);
+    (void) wz_xor_mask16(bytes + (min_len << 1), NULL, len - min_len,
+                         (wz_uint16_t) (0xaaaa + min_len));
   } else {
     assert(enc == WZ_ENC_UTF8);
-    if (len > WZ_KEY_UTF8_MAX_LEN)
+    if (len > WZ_KEY_UTF8_MAX_LEN ||
+        (key = wz_get_key(keys, key_i, len)) == NULL)
       WZ_ERR_RET(1);
-    key.c8 = keys + key_i * WZ_KEY_UTF8_MAX_LEN;
-    for (i = 0; i < len; i++)
-      bytes[i] ^= key.c8[i];
+    wz_xor_key(bytes, bytes, key, len);
   }
   return 0;
 }
@@ -642,23 +2292,28 @@ static int (* const wz_to_utf8[])(wz_uint8_t *, wz_uint32_t *,
 static int /* read characters (cp1252, utf16le, or utf8) */
 wz_read_chars(wz_uint8_t ** ret_bytes, wz_uint32_t * ret_len,
               wz_uint8_t * ret_enc,
-              wz_uint32_t capa, wz_uint32_t addr, wz_uint8_t type,
-              wz_uint8_t key, wz_uint8_t * keys, wzfile * file) {
+              wz_uint32_t capa, wz_uint64_t addr, wz_uint8_t type,
+              wz_uint8_t key, wzkeys * keys, wzcur * cur) {
   int ret = 1;
   wz_uint8_t enc = WZ_ENC_AUTO;
-  wz_uint32_t pos = 0;
+  wz_uint64_t pos = 0;
   wz_uint8_t padding = 0;
   wz_int8_t byte;
   wz_uint32_t len;
   wz_uint8_t * bytes_ptr;
   wz_uint8_t * bytes;
+  int (* to)(wz_uint8_t *, wz_uint32_t *, const wz_uint8_t *, wz_uint32_t);
+  wz_uint8_t   utf8_buf[WZ_UINT8_MAX * 3 + 1]; /* any name in cp1252 */
   wz_uint8_t * utf8_ptr;
+  wz_uint8_t * utf8;
   wz_uint32_t  utf8_len;
+  wz_uint64_t  ref = 0; /* position of the string referenced */
+  wzrefs *     refs = cur->file->refs;
   if (type != WZ_LV0_NAME) {
     wz_uint8_t fmt;
     enum {UNK = 2};
     wz_uint8_t inplace;
-    if (wz_read_byte(&fmt, file))
+    if (wz_read_byte(&fmt, cur))
       WZ_ERR_RET(ret);
     inplace = UNK;
     switch (type) {
@@ -693,10 +2348,11 @@ wz_read_chars(wz_uint8_t ** ret_bytes, wz_uint32_t * ret_len,
                       (wz_uint32_t) fmt), ret;
     if (!inplace) {
       wz_uint32_t offset;
-      if (wz_read_le32(&offset, file))
+      if (wz_read_le32(&offset, cur))
         WZ_ERR_RET(ret);
-      pos = file->pos;
-      if (wz_seek(addr + offset, SEEK_SET, file))
+      pos = cur->pos;
+      ref = addr + offset;
+      if (wz_seek(ref, SEEK_SET, cur))
         WZ_ERR_RET(ret);
     }
     if (type == WZ_LV1_STR) {
@@ -707,12 +2363,29 @@ wz_read_chars(wz_uint8_t ** ret_bytes, wz_uint32_t * ret_len,
       key = 1;
       padding = sizeof(wz_uint32_t);
     }
+    if (ref && refs != NULL) { /* decoded already by the other reference */
+      wz_uint8_t found;
+      if (wz_get_ref(&found, utf8_buf, &utf8_len, &enc, ref, key, refs))
+        WZ_ERR_RET(ret);
+      if (found) {
+        if (capa) {
+          if (utf8_len >= capa)
+            WZ_ERR_RET(ret);
+          bytes_ptr = * ret_bytes;
+        } else {
+          if ((bytes_ptr = malloc(padding + utf8_len + 1)) == NULL)
+            WZ_ERR_RET(ret);
+        }
+        memcpy(bytes_ptr + padding, utf8_buf, utf8_len + 1);
+        goto seek_back;
+      }
+    }
   }
-  if (wz_read_byte((wz_uint8_t *) &byte, file))
+  if (wz_read_byte((wz_uint8_t *) &byte, cur))
     WZ_ERR_RET(ret);
   if (byte <= 0) { /* cp1252/ascii/utf8 */
     if (byte == WZ_INT8_MIN) {
-      if (wz_read_le32(&len, file))
+      if (wz_read_le32(&len, cur))
         WZ_ERR_RET(ret);
     } else {
       len = (wz_uint32_t) -byte;
@@ -721,7 +2394,7 @@ wz_read_chars(wz_uint8_t ** ret_bytes, wz_uint32_t * ret_len,
       enc = WZ_ENC_CP1252;
   } else { /* utf16-le */
     if (byte == WZ_INT8_MAX) {
-      if (wz_read_le32(&len, file))
+      if (wz_read_le32(&len, cur))
         WZ_ERR_RET(ret);
     } else {
       len = (wz_uint32_t) byte;
@@ -730,70 +2403,78 @@ wz_read_chars(wz_uint8_t ** ret_bytes, wz_uint32_t * ret_len,
     if (enc == WZ_ENC_AUTO)
       enc = WZ_ENC_UTF16LE;
   }
-  if (capa) {
-    if (len >= capa)
-      WZ_ERR_RET(ret);
-    bytes_ptr = * ret_bytes;
+  if (capa && len >= capa)
+    WZ_ERR_RET(ret);
+  if (key == 0xff || (to = wz_to_utf8[enc]) == NULL) { /* kept as read */
+    if (capa) {
+      bytes_ptr = * ret_bytes;
+    } else {
+      if (len > WZ_INT32_MAX)
+        WZ_ERR_RET(ret);
+      if ((bytes_ptr = malloc(padding + len + 1)) == NULL)
+        WZ_ERR_RET(ret);
+    }
+    bytes = bytes_ptr + padding;
+    if (wz_read_bytes(bytes, len, cur))
+      WZ_ERR_GOTO(free_bytes_ptr);
+    bytes[len] = '\0';
+    if (key != 0xff && wz_decode_chars(bytes, len, key, keys, enc))
+      WZ_ERR_GOTO(free_bytes_ptr);
+    utf8_len = len;
   } else {
-    if (len > WZ_INT32_MAX)
+    /* The characters are read to the tail of a buffer of the worst size,
+       then converted to its head in one pass, where the output never
+       overtakes the input. A short string is converted on the stack and
+       copied to the buffer of the exact size, and a long one is converted
+       in the heap, which is shrunk then */
+    wz_uint32_t worst = enc == WZ_ENC_CP1252 ? len * 3 : (len + 1) / 2 * 3;
+    wz_uint8_t * raw;
+    if (len > WZ_INT32_MAX / 3)
       WZ_ERR_RET(ret);
-    if ((bytes_ptr = malloc(padding + len + 1)) == NULL)
-      WZ_ERR_RET(ret);
-  }
-  utf8_ptr = NULL;
-  bytes = bytes_ptr + padding;
-  if (wz_read_bytes(bytes, len, file))
-    WZ_ERR_GOTO(free_bytes_ptr);
-  bytes[len] = '\0';
-  utf8_len = 0;
-  if (key != 0xff) {
-    int (* to)(wz_uint8_t *, wz_uint32_t *, const wz_uint8_t *, wz_uint32_t);
-    if (wz_decode_chars(bytes, len, key, keys, enc))
-      WZ_ERR_GOTO(free_bytes_ptr);
-    if ((to = wz_to_utf8[enc]) != NULL) {
-      wz_uint8_t   utf8_buf[256];
-      wz_uint8_t * utf8;
-      if (to(NULL, &utf8_len, bytes, len))
-        WZ_ERR_GOTO(free_bytes_ptr);
-      if (capa && (utf8_len >= capa))
-        WZ_ERR_GOTO(free_bytes_ptr);
-      if (utf8_len < sizeof(utf8_buf) && (utf8_len <= len || capa)) {
-        utf8 = utf8_buf;
-      } else { /* malloc new string only if capa == 0 && utf8_len > len */
-        if ((utf8_ptr = malloc(padding + utf8_len + 1)) == NULL)
-          WZ_ERR_GOTO(free_bytes_ptr);
-        utf8 = utf8_ptr + padding;
-      }
-      if (to(utf8, NULL, bytes, len))
-        WZ_ERR_GOTO(free_utf8_ptr);
-      if (utf8_len <= len || capa) {
-        wz_uint32_t i;
-        for (i = 0; i < utf8_len; i++)
-          bytes[i] = utf8[i];
-        bytes[utf8_len] = '\0';
-        if (utf8_ptr != NULL) {
-          free(utf8_ptr);
-          utf8_ptr = NULL;
-        }
-      }
+    if (worst < sizeof(utf8_buf)) {
+      utf8_ptr = NULL;
+      utf8 = utf8_buf;
+    } else {
+      if ((utf8_ptr = malloc(padding + worst + 1)) == NULL)
+        WZ_ERR_RET(ret);
+      utf8 = utf8_ptr + padding;
+    }
+    raw = utf8 + worst - len;
+    if (wz_read_bytes(raw, len, cur) ||
+        wz_decode_chars(raw, len, key, keys, enc) ||
+        to(utf8, &utf8_len, raw, len) ||
+        (capa && utf8_len >= capa))
+      WZ_ERR_GOTO(free_utf8_ptr);
+    if (capa) {
+      bytes_ptr = * ret_bytes;
+      memcpy(bytes_ptr + padding, utf8, utf8_len + 1);
+    } else if (utf8_ptr != NULL) {
+      if ((bytes_ptr = realloc(utf8_ptr, padding + utf8_len + 1)) == NULL)
+        bytes_ptr = utf8_ptr; /* keep the larger one */
+      utf8_ptr = NULL;
+    } else {
+      if ((bytes_ptr = malloc(padding + utf8_len + 1)) == NULL)
+        WZ_ERR_RET(ret);
+      memcpy(bytes_ptr + padding, utf8, utf8_len + 1);
     }
   }
-  if (pos && wz_seek(pos, SEEK_SET, file))
-    WZ_ERR_GOTO(free_utf8_ptr);
-  if (utf8_ptr != NULL) {
-    * ret_bytes = utf8_ptr;
-  } else if (!capa) {
+  if (ref && refs != NULL &&
+      wz_put_ref(bytes_ptr + padding, utf8_len, enc, ref, key, refs))
+    WZ_ERR_GOTO(free_bytes_ptr);
+seek_back:
+  if (pos && wz_seek(pos, SEEK_SET, cur))
+    WZ_ERR_GOTO(free_bytes_ptr);
+  if (!capa)
     * ret_bytes = bytes_ptr;
-  }
-  * ret_len = utf8_len ? utf8_len : len;
+  * ret_len = utf8_len;
   if (ret_enc != NULL)
     * ret_enc = enc;
-  ret = 0;
+  return 0;
 free_utf8_ptr:
-  if (ret && utf8_ptr != NULL)
-    free(utf8_ptr);
+  free(utf8_ptr);
+  return ret;
 free_bytes_ptr:
-  if ((ret || utf8_ptr != NULL) && !capa)
+  if (!capa)
     free(bytes_ptr);
   return ret;
 }
@@ -804,102 +2485,291 @@ wz_free_chars(wz_uint8_t * bytes) {
 }
 
 static void
-wz_decode_addr(wz_uint32_t * ret_val, wz_uint32_t val, wz_uint32_t pos,
-               wz_uint32_t start, wz_uint32_t hash) {
+wz_decode_addr(wz_uint32_t * ret_val, wz_uint32_t val, wz_uint64_t pos,
+               wz_uint64_t start, wz_uint32_t hash) {
   wz_uint32_t key = 0x581c3f6d;
-  wz_uint32_t x = ~(pos - start) * hash - key;
+  wz_uint32_t x = ~(wz_uint32_t) (pos - start) * hash - key;
   wz_uint32_t n = x & 0x1f;
   x = (x << n) | (x >> (32 - n)); /* rotate left n bit */
-  * ret_val = (x ^ val) + start * 2;
+  * ret_val = (x ^ val) + (wz_uint32_t) start * 2; /* 32-bit in the format */
 }
 
-static int
-wz_read_lv0(wznode * node, wzfile * file, wz_uint8_t * keys) {
+#if defined(WZ_SSE2)
+static __m128i /* the low halves of a * b, no 32-bit mullo in sse2 */
+wz_mullo_sse2(__m128i a, __m128i b) {
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static __m128i /* rotate left x by its low 5 bits, lane by lane */
+wz_rotl_sse2(__m128i x) {
+  /* 2 ^ n by the exponent of a float, where 2 ^ 31 converts to the integer
+     indefinite 0x80000000, then or the high and the low half of x * 2 ^ n */
+  __m128i pow = _mm_and_si128(x, _mm_set1_epi32(0x1f));
+  __m128i even;
+  __m128i odd;
+  pow = _mm_cvttps_epi32(_mm_castsi128_ps(
+    _mm_slli_epi32(_mm_add_epi32(pow, _mm_set1_epi32(127)), 23)));
+  even = _mm_mul_epu32(x, pow);
+  odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), _mm_srli_epi64(pow, 32));
+  even = _mm_or_si128(even, _mm_srli_epi64(even, 32));
+  odd = _mm_or_si128(odd, _mm_srli_epi64(odd, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+static void /* vals at start + offs decoded by wz_decode_addr, 4 at once */
+wz_decode_addrs(wz_uint32_t * vals, const wz_uint32_t * offs,
+                wz_uint32_t len, wz_uint64_t start, wz_uint32_t hash) {
+  wz_uint32_t i = 0;
+#if defined(WZ_SSE2)
+  __m128i hash_v = _mm_set1_epi32((int) hash);
+  __m128i key_v = _mm_set1_epi32(0x581c3f6d);
+  __m128i start_v = _mm_set1_epi32((int) ((wz_uint32_t) start * 2));
+  for (; i + 4 <= len; i += 4) {
+    __m128i * dst = (__m128i *) (vals + i);
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (offs + i)),
+                              _mm_set1_epi32(-1));
+    x = wz_rotl_sse2(_mm_sub_epi32(wz_mullo_sse2(x, hash_v), key_v));
+    x = _mm_add_epi32(_mm_xor_si128(x, _mm_loadu_si128(dst)), start_v);
+    _mm_storeu_si128(dst, x);
+  }
+#elif defined(WZ_NEON)
+  uint32x4_t hash_v = vdupq_n_u32(hash);
+  uint32x4_t key_v = vdupq_n_u32(0x581c3f6d);
+  uint32x4_t start_v = vdupq_n_u32((wz_uint32_t) start * 2);
+  for (; i + 4 <= len; i += 4) {
+    uint32x4_t x = vsubq_u32(vmulq_u32(vmvnq_u32(vld1q_u32(offs + i)),
+                                       hash_v), key_v);
+    int32x4_t n = vreinterpretq_s32_u32(vandq_u32(x, vdupq_n_u32(0x1f)));
+    x = vorrq_u32(vshlq_u32(x, n), /* negative n shifts right */
+                  vshlq_u32(x, vsubq_s32(n, vdupq_n_s32(32))));
+    vst1q_u32(vals + i, vaddq_u32(veorq_u32(x, vld1q_u32(vals + i)),
+                                  start_v));
+  }
+#endif
+  for (; i < len; i++)
+    wz_decode_addr(vals + i, vals[i], start + offs[i], start, hash);
+}
+
+enum {
+  WZ_LV0_ENTRY_LEN = 32,  /* bytes of an entry, to size the window */
+  WZ_LV0_ENTRY_MAX = 1 + 4 + 5 + WZ_UINT8_MAX + 5 + 5 + 4, /* at most */
+  WZ_LV0_WIN_MAX   = 0x100000, /* bytes of the window read at once */
+  WZ_LV0_LINKS_LEN = 8    /* names of the links decoded lately */
+};
+
+typedef struct { /* the type and name which a lv0 link points to */
+  wz_uint32_t  offset;
+  wz_uint8_t   type; /* 0 if the slot is empty */
+  wz_uint8_t   name_len;
+  wz_uint8_t   name[WZ_UINT8_MAX];
+  wz_uint8_t   _[3]; /* padding */
+} wzlink;
+
+static int /* read the next entries of a directory at pos in one read */
+wz_load_lv0(wzfile * win, wz_uint64_t pos, wz_uint32_t entries,
+            wzfile * file) {
+  wz_uint64_t len = (wz_uint64_t) entries * WZ_LV0_ENTRY_LEN +
+                    WZ_LV0_ENTRY_MAX;
+  wzptr map;
+  if (pos > file->size)
+    WZ_ERR_RET(1);
+  if (len > WZ_LV0_WIN_MAX)
+    len = WZ_LV0_WIN_MAX;
+  if (len > file->size - pos)
+    len = file->size - pos;
+  map.c8 = win->map;
+  free(map.u8);
+  win->map = NULL;
+  if ((map.u8 = malloc((size_t) len + 1)) == NULL)
+    WZ_ERR_RET(1);
+  win->map = map.c8;
+  win->size = len;
+  win->start = pos; /* where the window is in the file */
+  if (!len)
+    return 0;
+  if (wz_read_at(map.u8, (wz_uint32_t) len, pos, file))
+    WZ_ERR_RET(1);
+  return 0;
+}
+
+static int /* the type and name at offset, decoded once for every link */
+wz_read_link(wzlink ** ret_link, wzlink * links, wz_uint32_t offset,
+             wz_uint8_t key, wzkeys * keys, wzfile * win, wzfile * file) {
+  wzlink * link = links + offset % WZ_LV0_LINKS_LEN;
+  wz_uint64_t pos = file->start + offset;
+  wz_uint8_t * name = link->name;
+  wz_uint32_t name_len;
+  wzcur cur;
+  if (link->type && link->offset == offset)
+    return * ret_link = link, 0;
+  if (win != NULL && pos >= win->start && pos - win->start < win->size &&
+      (win->size - (pos - win->start) >= WZ_LV0_ENTRY_MAX ||
+       win->start + win->size >= file->size)) {
+    cur.file = win; /* the whole entry is in the window */
+    cur.pos = pos - win->start;
+  } else {
+    cur.file = file;
+    cur.pos = 0;
+    if (wz_seek(pos, SEEK_SET, &cur))
+      WZ_ERR_RET(1);
+  }
+  link->type = 0;
+  if (wz_read_byte(&link->type, &cur))
+    WZ_ERR_RET(1);
+  if (WZ_IS_LV0_ARY(link->type) ||
+      WZ_IS_LV0_OBJ(link->type)) {
+    if (wz_read_chars(&name, &name_len, NULL, sizeof(link->name),
+                      0, WZ_LV0_NAME, key, keys, &cur)) {
+      link->type = 0;
+      WZ_ERR_RET(1);
+    }
+    link->name_len = (wz_uint8_t) name_len;
+  }
+  link->offset = offset;
+  return * ret_link = link, 0;
+}
+
+static int /* the entries are parsed in a window of the file, then every
+              address is decoded at once */
+wz_read_lv0(wznode * node, wzfile * file, wzkeys * keys) {
   int ret = 1;
   wz_uint32_t len;
   wzary * ary;
   wznode * nodes;
+  wz_uint32_t * sizes;
+  wz_uint32_t * addrs; /* encoded then decoded */
+  wz_uint32_t * offs;  /* positions of the addresses from start */
+  wzlink * links = NULL;
+  wzfile win; /* the window of the directory if the file is not mapped */
+  wzptr win_map;
   wz_uint8_t  key;
-  wz_uint32_t start;
+  wz_uint64_t start;
   wz_uint32_t hash;
   wz_uint8_t   name[WZ_UINT8_MAX];
   wz_uint8_t * name_ptr = name;
   wz_uint32_t  name_len;
   wz_uint32_t i;
   wz_uint32_t j;
+  wzcur cur;
+  cur.file = file;
   if (wz_seek(node->n.info & WZ_EMBED ?
-              node->na_e.addr : node->na.addr, SEEK_SET, file))
+              node->na_e.addr : node->na.addr, SEEK_SET, &cur))
     WZ_ERR_RET(ret);
-  if (wz_read_int32(&len, file))
+  if (wz_read_int32(&len, &cur))
     WZ_ERR_RET(ret);
   if ((ary = malloc(offsetof(wzary, nodes) +
-                    len * sizeof(* ary->nodes))) == NULL)
+                    len * sizeof(* ary->nodes) +
+                    len * sizeof(* sizes))) == NULL) /* sizes follow nodes */
     WZ_ERR_RET(ret);
   nodes = ary->nodes;
+  sizes = (wz_uint32_t *) (nodes + len);
+  if ((addrs = malloc(len * sizeof(* addrs) * 2)) == NULL)
+    WZ_ERR_GOTO(free_ary);
+  offs = addrs + len;
   key   = file->key;
   start = file->start;
   hash  = file->hash;
+  memset(&win, 0, sizeof(win)); /* nothing of the file but its bytes */
+  win.map = NULL;
+  win.cache = NULL;
+  win.names = NULL;
+  win.refs = NULL;
+  if (file->map == NULL) {
+    if (wz_load_lv0(&win, cur.pos, len, file))
+      WZ_ERR_GOTO(free_win);
+    cur.file = &win;
+    cur.pos = 0;
+  }
   for (i = 0; i < len; i++) {
     int err = 1;
     wznode * child = nodes + i;
+    wzlink * link = NULL;
     wz_uint8_t type;
-    wz_uint32_t pos;
-    if (wz_read_byte(&type, file))
+    if (cur.file == &win && win.size - cur.pos < WZ_LV0_ENTRY_MAX &&
+        win.start + win.size < file->size) { /* the window runs out */
+      if (wz_load_lv0(&win, win.start + cur.pos, len - i, file))
+        WZ_ERR_GOTO(free_child);
+      cur.pos = 0;
+    }
+    if (wz_read_byte(&type, &cur))
       WZ_ERR_GOTO(free_child);
-    pos = 0;
     if (WZ_IS_LV0_LINK(type)) {
       wz_uint32_t offset;
-      if (wz_read_le32(&offset, file))
+      if (wz_read_le32(&offset, &cur))
         WZ_ERR_GOTO(free_child);
-      pos = file->pos;
-      if (wz_seek(file->start + offset, SEEK_SET, file) ||
-          wz_read_byte(&type, file)) /* type and name are in the other place */
+      if (links == NULL) {
+        if ((links = malloc(WZ_LV0_LINKS_LEN * sizeof(* links))) == NULL)
+          WZ_ERR_GOTO(free_child);
+        for (j = 0; j < WZ_LV0_LINKS_LEN; j++)
+          links[j].type = 0;
+      }
+      if (wz_read_link(&link, links, offset, key, keys,
+                       cur.file == &win ? &win : NULL, file))
         WZ_ERR_GOTO(free_child);
+      type = link->type; /* type and name are in the other place */
     }
     if (WZ_IS_LV0_ARY(type) ||
         WZ_IS_LV0_OBJ(type)) {
       wz_uint32_t size;
       wz_uint32_t check;
-      wz_uint32_t addr;
-      wz_uint32_t addr_pos;
       wz_uint8_t * bytes;
-      if (wz_read_chars(&name_ptr, &name_len, NULL, sizeof(name),
-                        0, WZ_LV0_NAME, key, keys, file) ||
-          (pos && wz_seek(pos, SEEK_SET, file)) ||
-          wz_read_int32(&size, file) ||
-          wz_read_int32(&check, file))
+      if (link != NULL) {
+        name_ptr = link->name;
+        name_len = link->name_len;
+      } else {
+        name_ptr = name;
+        if (wz_read_chars(&name_ptr, &name_len, NULL, sizeof(name),
+                          0, WZ_LV0_NAME, key, keys, &cur))
+          WZ_ERR_GOTO(free_child);
+      }
+      if (wz_read_int32(&size, &cur) ||
+          wz_read_int32(&check, &cur))
         WZ_ERR_GOTO(free_child);
-      addr_pos = file->pos;
-      if (wz_read_le32(&addr, file))
+      offs[i] = (wz_uint32_t) (win.start + cur.pos - start);
+      if (wz_read_le32(&addrs[i], &cur))
         WZ_ERR_GOTO(free_child);
-      wz_decode_addr(&addr, addr, addr_pos, start, hash);
       if (name_len < sizeof(child->na_e.name_buf)) {
         bytes = child->n.name_e;
-        child->na_e.addr = addr;
         child->na_e.key = 0xff;
         child->n.info = WZ_EMBED;
+      } else if (file->intern) {
+        if (wz_intern_name(&child->n.name, name_ptr, name_len, file->names))
+          WZ_ERR_GOTO(free_child);
+        bytes = NULL;
+        child->na.key = 0xff;
+        child->n.info = WZ_INTERN;
       } else {
         if ((bytes = malloc(name_len + 1)) == NULL)
           WZ_ERR_GOTO(free_child);
         child->n.name = bytes;
-        child->na.addr = addr;
         child->na.key = 0xff;
         child->n.info = 0;
       }
-      for (j = 0; j < name_len; j++)
-        bytes[j] = name[j];
-      bytes[name_len] = '\0';
+      if (bytes != NULL) {
+        for (j = 0; j < name_len; j++)
+          bytes[j] = name_ptr[j];
+        bytes[name_len] = '\0';
+      }
       child->n.name_len = (wz_uint8_t) name_len;
+      sizes[i] = size;
       if (WZ_IS_LV0_ARY(type))
         child->n.info |= WZ_ARY;
       else
         child->n.info |= WZ_UNK | WZ_LEAF;
     } else if (WZ_IS_LV0_NIL(type)) {
-      if (wz_seek(10, SEEK_CUR, file)) /* unknown 10 bytes */
+      if (wz_seek(10, SEEK_CUR, &cur)) /* unknown 10 bytes */
         WZ_ERR_GOTO(free_child);
       child->n.name_e[0] = '\0';
       child->n.name_len = 0;
       child->n.info = WZ_EMBED | WZ_NIL | WZ_LEAF;
+      sizes[i] = 0;
+      addrs[i] = 0;
+      offs[i] = 0;
     } else {
       wz_error("Unsupported node type: 0x%02"WZ_PRIx32"\n", (wz_uint32_t) type);
       goto free_child;
@@ -912,15 +2782,30 @@ free_child:
     if (err) {
       for (j = 0; j < i; j++) {
         wznode * child_ = nodes + j;
-        if (!(child_->n.info & WZ_EMBED))
+        if (!(child_->n.info & (WZ_EMBED | WZ_INTERN)))
           wz_free_chars(child_->n.name);
       }
-      goto free_ary;
+      goto free_win;
     }
   }
+  wz_decode_addrs(addrs, offs, len, start, hash);
+  for (i = 0; i < len; i++) {
+    wznode * child = nodes + i;
+    if ((child->n.info & WZ_TYPE) == WZ_NIL)
+      continue;
+    if (child->n.info & WZ_EMBED)
+      child->na_e.addr = addrs[i];
+    else
+      child->na.addr = addrs[i];
+  }
   ary->len = len;
   node->n.val.ary = ary;
   ret = 0;
+free_win:
+  win_map.c8 = win.map;
+  free(win_map.u8);
+  free(links);
+  free(addrs);
 free_ary:
   if (ret)
     free(ary);
@@ -935,13 +2820,40 @@ wz_free_lv0(wznode * node) {
   wznode * nodes = ary->nodes;
   for (i = 0; i < len; i++) {
     wznode * child = nodes + i;
-    if (!(child->n.info & WZ_EMBED))
+    if (!(child->n.info & (WZ_EMBED | WZ_INTERN)))
       wz_free_chars(child->n.name);
   }
   free(ary);
   node->n.val.ary = NULL;
 }
 
+static void /* the position and size of the lv0 image */
+wz_get_img_range(wz_uint64_t * ret_pos, wz_uint32_t * ret_size,
+                 const wznode * node) {
+  const wzary * ary = node->n.parent->n.val.ary;
+  const wz_uint32_t * sizes = (const wz_uint32_t *) (ary->nodes + ary->len);
+  * ret_pos = node->n.info & WZ_EMBED ? node->na_e.addr : node->na.addr;
+  * ret_size = sizes[node - ary->nodes];
+}
+
+static int /* clip the range to the file and pass the hint to the backend */
+wz_advise_range(wzfile * file, wz_uint64_t pos, wz_uint64_t len, int advice) {
+  if (file->io.advise == NULL || pos >= file->size)
+    return 0;
+  if (!len || len > file->size - pos)
+    len = file->size - pos;
+  return file->io.advise(file->io.user, pos, len, advice);
+}
+
+static void /* let the pages of a large image go after it is freed */
+wz_drop_img(wznode * node) {
+  wz_uint64_t pos;
+  wz_uint32_t size;
+  wz_get_img_range(&pos, &size, node);
+  if (size >= WZ_DROP_IMG_MIN)
+    (void) wz_advise_range(node->n.root.file, pos, size, WZ_ADVICE_DONTNEED);
+}
+
 static void
 wz_encode_ver(wz_uint16_t * ret_enc, wz_uint32_t * ret_hash, wz_uint16_t dec) {
   wz_uint8_t b[5 + 1];
@@ -967,65 +2879,147 @@ wz_encode_ver(wz_uint16_t * ret_enc, wz_uint32_t * ret_hash, wz_uint16_t dec) {
   * ret_hash = hash;
 }
 
+static const wz_uint8_t wz_ver_encs[512] = {
+  /* the encoded version of each version by wz_encode_ver */
+  0xce, 0xcd, 0xcc, 0xcb, 0xca, 0xc9, 0xc8, 0xc7, 0xc6, 0xc5, 0x88, 0x8b,
+  0x8a, 0x8d, 0x8c, 0x8f, 0x8e, 0x81, 0x80, 0x83, 0x68, 0x6b, 0x6a, 0x6d,
+  0x6c, 0x6f, 0x6e, 0x61, 0x60, 0x63, 0x48, 0x4b, 0x4a, 0x4d, 0x4c, 0x4f,
+  0x4e, 0x41, 0x40, 0x43, 0x28, 0x2b, 0x2a, 0x2d, 0x2c, 0x2f, 0x2e, 0x21,
+  0x20, 0x23, 0x08, 0x0b, 0x0a, 0x0d, 0x0c, 0x0f, 0x0e, 0x01, 0x00, 0x03,
+  0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef, 0xe0, 0xe1, 0xe2, 0xc9, 0xca,
+  0xcb, 0xcc, 0xcd, 0xce, 0xcf, 0xc0, 0xc1, 0xc2, 0xa9, 0xaa, 0xab, 0xac,
+  0xad, 0xae, 0xaf, 0xa0, 0xa1, 0xa2, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e,
+  0x8f, 0x80, 0x81, 0x82, 0x60, 0x63, 0x62, 0x65, 0x64, 0x67, 0x66, 0x69,
+  0x68, 0x6b, 0x40, 0x43, 0x42, 0x45, 0x44, 0x47, 0x46, 0x49, 0x48, 0x4b,
+  0xa0, 0xa3, 0xa2, 0xa5, 0xa4, 0xa7, 0xa6, 0xa9, 0xa8, 0xab, 0x80, 0x83,
+  0x82, 0x85, 0x84, 0x87, 0x86, 0x89, 0x88, 0x8b, 0xe0, 0xe3, 0xe2, 0xe5,
+  0xe4, 0xe7, 0xe6, 0xe9, 0xe8, 0xeb, 0xc0, 0xc3, 0xc2, 0xc5, 0xc4, 0xc7,
+  0xc6, 0xc9, 0xc8, 0xcb, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,
+  0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x41, 0x42,
+  0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x7c, 0x7f, 0x7e, 0x79,
+  0x78, 0x7b, 0x7a, 0x75, 0x74, 0x77, 0x5c, 0x5f, 0x5e, 0x59, 0x58, 0x5b,
+  0x5a, 0x55, 0x54, 0x57, 0xbc, 0xbf, 0xbe, 0xb9, 0xb8, 0xbb, 0xba, 0xb5,
+  0xb4, 0xb7, 0x9c, 0x9f, 0x9e, 0x99, 0x98, 0x9b, 0x9a, 0x95, 0x94, 0x97,
+  0xfc, 0xff, 0xfe, 0xf9, 0xf8, 0xfb, 0xfa, 0xf5, 0xf4, 0xf7, 0xdc, 0xdf,
+  0xde, 0xd9, 0xd8, 0xdb, 0xda, 0xd5, 0xd4, 0xd7, 0x3d, 0x3e, 0x3f, 0x38,
+  0x39, 0x3a, 0x3b, 0x34, 0x35, 0x36, 0x1d, 0x1e, 0x1f, 0x18, 0x19, 0x1a,
+  0x1b, 0x14, 0x15, 0x16, 0x7d, 0x7e, 0x7f, 0x78, 0x79, 0x7a, 0x7b, 0x74,
+  0x75, 0x76, 0x5d, 0x5e, 0x5f, 0x58, 0x59, 0x5a, 0x5b, 0x54, 0x55, 0x56,
+  0x78, 0x7b, 0x7a, 0x7d, 0x7c, 0x7f, 0x7e, 0x71, 0x70, 0x73, 0x58, 0x5b,
+  0x5a, 0x5d, 0x5c, 0x5f, 0x5e, 0x51, 0x50, 0x53, 0xb8, 0xbb, 0xba, 0xbd,
+  0xbc, 0xbf, 0xbe, 0xb1, 0xb0, 0xb3, 0x98, 0x9b, 0x9a, 0x9d, 0x9c, 0x9f,
+  0x9e, 0x91, 0x90, 0x93, 0xf8, 0xfb, 0xfa, 0xfd, 0xfc, 0xff, 0xfe, 0xf1,
+  0xf0, 0xf3, 0xd8, 0xdb, 0xda, 0xdd, 0xdc, 0xdf, 0xde, 0xd1, 0xd0, 0xd3,
+  0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x30, 0x31, 0x32, 0x19, 0x1a,
+  0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x10, 0x11, 0x12, 0x79, 0x7a, 0x7b, 0x7c,
+  0x7d, 0x7e, 0x7f, 0x70, 0x71, 0x72, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e,
+  0x5f, 0x50, 0x51, 0x52, 0x74, 0x77, 0x76, 0x71, 0x70, 0x73, 0x72, 0x7d,
+  0x7c, 0x7f, 0x54, 0x57, 0x56, 0x51, 0x50, 0x53, 0x52, 0x5d, 0x5c, 0x5f,
+  0xb4, 0xb7, 0xb6, 0xb1, 0xb0, 0xb3, 0xb2, 0xbd, 0xbc, 0xbf, 0x94, 0x97,
+  0x96, 0x91, 0x90, 0x93, 0x92, 0x9d, 0x9c, 0x9f, 0xf4, 0xf7, 0xf6, 0xf1,
+  0xf0, 0xf3, 0xf2, 0xfd, 0xfc, 0xff, 0xd4, 0xd7, 0xd6, 0xd1, 0xd0, 0xd3,
+  0xd2, 0xdd, 0xdc, 0xdf, 0x35, 0x36, 0x37, 0x30, 0x31, 0x32, 0x33, 0x3c,
+  0x3d, 0x3e, 0x15, 0x16, 0x17, 0x10, 0x11, 0x12, 0x13, 0x1c, 0x1d, 0x1e,
+  0x75, 0x76, 0x77, 0x70, 0x71, 0x72, 0x73, 0x7c, 0x7d, 0x7e, 0x55, 0x56,
+  0x57, 0x50, 0x51, 0x52, 0x53, 0x5c, 0x5d, 0x5e, 0x70, 0x73, 0x72, 0x75,
+  0x74, 0x77, 0x76, 0x79, 0x78, 0x7b, 0x50, 0x53
+};
+
+static int /* decode the string if the key makes it printable */
+wz_try_key(wz_uint8_t * bytes, wz_uint32_t len, wz_uint8_t key,
+           wzkeys * keys) {
+  wz_uint8_t buf[WZ_UINT8_MAX]; /* tried in a copy, bytes are kept */
+  wz_uint32_t i;
+  if (!len || len > sizeof(buf))
+    return 1;
+  memcpy(buf, bytes, len);
+  if (wz_decode_chars(buf, len, key, keys, WZ_ENC_CP1252))
+    return 1;
+  for (i = 0; i < len; i++)
+    if (!isprint(buf[i]))
+      return 1;
+  return memcpy(bytes, buf, len), 0;
+}
+
 static int /* if string key is found, the string is also decoded. */
 wz_deduce_key(wz_uint8_t * ret_key, wz_uint8_t * bytes, wz_uint32_t len,
-              const wz_uint8_t * keys) {
-  wz_uint8_t i;
-  wz_uint32_t j;
-  for (i = 0; i <= WZ_KEY_EMPTY; i++) {
-    if (wz_decode_chars(bytes, len, i, keys, WZ_ENC_CP1252)) continue;
-    for (j = 0; j < len && isprint(bytes[j]); j++)
-      if (j == len - 1) return * ret_key = (wz_uint8_t) i, 0;
-    if (wz_decode_chars(bytes, len, i, keys, WZ_ENC_CP1252)) continue;
+              wz_uint8_t hint, wzkeys * keys) {
+  wz_uint8_t n;
+  for (n = 0; n <= WZ_KEY_EMPTY + 1; n++) { /* the hint, then every key */
+    wz_uint8_t i = n ? (wz_uint8_t) (n - 1) : hint;
+    if (i > WZ_KEY_EMPTY || (n && i == hint))
+      continue;
+    if (!wz_try_key(bytes, len, i, keys))
+      return * ret_key = i, 0;
   }
   return wz_error("Cannot deduce the string key\n"), 1;
 }
 
+static int /* find the keys of the region by the first name of the file */
+wz_match_keys(wzkeys ** ret_keys, wz_uint8_t * ret_key,
+              wz_uint8_t * bytes, wz_uint32_t len, wzctx * ctx) {
+  wz_uint8_t print = wz_print_name(bytes, len);
+  wz_uint8_t used = (wz_uint8_t) ((1U << (len < 8 ? len : 8)) - 1);
+  wz_uint8_t p;
+  wz_uint8_t i;
+  for (p = 0; p < ctx->profiles_len; p++) {
+    wzprofile * profile = ctx->profiles + p;
+    for (i = 0; i <= WZ_KEY_EMPTY; i++) /* only decode the likely keys */
+      if (!((profile->prints[i] ^ print) & used) &&
+          !wz_try_key(bytes, len, i, profile->keys))
+        return * ret_keys = profile->keys, * ret_key = i, 0;
+  }
+  return wz_error("Cannot match the keys of the file\n"), 1;
+}
+
 static int
 wz_deduce_ver(wz_uint16_t * ret_dec, wz_uint32_t * ret_hash,
-              wz_uint8_t * ret_key, wz_uint16_t enc,
-              wz_uint32_t addr, wz_uint32_t start, wz_uint32_t size, FILE * raw,
-              const wz_uint8_t * keys) {
+              wzkeys ** ret_keys, wz_uint8_t * ret_key, wz_uint16_t enc,
+              wz_uint64_t addr, wz_uint64_t start, wzfile * file,
+              wzctx * ctx) {
   int ret = 1;
+  wz_uint64_t size = file->size;
   wz_uint32_t len;
   wz_uint32_t i;
-  wzfile file;
-  file.raw = raw;
-  file.size = size; /* used in read_lv0/int32/byte */
-  if (wz_seek(addr, SEEK_SET, &file))
+  wzcur cur;
+  cur.file = file;
+  if (wz_seek(addr, SEEK_SET, &cur))
     WZ_ERR_RET(ret);
-  if (wz_read_int32(&len, &file))
+  if (wz_read_int32(&len, &cur))
     WZ_ERR_RET(ret);
   if (len) {
     int err = 1;
     struct entity {
+      wz_uint64_t addr_pos;
       wz_uint8_t  name_enc;
       wz_uint8_t  name[42 + 1];
       wz_uint32_t name_len;
       wz_uint32_t addr_enc;
-      wz_uint32_t addr_pos;
+      wz_uint8_t  _[4]; /* padding */
     } * entities;
     int guessed;
     wz_uint16_t g_dec;
     wz_uint32_t g_hash;
     wz_uint16_t g_enc;
+    wzkeys * keys;
     wz_uint8_t key;
     if ((entities = malloc(len * sizeof(* entities))) == NULL)
       WZ_ERR_RET(ret);
     for (i = 0; i < len; i++) {
       struct entity * entity = entities + i;
       wz_uint8_t type;
-      wz_uint32_t pos;
-      if (wz_read_byte(&type, &file))
+      wz_uint64_t pos;
+      if (wz_read_byte(&type, &cur))
         WZ_ERR_GOTO(free_entities);
       pos = 0;
       if (WZ_IS_LV0_LINK(type)) {
         wz_uint32_t offset;
-        if (wz_read_le32(&offset, &file))
+        if (wz_read_le32(&offset, &cur))
           WZ_ERR_GOTO(free_entities);
-        pos = file.pos;
-        if (wz_seek(start + offset, SEEK_SET, &file) ||
-            wz_read_byte(&type, &file)) /* type & name are in the other place */
+        pos = cur.pos;
+        if (wz_seek(start + offset, SEEK_SET, &cur) ||
+            wz_read_byte(&type, &cur)) /* type & name are in the other place */
           WZ_ERR_GOTO(free_entities);
       }
       if (WZ_IS_LV0_ARY(type) ||
@@ -1034,21 +3028,21 @@ wz_deduce_ver(wz_uint16_t * ret_dec, wz_uint32_t * ret_hash,
         wz_uint32_t  size_;
         wz_uint32_t  check_;
         wz_uint32_t  addr_enc;
-        wz_uint32_t  addr_pos;
+        wz_uint64_t  addr_pos;
         if (wz_read_chars(&name, &entity->name_len, &entity->name_enc,
                           sizeof(entity->name),
-                          0, WZ_LV0_NAME, 0xff, NULL, &file) ||
-            (pos && wz_seek(pos, SEEK_SET, &file)) ||
-            wz_read_int32(&size_, &file) ||
-            wz_read_int32(&check_, &file))
+                          0, WZ_LV0_NAME, 0xff, NULL, &cur) ||
+            (pos && wz_seek(pos, SEEK_SET, &cur)) ||
+            wz_read_int32(&size_, &cur) ||
+            wz_read_int32(&check_, &cur))
           WZ_ERR_GOTO(free_entities);
-        addr_pos = file.pos;
-        if (wz_read_le32(&addr_enc, &file))
+        addr_pos = cur.pos;
+        if (wz_read_le32(&addr_enc, &cur))
           WZ_ERR_GOTO(free_entities);
         entity->addr_enc = addr_enc;
         entity->addr_pos = addr_pos;
       } else if (WZ_IS_LV0_NIL(type)) {
-        if (wz_seek(10, SEEK_CUR, &file)) /* unknown 10 bytes */
+        if (wz_seek(10, SEEK_CUR, &cur)) /* unknown 10 bytes */
           WZ_ERR_GOTO(free_entities);
         entity->addr_enc = 0; /* no need to decode */
       } else {
@@ -1059,31 +3053,32 @@ wz_deduce_ver(wz_uint16_t * ret_dec, wz_uint32_t * ret_hash,
     }
     guessed = 0;
     g_hash = 0;
-    for (g_dec = 0; g_dec < 512; g_dec++) { /* guess dec */
+    for (g_dec = 0; g_dec < sizeof(wz_ver_encs); g_dec++) { /* guess dec */
+      int addr_err = 0;
+      if (wz_ver_encs[g_dec] != enc)
+        continue;
       wz_encode_ver(&g_enc, &g_hash, g_dec);
-      if (g_enc == enc) {
-        int addr_err = 0;
-        for (i = 0; i < len; i++) {
-          struct entity * entity = entities + i;
-          wz_uint32_t addr_enc = entity->addr_enc;
-          if (addr_enc) {
-            wz_uint32_t addr_pos = entity->addr_pos;
-            wz_uint32_t addr_dec;
-            wz_decode_addr(&addr_dec, addr_enc, addr_pos, start, g_hash);
-            if (addr_dec > size) {
-              addr_err = 1;
-              break;
-            }
+      for (i = 0; i < len; i++) {
+        struct entity * entity = entities + i;
+        wz_uint32_t addr_enc = entity->addr_enc;
+        if (addr_enc) {
+          wz_uint64_t addr_pos = entity->addr_pos;
+          wz_uint32_t addr_dec;
+          wz_decode_addr(&addr_dec, addr_enc, addr_pos, start, g_hash);
+          if (addr_dec > size || addr_dec < start) { /* not in the data */
+            addr_err = 1;
+            break;
           }
         }
-        if (!addr_err) {
-          guessed = 1;
-          break;
-        }
+      }
+      if (!addr_err) {
+        guessed = 1;
+        break;
       }
     }
     if (!guessed)
       WZ_ERR_GOTO(free_entities);
+    keys = NULL;
     key = 0xff;
     for (i = 0; i < len; i++) {
       struct entity * entity = entities + i;
@@ -1091,7 +3086,11 @@ wz_deduce_ver(wz_uint16_t * ret_dec, wz_uint32_t * ret_hash,
       if (addr_enc) {
         wz_uint8_t name_enc = entity->name_enc;
         if (name_enc == WZ_ENC_CP1252) {
-          if (wz_deduce_key(&key, entity->name, entity->name_len, keys)) {
+          if (key == 0xff ?
+              wz_match_keys(&keys, &key, entity->name, entity->name_len,
+                            ctx) :
+              wz_deduce_key(&key, entity->name, entity->name_len,
+                            key, keys)) {
             WZ_ERR;
             guessed = 0;
             break;
@@ -1105,6 +3104,7 @@ wz_deduce_ver(wz_uint16_t * ret_dec, wz_uint32_t * ret_hash,
       WZ_ERR_GOTO(free_entities);
     * ret_dec = g_dec;
     * ret_hash = g_hash;
+    * ret_keys = keys;
     * ret_key = key;
     err = 0;
 free_entities:
@@ -1114,6 +3114,7 @@ free_entities:
   } else {
     * ret_dec = 0;
     * ret_hash = 0;
+    * ret_keys = ctx->profiles[0].keys; /* nothing to match */
     * ret_key = 0xff;
   }
   ret = 0;
@@ -1149,8 +3150,9 @@ wz_invert_node(wznode * node) { /* node must not be NULL */
 
 static int
 wz_read_list(void ** ret_ary, wz_uint8_t nodes_off, wz_uint8_t len_off,
-             wz_uint32_t root_addr, wz_uint8_t root_key,
-             wz_uint8_t * keys, wznode * node, wznode * root, wzfile * file) {
+             wz_uint64_t root_addr, wz_uint8_t root_key,
+             wzkeys * keys, wznode * node, wznode * root,
+             wzfile * file, wzcur * cur) {
   int ret = 1;
   wz_uint32_t len;
   wz_uint32_t i;
@@ -1161,9 +3163,9 @@ wz_read_list(void ** ret_ary, wz_uint8_t nodes_off, wz_uint8_t len_off,
   wz_uint8_t   name[WZ_UINT8_MAX];
   wz_uint8_t * name_ptr = name;
   wz_uint32_t  name_len;
-  if (wz_seek(2, SEEK_CUR, file))
+  if (wz_seek(2, SEEK_CUR, cur))
     WZ_ERR_RET(ret);
-  if (wz_read_int32(&len, file))
+  if (wz_read_int32(&len, cur))
     WZ_ERR_RET(ret);
   if ((ary = malloc(nodes_off + len * sizeof(* nodes.n))) == NULL)
     WZ_ERR_RET(ret);
@@ -1176,41 +3178,41 @@ wz_read_list(void ** ret_ary, wz_uint8_t nodes_off, wz_uint8_t len_off,
     wz_uint8_t info;
     wz_uint8_t * bytes;
     if (wz_read_chars(&name_ptr, &name_len, NULL, sizeof(name),
-                      root_addr, WZ_LV1_NAME, root_key, keys, file))
+                      root_addr, WZ_LV1_NAME, root_key, keys, cur))
       WZ_ERR_GOTO(free_child);
-    if (wz_read_byte(&type, file))
+    if (wz_read_byte(&type, cur))
       WZ_ERR_GOTO(free_child);
     if (WZ_IS_LV1_NIL(type)) {
       name_capa = sizeof(child->nil_e.name_buf);
       info = WZ_NIL;
     } else if (WZ_IS_LV1_I16(type)) {
       wz_int16_t i16;
-      if (wz_read_le16((wz_uint16_t *) &i16, file))
+      if (wz_read_le16((wz_uint16_t *) &i16, cur))
         WZ_ERR_GOTO(free_child);
       child->n16.val = i16;
       name_capa = sizeof(child->n16_e.name_buf);
       info = WZ_I16;
     } else if (WZ_IS_LV1_I32(type)) {
       wz_int32_t i32;
-      if (wz_read_int32((wz_uint32_t *) &i32, file))
+      if (wz_read_int32((wz_uint32_t *) &i32, cur))
         WZ_ERR_GOTO(free_child);
       child->n32.val.i = i32;
       name_capa = sizeof(child->n32_e.name_buf);
       info = WZ_I32;
     } else if (WZ_IS_LV1_I64(type)) {
       wz_int64_t i64;
-      if (wz_read_int64((wz_uint64_t *) &i64, file))
+      if (wz_read_int64((wz_uint64_t *) &i64, cur))
         WZ_ERR_GOTO(free_child);
       child->n64.val.i = i64;
       name_capa = sizeof(child->n64_e.name_buf);
       info = WZ_I64;
     } else if (WZ_IS_LV1_F32(type)) {
       wz_int8_t flt8;
-      if (wz_read_byte((wz_uint8_t *) &flt8, file))
+      if (wz_read_byte((wz_uint8_t *) &flt8, cur))
         WZ_ERR_GOTO(free_child);
       if (flt8 == WZ_INT8_MIN) {
         union { wz_uint32_t i; float f; } flt32;
-        if (wz_read_le32(&flt32.i, file))
+        if (wz_read_le32(&flt32.i, cur))
           WZ_ERR_GOTO(free_child);
         child->n32.val.f = flt32.f;
       } else {
@@ -1220,7 +3222,7 @@ wz_read_list(void ** ret_ary, wz_uint8_t nodes_off, wz_uint8_t len_off,
       info = WZ_F32;
     } else if (WZ_IS_LV1_F64(type)) {
       union { wz_uint64_t i; double f; } flt64;
-      if (wz_read_le64(&flt64.i, file))
+      if (wz_read_le64(&flt64.i, cur))
         WZ_ERR_GOTO(free_child);
       child->n64.val.f = flt64.f;
       name_capa = sizeof(child->n64_e.name_buf);
@@ -1229,7 +3231,7 @@ wz_read_list(void ** ret_ary, wz_uint8_t nodes_off, wz_uint8_t len_off,
       wzstr * str;
       wz_uint32_t str_len;
       if (wz_read_chars((wz_uint8_t **) &str, &str_len, NULL, 0, root_addr,
-                        WZ_LV1_STR, root_key, keys, file))
+                        WZ_LV1_STR, root_key, keys, cur))
         WZ_ERR_GOTO(free_child);
       str->len = str_len;
       child->n.val.str = str;
@@ -1237,16 +3239,17 @@ wz_read_list(void ** ret_ary, wz_uint8_t nodes_off, wz_uint8_t len_off,
       info = WZ_STR;
     } else if (WZ_IS_LV1_OBJ(type)) {
       wz_uint32_t size;
-      wz_uint32_t pos;
-      if (wz_read_le32(&size, file))
+      wz_uint64_t pos;
+      if (wz_read_le32(&size, cur))
         WZ_ERR_GOTO(free_child);
-      pos = file->pos;
-      if (wz_seek(size, SEEK_CUR, file))
+      pos = cur->pos - root_addr; /* relative to the image */
+      if (pos > WZ_UINT32_MAX ||
+          wz_seek(size, SEEK_CUR, cur))
         WZ_ERR_GOTO(free_child);
       if (name_len < sizeof(child->na_e.name_buf))
-        child->na_e.addr = pos;
+        child->na_e.addr = (wz_uint32_t) pos;
       else
-        child->na.addr = pos;
+        child->na.addr = (wz_uint32_t) pos;
       child->n.val.ary = NULL;
       name_capa = sizeof(child->na_e.name_buf);
       info = WZ_UNK;
@@ -1258,14 +3261,21 @@ wz_read_list(void ** ret_ary, wz_uint8_t nodes_off, wz_uint8_t len_off,
     if (name_len < name_capa) {
       bytes = child->n.name_e;
       info |= WZ_EMBED;
+    } else if (file->intern) {
+      if (wz_intern_name(&child->n.name, name, name_len, file->names))
+        WZ_ERR_GOTO(free_str);
+      bytes = NULL;
+      info |= WZ_INTERN;
     } else {
       if ((bytes = malloc(name_len + 1)) == NULL)
         WZ_ERR_GOTO(free_str);
       child->n.name = bytes;
     }
-    for (j = 0; j < name_len; j++)
-      bytes[j] = name[j];
-    bytes[name_len] = '\0';
+    if (bytes != NULL) {
+      for (j = 0; j < name_len; j++)
+        bytes[j] = name[j];
+      bytes[name_len] = '\0';
+    }
     child->n.name_len = (wz_uint8_t) name_len;
     child->n.info = info | WZ_LEVEL;
     child->n.parent = node;
@@ -1280,7 +3290,7 @@ free_child:
         wznode * child_ = nodes.n + j;
         if ((child_->n.info & WZ_TYPE) == WZ_STR)
           wz_free_chars((wz_uint8_t *) child_->n.val.str);
-        if (!(child_->n.info & WZ_EMBED))
+        if (!(child_->n.info & (WZ_EMBED | WZ_INTERN)))
           wz_free_chars(child_->n.name);
       }
       goto free_ary;
@@ -1309,7 +3319,7 @@ wz_free_list(void * ary, wz_uint8_t nodes_off, wz_uint8_t len_off) {
     wznode * child = nodes.n + i;
     if ((child->n.info & WZ_TYPE) == WZ_STR)
       wz_free_chars((wz_uint8_t *) child->n.val.str);
-    if (!(child->n.info & WZ_EMBED))
+    if (!(child->n.info & (WZ_EMBED | WZ_INTERN)))
       wz_free_chars(child->n.name);
   }
   free(ary);
@@ -1317,18 +3327,17 @@ wz_free_list(void * ary, wz_uint8_t nodes_off, wz_uint8_t len_off) {
 
 static int
 wz_decode_bitmap(wz_uint32_t * written, wz_uint8_t * out, wz_uint8_t * in,
-                 wz_uint32_t size, wz_uint8_t * key) {
+                 wz_uint32_t size, const wz_uint8_t * key) {
   wzptr src;
   wz_uint8_t * src_end = in + size;
   wz_uint32_t wrote = 0;
   src.u8 = in;
   while (src.u8 < src_end) {
     wz_uint32_t len = WZ_LE32TOH(* src.u32++);
-    wz_uint32_t i;
     if (len > WZ_KEY_ASCII_MAX_LEN)
       return wz_error("Image chunk size is too large: %"WZ_PRIu32"\n", len), 1;
-    for (i = 0; i < len; i++)
-      out[wrote++] = * src.u8++ ^ key[i];
+    wz_xor_key(out + wrote, src.u8, key, len);
+    src.u8 += len, wrote += len;
   }
   return * written = wrote, 0;
 }
@@ -1384,7 +3393,7 @@ static const wz_uint8_t wz_u6[64] = {
 static int
 wz_read_bitmap(wzcolor ** data, wz_uint32_t w, wz_uint32_t h,
                wz_uint16_t depth, wz_uint16_t scale, wz_uint32_t size,
-               wz_uint8_t key, wz_uint8_t * keys) {
+               wz_uint8_t key, wzkeys * keys) {
   int ret = 1;
   wz_uint32_t pixels = w * h;
   wz_uint32_t full_size = pixels * (wz_uint32_t) sizeof(wzcolor);
@@ -1392,6 +3401,7 @@ wz_read_bitmap(wzcolor ** data, wz_uint32_t w, wz_uint32_t h,
   wz_uint8_t * in = (wz_uint8_t *) * data;
   wz_uint8_t * tmp;
   wz_uint8_t * out;
+  const wz_uint8_t * key_bytes;
   wz_uint32_t scale_size;
   wz_uint32_t depth_size;
   wz_uint32_t sw;
@@ -1400,10 +3410,10 @@ wz_read_bitmap(wzcolor ** data, wz_uint32_t w, wz_uint32_t h,
   if ((out = malloc(max_size)) == NULL)
     WZ_ERR_RET(ret);
   if (wz_inflate_bitmap(&size, out, full_size, in, size)) {
-    if (key == WZ_KEY_EMPTY)
+    if (key == WZ_KEY_EMPTY ||
+        (key_bytes = wz_get_key(keys, key, WZ_KEY_ASCII_MAX_LEN)) == NULL)
       WZ_ERR_GOTO(free_out);
-    if (wz_decode_bitmap(&size, out, in, size,
-                         keys + key * WZ_KEY_UTF8_MAX_LEN) ||
+    if (wz_decode_bitmap(&size, out, in, size, key_bytes) ||
         wz_inflate_bitmap(&size, in, full_size, out, size))
       WZ_ERR_GOTO(free_out);
   } else {
@@ -1649,10 +3659,8 @@ wz_read_wav(wzwav * wav, wz_uint8_t * data) {
 }
 
 static void
-wz_decode_wav(wz_uint8_t * wav, wz_uint8_t size, wz_uint8_t * key) {
-  wz_uint8_t i;
-  for (i = 0; i < size; i++)
-    wav[i] ^= key[i];
+wz_decode_wav(wz_uint8_t * wav, wz_uint8_t size, const wz_uint8_t * key) {
+  wz_xor_key(wav, wav, key, size);
 }
 
 static void
@@ -1674,17 +3682,63 @@ wz_write_pcm(wz_uint8_t * pcm, wzwav * wav, wz_uint32_t size) {
   * dst.u32++ = WZ_HTOLE32(size);
 }
 
+enum { /* how wz_read_lv1 reads the data of canvas */
+  WZ_LV1_RAW,    /* read as is, decoded later by the caller */
+  WZ_LV1_DECODE, /* read and decode */
+  WZ_LV1_DEFER,  /* allocate only, read later by the caller in a batch */
+  WZ_LV1_SKIP    /* neither allocate nor read, accessed by wz_get_raw */
+};
+
+typedef struct {
+  wz_uint8_t   type;
+  wz_uint8_t   len;
+  char         name[sizeof("Shape2D#Convex2D")];
+} wzlv1type;
+
+static const wzlv1type wz_lv1_types[] = {
+  /* the object types hashed by wz_get_lv1_type, which has no collision */
+  {WZ_IMG, 6,  "Canvas"},
+  {WZ_UNK, 0,  ""},
+  {WZ_VEC, 16, "Shape2D#Vector2D"},
+  {WZ_UNK, 0,  ""},
+  {WZ_UNK, 0,  ""},
+  {WZ_UNK, 0,  ""},
+  {WZ_UOL, 3,  "UOL"},
+  {WZ_UNK, 0,  ""},
+  {WZ_VEX, 16, "Shape2D#Convex2D"},
+  {WZ_UNK, 0,  ""},
+  {WZ_ARY, 8,  "Property"},
+  {WZ_UNK, 0,  ""},
+  {WZ_UNK, 0,  ""},
+  {WZ_AO,  9,  "Sound_DX8"},
+  {WZ_UNK, 0,  ""},
+  {WZ_UNK, 0,  ""}
+};
+
+static wz_uint8_t /* the node type of the object type, WZ_UNK if unknown */
+wz_get_lv1_type(const wz_uint8_t * name, wz_uint32_t len) {
+  const wzlv1type * type;
+  if (len < 3)
+    return WZ_UNK;
+  type = wz_lv1_types + ((len ^ name[len - 3]) & 0x0f);
+  if (type->len != len || memcmp(type->name, name, len))
+    return WZ_UNK;
+  return type->type;
+}
+
 static int
-wz_read_lv1(wznode * node, wznode * root, wzfile * file, wz_uint8_t * keys,
-            wz_uint8_t eager) {
+wz_read_lv1(wznode * node, wznode * root, wzfile * file,
+            wzkeys * keys, wz_uint8_t mode) {
   int ret = 1;
-  wz_uint32_t  root_addr;
+  wz_uint64_t  root_addr;
   wz_uint8_t   root_key;
-  wz_uint32_t  addr;
+  wz_uint64_t  addr;
   wz_uint8_t   type_enc;
   wz_uint8_t   type[sizeof("Shape2D#Convex2D")];
   wz_uint8_t * type_ptr = type;
   wz_uint32_t  type_len;
+  wzcur        cur;
+  cur.file = file;
   if (root->n.info & WZ_EMBED) {
     root_addr    = root->na_e.addr;
     root_key     = root->na_e.key;
@@ -1693,9 +3747,11 @@ wz_read_lv1(wznode * node, wznode * root, wzfile * file, wz_uint8_t * keys,
     root_key     = root->na.key;
   }
   addr = node->n.info & WZ_EMBED ? node->na_e.addr : node->na.addr;
-  if (wz_seek(addr, SEEK_SET, file) ||
+  if (node != root) /* lv1 nodes are relative to the image */
+    addr += root_addr;
+  if (wz_seek(addr, SEEK_SET, &cur) ||
       wz_read_chars(&type_ptr, &type_len, &type_enc, sizeof(type),
-                    root_addr, WZ_LV1_TYPENAME_OR_STR, root_key, keys, file))
+                    root_addr, WZ_LV1_TYPENAME_OR_STR, root_key, keys, &cur))
     WZ_ERR_RET(ret);
   if (type_enc == WZ_ENC_UTF8) {
     wzptr str;
@@ -1705,19 +3761,22 @@ wz_read_lv1(wznode * node, wznode * root, wzfile * file, wz_uint8_t * keys,
     node->n.info = (node->n.info ^ WZ_UNK) | WZ_STR;
     return ret = 0, ret;
   }
-  if (root_key == 0xff) {
-    if (wz_deduce_key(&root_key, type, type_len, keys))
+  if (root_key == 0xff) { /* most likely the key of the file */
+    if (wz_deduce_key(&root_key, type, type_len, file->key, keys))
       WZ_ERR_RET(ret);
     * (root->n.info & WZ_EMBED ? &root->na_e.key : &root->na.key) = root_key;
   }
-  if (WZ_IS_LV1_ARY(type)) {
+  switch (wz_get_lv1_type(type, type_len)) {
+  case WZ_ARY: {
     void * ary;
     if (wz_read_list(&ary, offsetof(wzary, nodes), offsetof(wzary, len),
-                     root_addr, root_key, keys, node, root, file))
+                     root_addr, root_key, keys, node, root, file, &cur))
       WZ_ERR_GOTO(exit);
     node->n.val.ary = ary;
     node->n.info = (node->n.info ^ WZ_UNK) | WZ_ARY;
-  } else if (WZ_IS_LV1_IMG(type)) {
+    break;
+  }
+  case WZ_IMG: {
     int err = 1;
     wz_uint8_t list;
     wzimg * img;
@@ -1730,26 +3789,27 @@ wz_read_lv1(wznode * node, wznode * root, wzfile * file, wz_uint8_t * keys,
     wz_uint32_t full_size;
     wz_uint32_t max_size;
     wz_uint8_t * data;
-    if (wz_seek(1, SEEK_CUR, file) ||
-        wz_read_byte(&list, file))
+    if (wz_seek(1, SEEK_CUR, &cur) ||
+        wz_read_byte(&list, &cur))
       WZ_ERR_GOTO(exit);
     if (list == 1) {
       if (wz_read_list((void **) &img,
                        offsetof(wzimg, nodes), offsetof(wzimg, len),
-                       root_addr, root_key, keys, node, root, file))
+                       root_addr, root_key, keys, node, root, file,
+                       &cur))
         WZ_ERR_GOTO(exit);
     } else {
       if ((img = malloc(offsetof(wzimg, nodes))) == NULL)
         WZ_ERR_GOTO(exit);
       img->len = 0;
     }
-    if (wz_read_int32(&w, file)      ||
-        wz_read_int32(&h, file)      ||
-        wz_read_int32(&depth, file)  || depth > WZ_UINT16_MAX ||
-        wz_read_byte(&scale, file)   ||
-        wz_seek(4, SEEK_CUR, file)   || /* blank */
-        wz_read_le32(&size, file)    ||
-        wz_seek(1, SEEK_CUR, file))     /* blank */
+    if (wz_read_int32(&w, &cur)      ||
+        wz_read_int32(&h, &cur)      ||
+        wz_read_int32(&depth, &cur)  || depth > WZ_UINT16_MAX ||
+        wz_read_byte(&scale, &cur)   ||
+        wz_seek(4, SEEK_CUR, &cur)   || /* blank */
+        wz_read_le32(&size, &cur)    ||
+        wz_seek(1, SEEK_CUR, &cur))     /* blank */
       WZ_ERR_GOTO(free_img);
     if (size <= 1)
       WZ_ERR_GOTO(free_img);
@@ -1757,11 +3817,19 @@ wz_read_lv1(wznode * node, wznode * root, wzfile * file, wz_uint8_t * keys,
     pixels = w * h;
     full_size = pixels * (wz_uint32_t) sizeof(wzcolor);
     max_size = size > full_size ? size : full_size;
-    if ((data = malloc(max_size)) == NULL)
+    if (size > file->size - cur.pos)
       WZ_ERR_GOTO(free_img);
-    if (wz_read_bytes(data, size, file) ||
-        (eager && wz_read_bitmap((wzcolor **) &data, w, h, (wz_uint16_t) depth,
-                                 scale, size, root_key, keys)))
+    if (mode == WZ_LV1_SKIP) {
+      data = NULL;
+    } else if ((data = malloc(max_size)) == NULL) {
+      WZ_ERR_GOTO(free_img);
+    }
+    img->pos = cur.pos;
+    if (mode != WZ_LV1_DEFER && mode != WZ_LV1_SKIP &&
+        (wz_read_bytes(data, size, &cur) ||
+         (mode == WZ_LV1_DECODE &&
+          wz_read_bitmap((wzcolor **) &data, w, h, (wz_uint16_t) depth,
+                         scale, size, root_key, keys))))
       WZ_ERR_GOTO(free_img_data);
     img->w = w;
     img->h = h;
@@ -1780,13 +3848,15 @@ free_img:
       wz_free_list(img, offsetof(wzimg, nodes), offsetof(wzimg, len));
       goto exit;
     }
-  } else if (WZ_IS_LV1_VEX(type)) {
+    break;
+  }
+  case WZ_VEX: {
     int err = 1;
     wz_uint32_t len;
     wz_uint32_t i;
     wzvex * vex;
     wzvec * vecs;
-    if (wz_read_int32(&len, file))
+    if (wz_read_int32(&len, &cur))
       WZ_ERR_GOTO(exit);
     if ((vex = malloc(offsetof(wzvex, ary) +
                       len * sizeof(* vex->ary))) == NULL)
@@ -1795,14 +3865,14 @@ free_img:
     for (i = 0; i < len; i++) {
       wzvec * vec = vecs + i;
       if (wz_read_chars(&type_ptr, &type_len, NULL, sizeof(type),
-                        root_addr, WZ_LV1_TYPENAME, root_key, keys, file))
+                        root_addr, WZ_LV1_TYPENAME, root_key, keys, &cur))
         WZ_ERR_GOTO(free_vex);
-      if (!WZ_IS_LV1_VEC(type)) {
+      if (wz_get_lv1_type(type, type_len) != WZ_VEC) {
         wz_error("Convex should contain only vectors\n");
         goto free_vex;
       }
-      if (wz_read_int32((wz_uint32_t *) &vec->x, file) ||
-          wz_read_int32((wz_uint32_t *) &vec->y, file))
+      if (wz_read_int32((wz_uint32_t *) &vec->x, &cur) ||
+          wz_read_int32((wz_uint32_t *) &vec->y, &cur))
         WZ_ERR_GOTO(free_vex);
     }
     vex->len = len;
@@ -1814,24 +3884,28 @@ free_vex:
       free(vex);
       goto exit;
     }
-  } else if (WZ_IS_LV1_VEC(type)) {
+    break;
+  }
+  case WZ_VEC: {
     wzvec vec;
-    if (wz_read_int32((wz_uint32_t *) &vec.x, file) ||
-        wz_read_int32((wz_uint32_t *) &vec.y, file))
+    if (wz_read_int32((wz_uint32_t *) &vec.x, &cur) ||
+        wz_read_int32((wz_uint32_t *) &vec.y, &cur))
       WZ_ERR_GOTO(exit);
     node->n64.val.vec = vec;
     node->n.info = (node->n.info ^ WZ_UNK) | WZ_VEC;
-  } else if (WZ_IS_LV1_AO(type)) {
+    break;
+  }
+  case WZ_AO: {
     int err = 1;
     wz_uint32_t size;
     wz_uint32_t ms;
     wz_uint8_t guid[16];
     wzao * ao;
-    if (wz_seek(1, SEEK_CUR, file) ||
-        wz_read_int32(&size, file) ||
-        wz_read_int32(&ms, file) ||
-        wz_seek(1 + 16 * 2 + 2, SEEK_CUR, file) || /* major and subtype GUID */
-        wz_read_bytes(guid, sizeof(guid), file))
+    if (wz_seek(1, SEEK_CUR, &cur) ||
+        wz_read_int32(&size, &cur) ||
+        wz_read_int32(&ms, &cur) ||
+        wz_seek(1 + 16 * 2 + 2, SEEK_CUR, &cur) || /* major and subtype GUID */
+        wz_read_bytes(guid, sizeof(guid), &cur))
       WZ_ERR_GOTO(exit);
     if ((ao = malloc(sizeof(* ao))) == NULL)
       WZ_ERR_GOTO(exit);
@@ -1841,24 +3915,27 @@ free_vex:
       wz_uint8_t * hdr; /* header */
       wzwav wav;
       wav.format = 0;
-      if (wz_read_byte(&hsize, file))
+      if (wz_read_byte(&hsize, &cur))
         WZ_ERR_GOTO(free_ao);
       if ((hdr = malloc(hsize)) == NULL)
         WZ_ERR_GOTO(free_ao);
-      if (wz_read_bytes(hdr, hsize, file))
+      if (wz_read_bytes(hdr, hsize, &cur))
         WZ_ERR_GOTO(free_hdr);
       wz_read_wav(&wav, hdr);
       if (WZ_AUDIO_WAV_SIZE + wav.extra_size != hsize) {
         wz_uint8_t decoded = 0;
         wz_uint8_t i;
         for (i = 0; i < WZ_KEY_EMPTY; i++) {
-          wz_decode_wav(hdr, hsize, keys + i * WZ_KEY_UTF8_MAX_LEN);
+          const wz_uint8_t * key;
+          if ((key = wz_get_key(keys, i, hsize)) == NULL)
+            WZ_ERR_GOTO(free_hdr);
+          wz_decode_wav(hdr, hsize, key);
           wz_read_wav(&wav, hdr);
           if (WZ_AUDIO_WAV_SIZE + wav.extra_size == hsize) {
             decoded = 1;
             break;
           }
-          wz_decode_wav(hdr, hsize, keys + i * WZ_KEY_UTF8_MAX_LEN);
+          wz_decode_wav(hdr, hsize, key);
         }
         if (!decoded)
           WZ_ERR_GOTO(free_hdr);
@@ -1868,13 +3945,20 @@ free_hdr:
       free(hdr);
       if (hdr_err)
         goto free_ao;
-      if (wav.format == WZ_AUDIO_PCM) {
+      ao->pos = cur.pos;
+      if (size > file->size - cur.pos)
+        WZ_ERR_GOTO(free_ao);
+      if (mode == WZ_LV1_SKIP && (wav.format == WZ_AUDIO_PCM ||
+                                  wav.format == WZ_AUDIO_MP3)) {
+        ao->data = NULL;
+        ao->size = (wav.format == WZ_AUDIO_PCM ? WZ_AUDIO_PCM_SIZE : 0) + size;
+      } else if (wav.format == WZ_AUDIO_PCM) {
         int pcm_err = 1;
         wz_uint8_t * pcm;
         if ((pcm = malloc(WZ_AUDIO_PCM_SIZE + size)) == NULL)
           WZ_ERR_GOTO(free_ao);
         wz_write_pcm(pcm, &wav, size);
-        if (wz_read_bytes(pcm + WZ_AUDIO_PCM_SIZE, size, file))
+        if (wz_read_bytes(pcm + WZ_AUDIO_PCM_SIZE, size, &cur))
           WZ_ERR_GOTO(free_pcm);
         ao->data = pcm;
         ao->size = WZ_AUDIO_PCM_SIZE + size;
@@ -1889,7 +3973,7 @@ free_pcm:
         wz_uint8_t * data;
         if ((data = malloc(size)) == NULL)
           WZ_ERR_GOTO(free_ao);
-        if (wz_read_bytes(data, size, file))
+        if (wz_read_bytes(data, size, &cur))
           WZ_ERR_GOTO(free_ao_data);
         ao->data = data;
         ao->size = size;
@@ -1913,12 +3997,20 @@ free_ao_data:
           empty = 0;
           break;
         }
-      if (empty) {
+      if (empty && mode == WZ_LV1_SKIP) {
+        ao->pos = cur.pos;
+        if (size > file->size - cur.pos)
+          WZ_ERR_GOTO(free_ao);
+        ao->data = NULL;
+        ao->size = size;
+        ao->format = WZ_AUDIO_MP3;
+      } else if (empty) {
         int data_err = 1;
         wz_uint8_t * data;
+        ao->pos = cur.pos;
         if ((data = malloc(size)) == NULL)
           WZ_ERR_GOTO(free_ao);
-        if (wz_read_bytes(data, size, file))
+        if (wz_read_bytes(data, size, &cur))
           WZ_ERR_GOTO(free_ao_data_);
         ao->data = data;
         ao->size = size;
@@ -1943,17 +4035,21 @@ free_ao:
       free(ao);
       goto exit;
     }
-  } else if (WZ_IS_LV1_UOL(type)) {
+    break;
+  }
+  case WZ_UOL: {
     wzstr * str;
     wz_uint32_t str_len;
-    if (wz_seek(1, SEEK_CUR, file) ||
+    if (wz_seek(1, SEEK_CUR, &cur) ||
         wz_read_chars((wz_uint8_t **) &str, &str_len, NULL, 0, root_addr,
-                      WZ_LV1_STR, root_key, keys, file))
+                      WZ_LV1_STR, root_key, keys, &cur))
       WZ_ERR_GOTO(exit);
     str->len = str_len;
     node->n.val.str = str;
     node->n.info = (node->n.info ^ WZ_UNK) | WZ_UOL;
-  } else {
+    break;
+  }
+  default:
     wz_error("Unsupported object type: %s\n", type);
     goto exit;
   }
@@ -2025,7 +4121,7 @@ typedef struct {
   wz_uint32_t capa;
   wz_uint32_t len;
   wz_iter_node_thrd_node * nodes;
-  wz_uint8_t * keys;
+  wzkeys * keys;
   wz_uint8_t exit;
   wz_uint8_t _[sizeof(void *) - 1];
 } wz_iter_node_thrd_queue;
@@ -2049,7 +4145,7 @@ wz_iter_node_thrd(wz_iter_node_thrd_data * data) {
   wz_uint8_t ret = 0;
   wz_uint8_t err = 0;
   wz_iter_node_thrd_queue * queue = data->queue;
-  wz_uint8_t * keys = queue->keys;
+  wzkeys * keys = queue->keys;
   for (;;) {
     wz_uint8_t exit;
     wz_iter_node_thrd_node nodes[WZ_ITER_NODE_CAPA];
@@ -2100,7 +4196,7 @@ wz_iter_node_thrd(wz_iter_node_thrd_data * data) {
   wz_uint8_t ret = 1;
   wz_uint8_t err = 0;
   wz_iter_node_thrd_queue * queue = data->queue;
-  wz_uint8_t * keys = queue->keys;
+  wzkeys * keys = queue->keys;
   for (;;) {
     wz_uint8_t exit;
     wz_iter_node_thrd_node nodes[WZ_ITER_NODE_CAPA];
@@ -2143,12 +4239,12 @@ exit:
 #endif
 
 int
-wz_parse_file(wzfile * file) {
+wz_parse_file_advised(wzfile * file, int advice) {
   int ret = 1;
   int err = 0;
   wznode * node = &file->root;
   wznode * root = node;
-  wz_uint8_t * keys = file->ctx->keys;
+  wzkeys * keys = file->keys;
   wz_uint32_t stack_capa;
   wz_uint32_t stack_len;
   wznode ** stack;
@@ -2166,6 +4262,8 @@ wz_parse_file(wzfile * file) {
   wz_uint8_t attr_err;
 # endif
 #endif
+  if (wz_advise_file(file, advice))
+    WZ_ERR_RET(ret);
 #ifndef WZ_NO_THRD
   queue.capa = 0;
   queue.len = 0;
@@ -2240,10 +4338,14 @@ destroy_attr:
     node = stack[--stack_len];
     if (node == NULL) {
       node = stack[--stack_len];
-      if (node->n.info & (WZ_LEVEL | WZ_LEAF))
+      if (node->n.info & WZ_LEVEL) {
         wz_free_lv1(node);
-      else
+      } else if (node->n.info & WZ_LEAF) {
+        wz_free_lv1(node);
+        wz_drop_img(node);
+      } else {
         wz_free_lv0(node);
+      }
       continue;
     }
     if (node->n.info & WZ_LEAF)
@@ -2252,9 +4354,9 @@ destroy_attr:
         node->n.val.ary == NULL) {
       if (node->n.info & (WZ_LEVEL | WZ_LEAF)) {
 #ifdef WZ_NO_THRD
-        if (wz_read_lv1(node, root, file, keys, 1)) {
+        if (wz_read_lv1(node, root, file, keys, WZ_LV1_DECODE)) {
 #else
-        if (wz_read_lv1(node, root, file, keys, 0)) {
+        if (wz_read_lv1(node, root, file, keys, WZ_LV1_RAW)) {
 #endif
           err = 1;
           continue;
@@ -2395,9 +4497,17 @@ destroy_mutex:
 # endif
   free(queue.nodes);
 #endif
+  if ((advice == WZ_ADVICE_SEQUENTIAL || advice == WZ_ADVICE_RANDOM) &&
+      wz_advise_file(file, WZ_ADVICE_NORMAL)) /* the pattern ends here */
+    ret = 1;
   return ret;
 }
 
+int
+wz_parse_file(wzfile * file) {
+  return wz_parse_file_advised(file, WZ_ADVICE_SEQUENTIAL);
+}
+
 static size_t /* [^\0{delim}]+ */
 wz_next_tok(const char ** begin, const char ** end, const char * str,
             const char delim) {
@@ -2526,12 +4636,70 @@ wz_get_ao(wz_uint32_t * size, wz_uint32_t * ms, wz_uint16_t * format,
   return ao->data;
 }
 
+int
+wz_get_raw(const wz_uint8_t ** bytes, wz_uint32_t * size,
+           const wznode * node) {
+  wzfile * file = (node->n.info & WZ_LEVEL ?
+                   node->n.root.node->n.root.file : node->n.root.file);
+  wz_uint64_t pos;
+  wz_uint32_t len;
+  wz_uint8_t * buf;
+  switch (node->n.info & WZ_TYPE) {
+  case WZ_IMG: {
+    wzimg * img = node->n.val.img;
+    if (img == NULL)
+      WZ_ERR_RET(1);
+    pos = img->pos;
+    len = img->size;
+    break;
+  }
+  case WZ_AO: {
+    wzao * ao = node->n.val.ao;
+    if (ao == NULL)
+      WZ_ERR_RET(1);
+    pos = ao->pos;
+    len = ao->size;
+    if (ao->format == WZ_AUDIO_PCM)
+      len -= WZ_AUDIO_PCM_SIZE; /* the header is not stored in wz file */
+    break;
+  }
+  default:
+    WZ_ERR_RET(1);
+  }
+  if (file->map != NULL) {
+    * bytes = file->map + pos;
+    * size = len;
+    return 0;
+  }
+  if ((buf = malloc(len ? len : 1)) == NULL)
+    WZ_ERR_RET(1);
+  if (len && wz_read_io(buf, len, pos, file)) { /* bypass the cache */
+    free(buf);
+    WZ_ERR_RET(1);
+  }
+  * bytes = buf;
+  * size = len;
+  return 0;
+}
+
+int
+wz_free_raw(const wz_uint8_t * bytes, const wznode * node) {
+  wzfile * file = (node->n.info & WZ_LEVEL ?
+                   node->n.root.node->n.root.file : node->n.root.file);
+  union { const wz_uint8_t * c8; void * ptr; } buf;
+  if (file->map == NULL) {
+    buf.c8 = bytes;
+    free(buf.ptr);
+  }
+  return 0;
+}
+
 wznode *
 wz_open_node(wznode * node, const char * path) {
   wznode * link;
   wznode * root;
   wzfile * file;
-  wz_uint8_t * keys;
+  wzkeys * keys;
   char * search;
   wz_uint8_t found;
   link = NULL;
@@ -2542,12 +4710,13 @@ wz_open_node(wznode * node, const char * path) {
     root = NULL;
     file = node->n.root.file;
   }
-  keys = file->ctx->keys;
+  keys = file->keys;
   search = NULL;
   found = 0;
   for (;;) {
     const char * name;
     size_t name_len;
+    const wz_uint8_t * interned;
     wz_uint32_t len;
     wz_uint32_t i;
     wznode * nodes;
@@ -2557,7 +4726,8 @@ wz_open_node(wznode * node, const char * path) {
     if ((node->n.info & WZ_TYPE) >= WZ_UNK &&
         node->n.val.ary == NULL) {
       if (node->n.info & (WZ_LEVEL | WZ_LEAF)) {
-        if (wz_read_lv1(node, root, file, keys, 1))
+        if (wz_read_lv1(node, root, file, keys,
+                        file->raw ? WZ_LV1_SKIP : WZ_LV1_DECODE))
           WZ_ERR_GOTO(free_search);
       } else {
         if (wz_read_lv0(node, file, keys))
@@ -2618,13 +4788,24 @@ wz_open_node(wznode * node, const char * path) {
     default:
       WZ_ERR_GOTO(free_search);
     }
+    interned = NULL; /* na_e has the smallest buffer of embedded names */
+    if (file->names != NULL && name_len <= WZ_UINT8_MAX &&
+        name_len >= sizeof(nodes->na_e.name_buf) &&
+        wz_lookup_name(&interned, (const wz_uint8_t *) name,
+                       (wz_uint32_t) name_len, file->names))
+      WZ_ERR_GOTO(free_search);
     next = NULL;
     for (i = 0; i < len; i++) {
       wznode * child = nodes + i;
       wz_uint32_t name_len_ = child->n.name_len;
       wz_uint8_t * name_ = (child->n.info & WZ_EMBED ?
                             child->n.name_e : child->n.name);
-      if (name_len_ == name_len &&
+      if (child->n.info & WZ_INTERN) { /* the same name at the same place */
+        if (name_ == interned) {
+          next = child;
+          break;
+        }
+      } else if (name_len_ == name_len &&
           !strncmp((char *) name_, name, name_len)) {
         next = child;
         break;
@@ -2656,10 +4837,14 @@ wz_close_node(wznode * node) {
     node = stack[--stack_len];
     if (node == NULL) {
       node = stack[--stack_len];
-      if (node->n.info & (WZ_LEVEL | WZ_LEAF))
+      if (node->n.info & WZ_LEVEL) {
         wz_free_lv1(node);
-      else
+      } else if (node->n.info & WZ_LEAF) {
+        wz_free_lv1(node);
+        wz_drop_img(node);
+      } else {
         wz_free_lv0(node);
+      }
       continue;
     }
     if ((node->n.info & WZ_TYPE) <= WZ_UNK ||
@@ -2701,6 +4886,125 @@ free_stack:
   return ret;
 }
 
+static int /* decode the canvas whose compressed data has been read */
+wz_decode_req(wzreq * req, wzfile * file) {
+  wznode * node = req->node;
+  wznode * root = node->n.info & WZ_LEVEL ? node->n.root.node : node;
+  wzimg * img = node->n.val.img;
+  wz_uint8_t key = root->n.info & WZ_EMBED ? root->na_e.key : root->na.key;
+  req->bytes = NULL;
+  if (wz_read_bitmap((wzcolor **) &img->data, img->w, img->h, img->depth,
+                     img->scale, img->size, key, file->keys)) {
+    free(img->data);
+    img->data = NULL;
+    WZ_ERR_RET(1);
+  }
+  return 0;
+}
+
+static int
+wz_cmp_req(const void * a, const void * b) {
+  const wzreq * x = a;
+  const wzreq * y = b;
+  return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+int
+wz_load_node(wznode * node) {
+  int ret = 1;
+  wzfile * file = (node->n.info & WZ_LEVEL ?
+                   node->n.root.node->n.root.file : node->n.root.file);
+  wzkeys * keys = file->keys;
+  wz_uint32_t stack_capa = 1;
+  wz_uint32_t stack_len = 0;
+  wznode ** stack;
+  wz_uint32_t reqs_capa = 0;
+  wz_uint32_t reqs_len = 0;
+  wzreq * reqs = NULL;
+  wz_uint32_t i;
+  if ((stack = malloc(stack_capa * sizeof(* stack))) == NULL)
+    WZ_ERR_RET(ret);
+  stack[stack_len++] = node;
+  while (stack_len) {
+    wz_uint32_t req;
+    wz_uint32_t len;
+    wznode * nodes;
+    node = stack[--stack_len];
+    if ((node->n.info & WZ_TYPE) >= WZ_UNK &&
+        node->n.val.ary == NULL) {
+      if (node->n.info & (WZ_LEVEL | WZ_LEAF)) {
+        wznode * root = node->n.info & WZ_LEVEL ? node->n.root.node : node;
+        if (wz_read_lv1(node, root, file, keys, WZ_LV1_DEFER))
+          WZ_ERR_GOTO(free_reqs);
+        if ((node->n.info & WZ_TYPE) == WZ_IMG) { /* read later */
+          wzimg * img = node->n.val.img;
+          if (reqs_len == reqs_capa) {
+            wzreq * fit;
+            wz_uint32_t l = reqs_capa < 4 ? 4 : reqs_capa + reqs_capa / 4;
+            if ((fit = realloc(reqs, l * sizeof(* reqs))) == NULL) {
+              free(img->data);
+              img->data = NULL;
+              WZ_ERR_GOTO(free_reqs);
+            }
+            reqs = fit, reqs_capa = l;
+          }
+          reqs[reqs_len].pos = img->pos;
+          reqs[reqs_len].len = img->size;
+          reqs[reqs_len].read = 0;
+          reqs[reqs_len].bytes = img->data;
+          reqs[reqs_len].node = node;
+          reqs_len++;
+        }
+      } else {
+        if (wz_read_lv0(node, file, keys))
+          WZ_ERR_GOTO(free_reqs);
+      }
+    }
+    switch (node->n.info & WZ_TYPE) {
+    case WZ_ARY: {
+      wzary * ary = node->n.val.ary;
+      len   = ary->len;
+      nodes = ary->nodes;
+      break;
+    }
+    case WZ_IMG: {
+      wzimg * img = node->n.val.img;
+      len   = img->len;
+      nodes = img->nodes;
+      break;
+    }
+    default:
+      continue;
+    }
+    req = stack_len + len;
+    if (req > stack_capa) {
+      wznode ** fit;
+      wz_uint32_t l = stack_capa;
+      do { l = l < 4 ? 4 : l + l / 4; } while (l < req);
+      if ((fit = realloc(stack, l * sizeof(* stack))) == NULL)
+        WZ_ERR_GOTO(free_reqs);
+      stack = fit, stack_capa = l;
+    }
+    for (i = len; i--;)
+      stack[stack_len++] = nodes + i;
+  }
+  if (reqs_len)
+    qsort(reqs, reqs_len, sizeof(* reqs), wz_cmp_req);
+  ret = wz_read_batch(reqs, reqs_len, file, wz_decode_req);
+free_reqs:
+  for (i = 0; i < reqs_len; i++) { /* not read, not to be decoded */
+    wzreq * req = reqs + i;
+    if (req->bytes != NULL) {
+      wzimg * img = req->node->n.val.img;
+      free(img->data);
+      img->data = NULL;
+    }
+  }
+  free(reqs);
+  free(stack);
+  return ret;
+}
+
 wznode *
 wz_open_root(wzfile * file) {
   return wz_open_node(&file->root, "");
@@ -2755,143 +5059,315 @@ wz_open_node_at(wznode * node, wz_uint32_t i) {
   }
 }
 
-wzfile *
-wz_open_file(const char * filename, wzctx * ctx) {
+static wzfile * /* read the header and deduce the version through the io */
+wz_init_file(const wzio * io, wzctx * ctx) {
   wzfile * file = NULL;
-  FILE * raw;
-  long size_l;
-  wz_uint32_t size;
   wzfile tmp;
+  wzcur cur;
   wz_uint32_t start;
   wz_uint16_t enc;
   wz_uint16_t dec;
   wz_uint32_t hash;
-  wz_uint32_t addr;
+  wz_uint64_t addr;
+  wzkeys *    keys;
   wz_uint8_t  key;
-  if ((raw = fopen(filename, "rb")) == NULL) {
-    perror(filename);
-    return file;
-  }
-  if (fseek(raw, 0, SEEK_END)) {
-    perror(filename);
-    goto close_raw;
-  }
-  if ((size_l = ftell(raw)) < 0) {
-    perror(filename);
-    goto close_raw;
-  }
-  if (size_l > WZ_INT32_MAX) {
-    wz_error("The file is too large: %s\n", filename);
-    goto close_raw;
-  }
-  if (fseek(raw, 0, SEEK_SET)) {
-    perror(filename);
-    goto close_raw;
-  }
-  size = (wz_uint32_t) size_l;
-  tmp.raw = raw;
-  tmp.pos = 0;
-  tmp.size = size;
-  if (wz_seek(4 + 4 + 4, SEEK_CUR, &tmp) || /* ident + size + unk */
-      wz_read_le32(&start, &tmp) ||
-      wz_seek(start - tmp.pos, SEEK_CUR, &tmp) || /* copyright */
-      wz_read_le16(&enc, &tmp)) {
-    perror(filename);
-    goto close_raw;
+  wzrefs *    refs;
+  tmp.io = * io;
+  tmp.map = io->map != NULL ? io->map(io->user) : NULL;
+  tmp.cache = NULL;
+  tmp.refs = NULL;
+  tmp.read_end = 0;
+  memset(&tmp.stats, 0, sizeof(tmp.stats));
+  if (io->size(io->user, &tmp.size))
+    WZ_ERR_RET(file);
+  if (tmp.map == NULL && (tmp.cache = wz_init_cache()) == NULL)
+    WZ_ERR_RET(file);
+  cur.file = &tmp;
+  cur.pos = 0;
+  if (wz_seek(4 + 4 + 4, SEEK_CUR, &cur) || /* ident + size + unk */
+      wz_read_le32(&start, &cur) ||
+      wz_seek(start - cur.pos, SEEK_CUR, &cur) || /* copyright */
+      wz_read_le16(&enc, &cur))
+    WZ_ERR_GOTO(free_cache);
+  if ((addr = cur.pos) > WZ_UINT32_MAX)
+    WZ_ERR_GOTO(free_cache);
+  if (wz_deduce_ver(&dec, &hash, &keys, &key,
+                    enc, addr, start, &tmp, ctx))
+    WZ_ERR_GOTO(free_cache);
+  if ((refs = wz_init_refs()) == NULL)
+    WZ_ERR_GOTO(free_cache);
+  if ((file = malloc(sizeof(* file))) == NULL) {
+    (void) wz_free_refs(refs);
+    WZ_ERR_GOTO(free_cache);
   }
-  addr = tmp.pos;
-  if (wz_deduce_ver(&dec, &hash, &key,
-                    enc, addr, start, size, raw, ctx->keys))
-    WZ_ERR_GOTO(close_raw);
-  if ((file = malloc(sizeof(* file))) == NULL)
-    WZ_ERR_GOTO(close_raw);
   file->ctx = ctx;
-  file->raw = raw;
-  file->pos = 0;
-  file->size = size;
+  file->keys = keys;
+  file->io = tmp.io;
+  file->map = tmp.map;
+  file->cache = tmp.cache;
+  file->size = tmp.size;
   file->start = start;
   file->hash = hash;
   file->key = key;
+  file->raw = 0;
+  file->intern = 0;
+  file->names = NULL;
+  file->refs = refs;
+  file->read_end = tmp.read_end; /* the header is read already */
+  file->stats = tmp.stats;
   file->root.n.parent = NULL;
   file->root.n.root.file = file;
   file->root.n.info = WZ_ARY | WZ_EMBED;
   file->root.n.name_len = 0;
   file->root.n.name_e[0] = '\0';
-  file->root.na_e.addr = addr;
+  file->root.na_e.addr = (wz_uint32_t) addr;
   file->root.n.val.ary = NULL;
-close_raw:
-  if (file == NULL)
-    fclose(raw);
+free_cache:
+  if (file == NULL && tmp.cache != NULL)
+    (void) wz_free_cache(tmp.cache);
+  return file;
+}
+
+wzfile *
+wz_open_file(const char * filename, wzctx * ctx) {
+  wzfile * file = NULL;
+  wzio io;
+  if (ctx->open(&io, filename, ctx->open_user))
+    return file;
+  if ((file = wz_init_file(&io, ctx)) == NULL) {
+    wz_error("Failed to open the file: %s\n", filename);
+    if (io.close != NULL)
+      (void) io.close(io.user);
+  }
+  return file;
+}
+
+wzfile *
+wz_open_io(const wzio * io, wzctx * ctx) {
+  if (io->read_at == NULL || io->size == NULL)
+    WZ_ERR_RET(NULL);
+  return wz_init_file(io, ctx);
+}
+
+wzfile *
+wz_open_mem(const void * buf, size_t len, wzctx * ctx) {
+  wzfile * file = NULL;
+  wzmem * mem;
+  wzio io;
+  if ((mem = malloc(sizeof(* mem))) == NULL)
+    WZ_ERR_RET(file);
+  mem->buf = buf;
+  mem->size = len;
+  mem->own = 0;
+  io.user = mem;
+  io.read_at = wz_mem_read_at;
+  io.size = wz_mem_size;
+  io.map = wz_mem_map;
+  io.advise = NULL;
+  io.close = wz_mem_close;
+  if ((file = wz_init_file(&io, ctx)) == NULL)
+    free(mem);
   return file;
 }
 
+int
+wz_own_mem(wzfile * file) {
+  wzmem * mem;
+  if (file->io.close != wz_mem_close)
+    WZ_ERR_RET(1);
+  mem = file->io.user;
+  mem->own = 1;
+  return 0;
+}
+
+int
+wz_get_io_stats(wzfile * file, struct wz_io_stats * stats) {
+  wz_uint8_t i;
+  stats->reads = wz_load_stat(&file->stats.reads);
+  stats->bytes = wz_load_stat(&file->stats.bytes);
+  stats->forward = wz_load_stat(&file->stats.forward);
+  stats->backward = wz_load_stat(&file->stats.backward);
+  for (i = 0; i < WZ_IO_SEEKS_LEN; i++)
+    stats->seeks[i] = wz_load_stat(&file->stats.seeks[i]);
+  stats->ns = wz_load_stat(&file->stats.ns);
+  return 0;
+}
+
+int
+wz_keep_raw(wzfile * file, int raw) {
+  file->raw = raw != 0;
+  return 0;
+}
+
+int
+wz_intern_names(wzfile * file, int intern) {
+  if (intern && file->names == NULL &&
+      (file->names = wz_init_names()) == NULL)
+    WZ_ERR_RET(1);
+  file->intern = intern != 0;
+  return 0;
+}
+
+int
+wz_get_cache_stats(wz_uint64_t * hits, wz_uint64_t * misses,
+                   wz_uint64_t * bytes, wzfile * file) {
+  wzcache * cache = file->cache;
+  if (cache == NULL) {
+    * hits = * misses = * bytes = 0;
+    return 0;
+  }
+  if (wz_lock_mutex(&cache->mutex))
+    WZ_ERR_RET(1);
+  * hits = cache->hits;
+  * misses = cache->misses;
+  * bytes = cache->bytes;
+  return wz_unlock_mutex(&cache->mutex);
+}
+
+int
+wz_advise_file(wzfile * file, int advice) {
+  wzcache * cache = file->cache;
+  if (advice < WZ_ADVICE_NORMAL || advice > WZ_ADVICE_DONTNEED)
+    WZ_ERR_RET(1);
+  if (cache != NULL && advice <= WZ_ADVICE_RANDOM) {
+    if (wz_lock_mutex(&cache->mutex))
+      WZ_ERR_RET(1);
+    cache->ahead_max = advice == WZ_ADVICE_RANDOM ? 1 : WZ_CACHE_AHEAD_MAX;
+    if (cache->ahead > cache->ahead_max)
+      cache->ahead = cache->ahead_max;
+    if (wz_unlock_mutex(&cache->mutex))
+      WZ_ERR_RET(1);
+  }
+  return wz_advise_range(file, 0, 0, advice);
+}
+
+int
+wz_advise_node(wznode * node, int advice) {
+  wz_uint64_t pos;
+  wz_uint64_t len;
+  wz_uint32_t size;
+  if (advice < WZ_ADVICE_NORMAL || advice > WZ_ADVICE_DONTNEED)
+    WZ_ERR_RET(1);
+  if (node->n.info & WZ_LEVEL) /* inside of an image */
+    node = node->n.root.node;
+  if (node->n.info & WZ_LEAF) {
+    if ((node->n.info & WZ_TYPE) == WZ_NIL)
+      return 0;
+    wz_get_img_range(&pos, &size, node);
+    len = size;
+  } else { /* the span of the images in the directory */
+    wzary * ary = node->n.val.ary;
+    wz_uint64_t end = 0;
+    wz_uint32_t i;
+    if ((node->n.info & WZ_TYPE) != WZ_ARY || ary == NULL)
+      WZ_ERR_RET(1);
+    pos = (wz_uint64_t) -1;
+    for (i = 0; i < ary->len; i++) {
+      wznode * child = ary->nodes + i;
+      wz_uint64_t child_pos;
+      wz_uint32_t child_size;
+      if (!(child->n.info & WZ_LEAF) || (child->n.info & WZ_TYPE) == WZ_NIL)
+        continue;
+      wz_get_img_range(&child_pos, &child_size, child);
+      if (child_pos < pos)
+        pos = child_pos;
+      if (child_pos + child_size > end)
+        end = child_pos + child_size;
+    }
+    len = end > pos ? end - pos : 0;
+  }
+  if (!len) /* nothing to hint */
+    return 0;
+  return wz_advise_range(node->n.root.file, pos, len, advice);
+}
+
 int
 wz_close_file(wzfile * file) {
   wz_uint8_t ret = 0;
   if (wz_close_node(&file->root))
     ret = 1;
-  if (fclose(file->raw))
+  if (file->cache != NULL && wz_free_cache(file->cache))
+    ret = 1;
+  if (file->names != NULL && wz_free_names(file->names))
+    ret = 1;
+  if (file->refs != NULL && wz_free_refs(file->refs))
+    ret = 1;
+  if (file->io.close != NULL && file->io.close(file->io.user))
     ret = 1;
   free(file);
   return ret;
 }
 
-static void /* aes ofb */
-wz_encode_aes(wz_uint8_t * cipher, wz_uint32_t len,
-              wz_uint8_t * key, const wz_uint8_t * iv) {
-  aes256_context ctx;
-  wzptr cipher_c;
-  wzptr iv_c;
-  wz_uint32_t i;
-  wz_uint8_t j;
-  aes256_init(&ctx, key);
-  cipher_c.u8 = cipher;
-  iv_c.c8 = iv;
-  len >>= 4;
-  for (i = 0; i < len; i++) {
-    for (j = 0; j < 16 / 4; j++)
-      cipher_c.u32[j] = iv_c.c32[j];
-    aes256_encrypt_ecb(&ctx, cipher_c.u8);
-    iv_c = cipher_c, cipher_c.u8 += 16;
-  }
-  aes256_done(&ctx);
-}
-
 wzctx *
 wz_init_ctx(void) {
   wzctx * ctx = NULL;
-  wz_uint8_t aes_key[32];
-  wz_uint8_t aes_iv[16];
-  wzptr aes_key_c;
-  wzptr aes_iv_c;
-  wz_uint8_t * keys;
-  wz_uint8_t i;
-  wz_uint8_t j;
-  aes_key_c.u8 = aes_key;
-  for (i = 0; i < 32 / 4; i++)
-    aes_key_c.u32[i] = WZ_HTOLE32(wz_aes_key[i]);
-  aes_iv_c.u8 = aes_iv;
-  if ((keys = malloc(WZ_KEYS_LEN * WZ_KEY_UTF8_MAX_LEN)) == NULL)
+  wzprofile * profiles;
+  wzkeys * keys;
+  if ((keys = wz_hold_keys()) == NULL)
     WZ_ERR_RET(ctx);
-  for (i = 0; i < WZ_KEYS_LEN; i++) {
-    wz_uint32_t aes_iv4 = WZ_HTOLE32(wz_aes_ivs[i]);
-    for (j = 0; j < 16 / 4; j++)
-      aes_iv_c.u32[j] = aes_iv4;
-    wz_encode_aes(keys + i * WZ_KEY_UTF8_MAX_LEN, WZ_KEY_UTF8_MAX_LEN,
-                  aes_key, aes_iv);
-  }
+  if ((profiles = malloc(sizeof(* profiles))) == NULL)
+    WZ_ERR_GOTO(drop_keys);
+  if (wz_init_profile(profiles, keys))
+    WZ_ERR_GOTO(free_profiles);
   if ((ctx = malloc(sizeof(* ctx))) == NULL)
+    WZ_ERR_GOTO(free_profiles);
+  ctx->profiles = profiles;
+  ctx->profiles_len = 1;
+  ctx->open = wz_open_stdio;
+  ctx->open_user = NULL;
+  return ctx;
+free_profiles:
+  free(profiles);
+drop_keys:
+  (void) wz_drop_keys(keys);
+  return ctx;
+}
+
+int
+wz_add_keys(wzctx * ctx, const wz_uint32_t * ivs, wz_uint8_t len,
+            const wz_uint8_t * aes_key) {
+  int ret = 1;
+  wz_uint32_t keys_ivs[WZ_KEYS_LEN];
+  wzprofile * profiles;
+  wzkeys * keys;
+  wz_uint8_t i;
+  if (!len || len > WZ_KEYS_LEN || ctx->profiles_len == WZ_UINT8_MAX)
+    WZ_ERR_RET(ret);
+  for (i = 0; i < WZ_KEYS_LEN; i++) /* the last iv fills the rest */
+    keys_ivs[i] = ivs[i < len ? i : len - 1];
+  if ((keys = wz_init_keys(keys_ivs, aes_key)) == NULL)
+    WZ_ERR_RET(ret);
+  if ((profiles = realloc(ctx->profiles, (ctx->profiles_len + 1U) *
+                          sizeof(* profiles))) == NULL)
+    WZ_ERR_GOTO(free_keys);
+  ctx->profiles = profiles;
+  if (wz_init_profile(profiles + ctx->profiles_len, keys))
     WZ_ERR_GOTO(free_keys);
-  ctx->keys = keys;
+  ctx->profiles_len++;
+  ret = 0;
 free_keys:
-  if (ctx == NULL)
-    free(keys);
-  return ctx;
+  if (ret)
+    (void) wz_free_keys(keys);
+  return ret;
+}
+
+int
+wz_set_io(wzctx * ctx,
+          int (* open)(wzio * io, const char * filename, void * user),
+          void * user) {
+  ctx->open = open != NULL ? open : wz_open_stdio;
+  ctx->open_user = user;
+  return 0;
 }
 
 int
 wz_free_ctx(wzctx * ctx) {
-  free(ctx->keys);
+  int ret = wz_drop_keys(ctx->profiles[0].keys);
+  wz_uint8_t i;
+  for (i = 1; i < ctx->profiles_len; i++)
+    if (wz_free_keys(ctx->profiles[i].keys))
+      ret = 1;
+  free(ctx->profiles);
   free(ctx);
-  return 0;
+  return ret;
 }
@@ -0,0 +1,73 @@
+#include "predef.h"
+
+#ifdef WZ_MSVC
+#  pragma warning(push, 3)
+#endif
+
+#include <stdio.h>
+
+#ifdef WZ_MSVC
+#  pragma warning(pop)
+#endif
+
+#include "file.c"
+
+/* gen_keys - write the keys expanded by wz_init_ctx as a header, which is
+   included by the library built without WZ_RUNTIME_KEYS. The masks of each
+   encoding combined with the keys are written along with them.
+   usage: gen_keys <header> */
+
+static void
+put_array(FILE * raw, const char * name,
+          const wz_uint8_t * bytes, wz_uint32_t len) {
+  wz_uint32_t i;
+  fprintf(raw,
+          "\n"
+          "static const wz_uint8_t %s[0x%"WZ_PRIx32"] = {\n", name, len);
+  for (i = 0; i < len; i++)
+    fprintf(raw, "%s0x%02x%s", i % 12 ? " " : "  ",
+            (unsigned int) bytes[i],
+            i + 1 == len ? "\n" : i % 12 == 11 ? ",\n" : ",");
+  fprintf(raw, "};\n");
+}
+
+int
+main(int argc, char ** argv) {
+  int ret = 1;
+  wzctx * ctx;
+  wzkeys * built_in;
+  FILE * raw;
+  wz_uint32_t masks_len = (WZ_KEY_EMPTY + 1) * WZ_KEY_ASCII_MAX_LEN;
+  const wz_uint8_t * keys;
+  const wz_uint8_t * ascii;
+  const wz_uint8_t * utf16;
+  if (argc != 2) {
+    fprintf(stderr, "usage: gen_keys <header>\n");
+    return ret;
+  }
+  if ((ctx = wz_init_ctx()) == NULL)
+    return ret;
+  built_in = ctx->profiles[0].keys;
+  if ((keys = wz_get_key(built_in, 0, WZ_KEY_UTF8_MAX_LEN)) == NULL ||
+      (ascii = wz_get_mask(built_in, 0, WZ_ENC_CP1252,
+                           WZ_KEY_ASCII_MAX_LEN)) == NULL ||
+      (utf16 = wz_get_mask(built_in, 0, WZ_ENC_UTF16LE,
+                           WZ_KEY_ASCII_MAX_LEN)) == NULL ||
+      (raw = fopen(argv[1], "w")) == NULL)
+    goto free_ctx;
+  fprintf(raw, "/* Generated by gen_keys, do not edit. */\n");
+  put_array(raw, "wz_keys", keys, WZ_KEYS_LEN * WZ_KEY_UTF8_MAX_LEN);
+  put_array(raw, "wz_keys_ascii", ascii, masks_len);
+  put_array(raw, "wz_keys_utf16", utf16, masks_len);
+  if (ferror(raw))
+    goto close_raw;
+  ret = 0;
+close_raw:
+  if (fclose(raw))
+    ret = 1;
+  if (ret)
+    remove(argv[1]);
+free_ctx:
+  wz_free_ctx(ctx);
+  return ret;
+}
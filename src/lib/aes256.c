@@ -19,18 +19,37 @@
 */
 #include "aes256.h"
 
+/* AES256_BYTE_ORIENTED keeps the original encryption, which is slow but
+ * small. Otherwise blocks are encrypted by AES-NI if the CPU has it, or by
+ * a T-table. */
+#ifndef AES256_BYTE_ORIENTED
+#  if (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || \
+       (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))) && \
+      (defined(__x86_64__) || defined(__i386__))
+#    define AES_NI_GNUC
+#    include <cpuid.h>
+#    include <wmmintrin.h>
+#  elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#    define AES_NI_MSVC
+#    include <intrin.h>
+#    include <wmmintrin.h>
+#  endif
+#endif
+
 #define FD(x)  (((x) >> 1) ^ (((x) & 1) ? 0x8d : 0))
 
 #define BACK_TO_TABLES
 
 static uint8_t rj_xtime(uint8_t);
+#ifdef AES256_BYTE_ORIENTED
 static void aes_subBytes(uint8_t *);
+static void aes_shiftRows(uint8_t *);
+static void aes_mixColumns(uint8_t *);
+#endif
 static void aes_subBytes_inv(uint8_t *);
 static void aes_addRoundKey(uint8_t *, uint8_t *);
 static void aes_addRoundKey_cpy(uint8_t *, uint8_t *, uint8_t *);
-static void aes_shiftRows(uint8_t *);
 static void aes_shiftRows_inv(uint8_t *);
-static void aes_mixColumns(uint8_t *);
 static void aes_mixColumns_inv(uint8_t *);
 static void aes_expandEncKey(uint8_t *, uint8_t *);
 static void aes_expandDecKey(uint8_t *, uint8_t *);
@@ -190,6 +209,7 @@ static uint8_t rj_xtime(uint8_t x)
     return (x & 0x80) ? (y ^ 0x1b) : y;
 } /* rj_xtime */
 
+#ifdef AES256_BYTE_ORIENTED
 /* -------------------------------------------------------------------------- */
 static void aes_subBytes(uint8_t *buf)
 {
@@ -197,6 +217,7 @@ static void aes_subBytes(uint8_t *buf)
 
     while (i--) buf[i] = rj_sbox(buf[i]);
 } /* aes_subBytes */
+#endif
 
 /* -------------------------------------------------------------------------- */
 static void aes_subBytes_inv(uint8_t *buf)
@@ -223,6 +244,7 @@ static void aes_addRoundKey_cpy(uint8_t *buf, uint8_t *key, uint8_t *cpk)
 } /* aes_addRoundKey_cpy */
 
 
+#ifdef AES256_BYTE_ORIENTED
 /* -------------------------------------------------------------------------- */
 static void aes_shiftRows(uint8_t *buf)
 {
@@ -234,6 +256,7 @@ static void aes_shiftRows(uint8_t *buf)
     j = buf[14], buf[14] = buf[6], buf[6]  = j;
 
 } /* aes_shiftRows */
+#endif
 
 /* -------------------------------------------------------------------------- */
 static void aes_shiftRows_inv(uint8_t *buf)
@@ -247,6 +270,7 @@ static void aes_shiftRows_inv(uint8_t *buf)
 
 } /* aes_shiftRows_inv */
 
+#ifdef AES256_BYTE_ORIENTED
 /* -------------------------------------------------------------------------- */
 static void aes_mixColumns(uint8_t *buf)
 {
@@ -265,6 +289,7 @@ static void aes_mixColumns(uint8_t *buf)
         buf[i + 3] ^= e ^ rj_xtime(d ^ a);
     }
 } /* aes_mixColumns */
+#endif
 
 /* -------------------------------------------------------------------------- */
 void aes_mixColumns_inv(uint8_t *buf)
@@ -335,13 +360,170 @@ void aes_expandDecKey(uint8_t *k, uint8_t *rc)
 } /* aes_expandDecKey */
 
 
+#ifndef AES256_BYTE_ORIENTED
+
+typedef unsigned int aes_u32; /* 32 bits on every supported target */
+
+/* subBytes and mixColumns of one byte: 02 01 01 03 times the sbox */
+static const aes_u32 te0[256] =
+{
+    0xc66363a5, 0xf87c7c84, 0xee777799, 0xf67b7b8d, 0xfff2f20d, 0xd66b6bbd,
+    0xde6f6fb1, 0x91c5c554, 0x60303050, 0x02010103, 0xce6767a9, 0x562b2b7d,
+    0xe7fefe19, 0xb5d7d762, 0x4dababe6, 0xec76769a, 0x8fcaca45, 0x1f82829d,
+    0x89c9c940, 0xfa7d7d87, 0xeffafa15, 0xb25959eb, 0x8e4747c9, 0xfbf0f00b,
+    0x41adadec, 0xb3d4d467, 0x5fa2a2fd, 0x45afafea, 0x239c9cbf, 0x53a4a4f7,
+    0xe4727296, 0x9bc0c05b, 0x75b7b7c2, 0xe1fdfd1c, 0x3d9393ae, 0x4c26266a,
+    0x6c36365a, 0x7e3f3f41, 0xf5f7f702, 0x83cccc4f, 0x6834345c, 0x51a5a5f4,
+    0xd1e5e534, 0xf9f1f108, 0xe2717193, 0xabd8d873, 0x62313153, 0x2a15153f,
+    0x0804040c, 0x95c7c752, 0x46232365, 0x9dc3c35e, 0x30181828, 0x379696a1,
+    0x0a05050f, 0x2f9a9ab5, 0x0e070709, 0x24121236, 0x1b80809b, 0xdfe2e23d,
+    0xcdebeb26, 0x4e272769, 0x7fb2b2cd, 0xea75759f, 0x1209091b, 0x1d83839e,
+    0x582c2c74, 0x341a1a2e, 0x361b1b2d, 0xdc6e6eb2, 0xb45a5aee, 0x5ba0a0fb,
+    0xa45252f6, 0x763b3b4d, 0xb7d6d661, 0x7db3b3ce, 0x5229297b, 0xdde3e33e,
+    0x5e2f2f71, 0x13848497, 0xa65353f5, 0xb9d1d168, 0x00000000, 0xc1eded2c,
+    0x40202060, 0xe3fcfc1f, 0x79b1b1c8, 0xb65b5bed, 0xd46a6abe, 0x8dcbcb46,
+    0x67bebed9, 0x7239394b, 0x944a4ade, 0x984c4cd4, 0xb05858e8, 0x85cfcf4a,
+    0xbbd0d06b, 0xc5efef2a, 0x4faaaae5, 0xedfbfb16, 0x864343c5, 0x9a4d4dd7,
+    0x66333355, 0x11858594, 0x8a4545cf, 0xe9f9f910, 0x04020206, 0xfe7f7f81,
+    0xa05050f0, 0x783c3c44, 0x259f9fba, 0x4ba8a8e3, 0xa25151f3, 0x5da3a3fe,
+    0x804040c0, 0x058f8f8a, 0x3f9292ad, 0x219d9dbc, 0x70383848, 0xf1f5f504,
+    0x63bcbcdf, 0x77b6b6c1, 0xafdada75, 0x42212163, 0x20101030, 0xe5ffff1a,
+    0xfdf3f30e, 0xbfd2d26d, 0x81cdcd4c, 0x180c0c14, 0x26131335, 0xc3ecec2f,
+    0xbe5f5fe1, 0x359797a2, 0x884444cc, 0x2e171739, 0x93c4c457, 0x55a7a7f2,
+    0xfc7e7e82, 0x7a3d3d47, 0xc86464ac, 0xba5d5de7, 0x3219192b, 0xe6737395,
+    0xc06060a0, 0x19818198, 0x9e4f4fd1, 0xa3dcdc7f, 0x44222266, 0x542a2a7e,
+    0x3b9090ab, 0x0b888883, 0x8c4646ca, 0xc7eeee29, 0x6bb8b8d3, 0x2814143c,
+    0xa7dede79, 0xbc5e5ee2, 0x160b0b1d, 0xaddbdb76, 0xdbe0e03b, 0x64323256,
+    0x743a3a4e, 0x140a0a1e, 0x924949db, 0x0c06060a, 0x4824246c, 0xb85c5ce4,
+    0x9fc2c25d, 0xbdd3d36e, 0x43acacef, 0xc46262a6, 0x399191a8, 0x319595a4,
+    0xd3e4e437, 0xf279798b, 0xd5e7e732, 0x8bc8c843, 0x6e373759, 0xda6d6db7,
+    0x018d8d8c, 0xb1d5d564, 0x9c4e4ed2, 0x49a9a9e0, 0xd86c6cb4, 0xac5656fa,
+    0xf3f4f407, 0xcfeaea25, 0xca6565af, 0xf47a7a8e, 0x47aeaee9, 0x10080818,
+    0x6fbabad5, 0xf0787888, 0x4a25256f, 0x5c2e2e72, 0x381c1c24, 0x57a6a6f1,
+    0x73b4b4c7, 0x97c6c651, 0xcbe8e823, 0xa1dddd7c, 0xe874749c, 0x3e1f1f21,
+    0x964b4bdd, 0x61bdbddc, 0x0d8b8b86, 0x0f8a8a85, 0xe0707090, 0x7c3e3e42,
+    0x71b5b5c4, 0xcc6666aa, 0x904848d8, 0x06030305, 0xf7f6f601, 0x1c0e0e12,
+    0xc26161a3, 0x6a35355f, 0xae5757f9, 0x69b9b9d0, 0x17868691, 0x99c1c158,
+    0x3a1d1d27, 0x279e9eb9, 0xd9e1e138, 0xebf8f813, 0x2b9898b3, 0x22111133,
+    0xd26969bb, 0xa9d9d970, 0x078e8e89, 0x339494a7, 0x2d9b9bb6, 0x3c1e1e22,
+    0x15878792, 0xc9e9e920, 0x87cece49, 0xaa5555ff, 0x50282878, 0xa5dfdf7a,
+    0x038c8c8f, 0x59a1a1f8, 0x09898980, 0x1a0d0d17, 0x65bfbfda, 0xd7e6e631,
+    0x844242c6, 0xd06868b8, 0x824141c3, 0x299999b0, 0x5a2d2d77, 0x1e0f0f11,
+    0x7bb0b0cb, 0xa85454fc, 0x6dbbbbd6, 0x2c16163a
+};
+
+#define ROR8(x)  (((x) >> 8) | ((x) << 24))
+#define ROR16(x) (((x) >> 16) | ((x) << 16))
+#define ROR24(x) (((x) >> 24) | ((x) << 8))
+#define GETU32(p) ((aes_u32)(p)[0] << 24 | (aes_u32)(p)[1] << 16 | \
+                   (aes_u32)(p)[2] << 8  | (aes_u32)(p)[3])
+#define PUTU32(p, x) ((p)[0] = (uint8_t)((x) >> 24), \
+                      (p)[1] = (uint8_t)((x) >> 16), \
+                      (p)[2] = (uint8_t)((x) >> 8),  \
+                      (p)[3] = (uint8_t)(x))
+#define TE(a, b, c, d) (te0[(a) >> 24] ^ ROR8(te0[((b) >> 16) & 0xff]) ^ \
+                        ROR16(te0[((c) >> 8) & 0xff]) ^ ROR24(te0[(d) & 0xff]))
+#define TE_LAST(a, b, c, d) ((aes_u32)rj_sbox((a) >> 24) << 24 ^ \
+                             (aes_u32)rj_sbox(((b) >> 16) & 0xff) << 16 ^ \
+                             (aes_u32)rj_sbox(((c) >> 8) & 0xff) << 8 ^ \
+                             (aes_u32)rj_sbox((d) & 0xff))
+
+/* -------------------------------------------------------------------------- */
+static void aes_encrypt_table(const uint8_t *rk, uint8_t *buf)
+{
+    aes_u32 s0, s1, s2, s3, t0, t1, t2, t3;
+    uint8_t i;
+
+    s0 = GETU32(buf) ^ GETU32(rk);
+    s1 = GETU32(buf + 4) ^ GETU32(rk + 4);
+    s2 = GETU32(buf + 8) ^ GETU32(rk + 8);
+    s3 = GETU32(buf + 12) ^ GETU32(rk + 12);
+    for (i = 1; i < 14; ++i)
+    {
+        rk += 16;
+        t0 = TE(s0, s1, s2, s3) ^ GETU32(rk);
+        t1 = TE(s1, s2, s3, s0) ^ GETU32(rk + 4);
+        t2 = TE(s2, s3, s0, s1) ^ GETU32(rk + 8);
+        t3 = TE(s3, s0, s1, s2) ^ GETU32(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+    rk += 16;
+    t0 = TE_LAST(s0, s1, s2, s3) ^ GETU32(rk);
+    t1 = TE_LAST(s1, s2, s3, s0) ^ GETU32(rk + 4);
+    t2 = TE_LAST(s2, s3, s0, s1) ^ GETU32(rk + 8);
+    t3 = TE_LAST(s3, s0, s1, s2) ^ GETU32(rk + 12);
+    PUTU32(buf, t0);
+    PUTU32(buf + 4, t1);
+    PUTU32(buf + 8, t2);
+    PUTU32(buf + 12, t3);
+} /* aes_encrypt_table */
+
+#if defined(AES_NI_GNUC) || defined(AES_NI_MSVC)
+
+/* -------------------------------------------------------------------------- */
+static uint8_t aes_has_ni(void)
+{
+#ifdef AES_NI_GNUC
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+#else
+    int r[4];
+    unsigned int c, d;
+
+    __cpuid(r, 1);
+    c = (unsigned int)r[2], d = (unsigned int)r[3];
+#endif
+    return (uint8_t)((c >> 25) & (d >> 26) & 1); /* aes and sse2 */
+} /* aes_has_ni */
+
+/* -------------------------------------------------------------------------- */
+#ifdef AES_NI_GNUC
+__attribute__((target("aes,sse2")))
+#endif
+static void aes_encrypt_ni(const uint8_t *rk, uint8_t *buf)
+{
+    __m128i s;
+    uint8_t i;
+
+    s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)buf),
+                      _mm_loadu_si128((const __m128i *)rk));
+    for (i = 1; i < 14; ++i)
+        s = _mm_aesenc_si128(s, _mm_loadu_si128((const __m128i *)(rk + 16 * i)));
+    s = _mm_aesenclast_si128(s, _mm_loadu_si128((const __m128i *)(rk + 16 * 14)));
+    _mm_storeu_si128((__m128i *)buf, s);
+} /* aes_encrypt_ni */
+
+#endif
+
+#endif /* AES256_BYTE_ORIENTED */
+
 /* -------------------------------------------------------------------------- */
 void aes256_init(aes256_context *ctx, uint8_t *k)
 {
     uint8_t rcon = 1;
     register uint8_t i;
+#ifndef AES256_BYTE_ORIENTED
+    uint8_t j;
+#endif
 
     for (i = 0; i < sizeof(ctx->key); i++) ctx->enckey[i] = ctx->deckey[i] = k[i];
+#ifndef AES256_BYTE_ORIENTED
+    /* the round keys are the key followed by the halves of each expansion */
+    for (i = 0; i < sizeof(ctx->key); i++) ctx->key[i] = ctx->rk[i] = k[i];
+    for (i = 2; i < 15; i += 2)
+    {
+        aes_expandEncKey(ctx->key, &rcon);
+        for (j = 0; j < 16; j++) ctx->rk[16 * i + j] = ctx->key[j];
+        if (i < 14) for (j = 0; j < 16; j++) ctx->rk[16 * i + 16 + j] = ctx->key[16 + j];
+    }
+    rcon = 1;
+#if defined(AES_NI_GNUC) || defined(AES_NI_MSVC)
+    ctx->ni = aes_has_ni();
+#else
+    ctx->ni = 0;
+#endif
+#endif
     for (i = 8; --i;) aes_expandEncKey(ctx->deckey, &rcon);
 } /* aes256_init */
 
@@ -352,11 +534,15 @@ void aes256_done(aes256_context *ctx)
 
     for (i = 0; i < sizeof(ctx->key); i++)
         ctx->key[i] = ctx->enckey[i] = ctx->deckey[i] = 0;
+#ifndef AES256_BYTE_ORIENTED
+    for (i = 0; i < sizeof(ctx->rk); i++) ctx->rk[i] = 0;
+#endif
 } /* aes256_done */
 
 /* -------------------------------------------------------------------------- */
 void aes256_encrypt_ecb(aes256_context *ctx, uint8_t *buf)
 {
+#ifdef AES256_BYTE_ORIENTED
     uint8_t i, rcon;
 
     aes_addRoundKey_cpy(buf, ctx->enckey, ctx->key);
@@ -372,6 +558,13 @@ void aes256_encrypt_ecb(aes256_context *ctx, uint8_t *buf)
     aes_shiftRows(buf);
     aes_expandEncKey(ctx->key, &rcon);
     aes_addRoundKey(buf, ctx->key);
+#else
+#if defined(AES_NI_GNUC) || defined(AES_NI_MSVC)
+    if (ctx->ni) aes_encrypt_ni(ctx->rk, buf);
+    else
+#endif
+    aes_encrypt_table(ctx->rk, buf);
+#endif
 } /* aes256_encrypt */
 
 /* -------------------------------------------------------------------------- */
@@ -29,6 +29,8 @@ extern "C" {
         uint8_t key[32]; 
         uint8_t enckey[32]; 
         uint8_t deckey[32];
+        uint8_t rk[240]; /* round keys of encryption */
+        uint8_t ni;      /* encrypt by AES-NI */
     } aes256_context; 
 
 
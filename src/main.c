@@ -97,7 +97,7 @@ cmd_help(int argc, char ** argv) {
   else if (func == cmd_time)
     printf("usage: wz time <file> [<file>...]\n"
            "\n"
-           "Timing of parsing wz file(s).\n");
+           "Timing of parsing wz file(s), and the reads of each file.\n");
   return 0;
 }
 
@@ -299,6 +299,24 @@ free_ctx:
   return ret;
 }
 
+static void
+print_io_stats(wzfile * file) {
+  struct wz_io_stats stats;
+  int i;
+  if (wz_get_io_stats(file, &stats))
+    return;
+  printf("  reads: %"WZ_PRIu64", bytes: %"WZ_PRIu64", "
+         "waited %"WZ_PRIu64".%09"WZ_PRIu64" seconds\n",
+         stats.reads, stats.bytes,
+         stats.ns / 1000000000, stats.ns % 1000000000);
+  printf("  seeks: %"WZ_PRIu64" forward, %"WZ_PRIu64" backward, "
+         "by distance in 16^i bytes:",
+         stats.forward, stats.backward);
+  for (i = 0; i < WZ_IO_SEEKS_LEN; i++)
+    printf(" %"WZ_PRIu64, stats.seeks[i]);
+  printf("\n");
+}
+
 static int
 cmd_time(int argc, char ** argv) {
   /* wz time <file> [<file>...] */
@@ -353,6 +371,7 @@ cmd_time(int argc, char ** argv) {
         err = 1;
         goto close_file;
       }
+      print_io_stats(file);
 close_file:
       wz_close_file(file);
     } else {
@@ -9,6 +9,7 @@
 #define WZ_UINT8_MAX  255
 #define WZ_UINT16_MAX 65535
 #define WZ_INT32_MAX  2147483647
+#define WZ_UINT32_MAX 4294967295U
 
 #if defined(WZ_MSVC)
 # define WZ_PRId32 "I32d"
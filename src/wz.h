@@ -12,6 +12,8 @@
 #  define WZ_ARCH_32
 #endif
 
+#include <stddef.h>
+
 typedef   signed char  wz_int8_t;   /**< 8 bit signed integer */
 typedef   signed short wz_int16_t;  /**< 16 bit signed integer */
 typedef   signed int   wz_int32_t;  /**< 32 bit signed integer */
@@ -43,16 +45,60 @@ typedef union wznode wznode;
 
 /** wzfile is used to open and close wz file. After opened the wz file,
  * the root of wznode can be accessed by wz_open_root(). wzfile can be
- * accessed by wz_open_file() with already initialized wzctx. */
+ * accessed by wz_open_file() with already initialized wzctx. Reads from a
+ * wzfile are positioned and keep no shared stream offset, so different
+ * nodes of the same wzfile may be read from different threads at once. */
 typedef struct wzfile wzfile;
 
 /** wzctx is used to prepare the context that every wzfile needed. For example,
  * the AES keys for decrypting the wz file are stored in wzctx. wzfile uses
  * these keys to decrypt the wz file. One wzctx is enough for one program
- * though multiple wzctx is safe because each wzctx is individual and has no
- * side effect. */
+ * though multiple wzctx is safe and cheap because every wzctx of the process
+ * shares the same read-only keys and has no other side effect. */
 typedef struct wzctx wzctx;
 
+/** wzio is the storage backend of wzfile. Every read of wzfile goes through
+ * @p read_at with an absolute position, so the backend needs no seek state
+ * and may be called from multiple threads at once. */
+typedef struct wzio {
+  void * user; /**< passed to every callback as the first argument */
+  /** Read exactly @p len bytes at @p pos into @p buf.
+   * @return 0 if succeed, 1 if error occurred. */
+  int (* read_at)(void * user, void * buf, wz_uint32_t len, wz_uint64_t pos);
+  /** Get the size of the file.
+   * @return 0 if succeed, 1 if error occurred. */
+  int (* size)(void * user, wz_uint64_t * size);
+  /** Optional. Get the whole file in memory, which is read in place instead
+   * of calling @p read_at. It may be NULL or return NULL. */
+  const void * (* map)(void * user);
+  /** Optional. Hint the kernel how @p len bytes at @p pos will be read.
+   * @p advice is one of #WZ_ADVICE_NORMAL, #WZ_ADVICE_SEQUENTIAL,
+   * #WZ_ADVICE_RANDOM, #WZ_ADVICE_WILLNEED, and #WZ_ADVICE_DONTNEED.
+   * @return 0 if succeed, 1 if error occurred. */
+  int (* advise)(void * user, wz_uint64_t pos, wz_uint64_t len, int advice);
+  /** Optional. Release the backend when wz_close_file() is called.
+   * @return 0 if succeed, 1 if error occurred. */
+  int (* close)(void * user);
+} wzio;
+
+enum {
+  WZ_IO_SEEKS_LEN = 8 /**< The number of buckets of wz_io_stats::seeks. */
+};
+
+/** wz_io_stats is the counters of the reads of wzfile, see
+ * wz_get_io_stats(). A seek is a read which does not start where the
+ * previous read ended. */
+struct wz_io_stats {
+  wz_uint64_t reads;    /**< read calls */
+  wz_uint64_t bytes;    /**< bytes read */
+  wz_uint64_t forward;  /**< seeks forward */
+  wz_uint64_t backward; /**< seeks backward */
+  /** Seeks by distance: @p seeks[i] counts the distances from 16^i to
+   * 16^(i+1) - 1 bytes, and the last bucket counts the longer ones too. */
+  wz_uint64_t seeks[WZ_IO_SEEKS_LEN];
+  wz_uint64_t ns;       /**< nanoseconds spent waiting for the backend */
+};
+
 enum {
   WZ_NIL, /**< a node with nothing */
   WZ_I16, /**< a node with wz_int16_t */
@@ -90,6 +136,16 @@ enum { /* microsoft define these values in Mmreg.h */
                           * (https://en.wikipedia.org/wiki/MP3). */
 };
 
+enum {
+  WZ_ADVICE_NORMAL,     /**< No particular order of reads. */
+  WZ_ADVICE_SEQUENTIAL, /**< Reads go forward, e.g. wz_parse_file(). */
+  WZ_ADVICE_RANDOM,     /**< Reads jump around, e.g. lookups by
+                         * wz_open_node() in a running server. */
+  WZ_ADVICE_WILLNEED,   /**< The bytes will be read soon, prefetch them. */
+  WZ_ADVICE_DONTNEED    /**< The bytes will not be read soon, their pages
+                         * may be dropped from the page cache. */
+};
+
 /** Get type of wznode. The type can be #WZ_NIL, #WZ_I16, #WZ_I32, #WZ_I64,
  * #WZ_F32, #WZ_F64, #WZ_VEC, #WZ_UNK, #WZ_ARY, #WZ_IMG, #WZ_VEX, #WZ_AO,
  * or #WZ_STR. */
@@ -156,6 +212,24 @@ int          wz_get_vec(wz_int32_t * x, wz_int32_t * y, const wznode * node);
 wz_uint8_t * wz_get_ao(wz_uint32_t * size, wz_uint32_t * ms,
                        wz_uint16_t * format, const wznode * node);
 
+/** Get the bytes of wznode with type #WZ_IMG or #WZ_AO as stored in wz
+ * file, neither copied nor decoded: the compressed image, or the audio
+ * without header. If the file is in memory (wz_open_mem() or mapped by
+ * wz_open_file()), @p bytes points into it. Otherwise the bytes are read
+ * into a new buffer.
+ * @note @p bytes should be released by wz_free_raw() before the node is
+ * closed.
+ * @param[out] bytes the bytes
+ * @param[out] size the number of bytes
+ * @param[in] node the node
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_get_raw(const wz_uint8_t ** bytes, wz_uint32_t * size,
+                        const wznode * node);
+
+/** Release the bytes returned by wz_get_raw().
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_free_raw(const wz_uint8_t * bytes, const wznode * node);
+
 /** Get the child wznode of wznode with given @p path.
  * @note the children of wznode would be freed after wz_close_node()
  * or wz_close_file() called. The pointer to any child of wznode would
@@ -191,28 +265,130 @@ int          wz_close_node(wznode * node);
  * @return the wzfile. Return NULL if error occurred. */
 wzfile *     wz_open_file(const char * filename, wzctx * ctx);
 
+/** Open the wz file which is already loaded in memory at @p buf with
+ * @p len bytes. The buffer is read in place without copying and must stay
+ * valid until wz_close_file() is called.
+ * @note To prevent memory leak, please make sure wz_close_file() is
+ * called after wz_open_mem() succeed.
+ * @return the wzfile. Return NULL if error occurred. */
+wzfile *     wz_open_mem(const void * buf, size_t len, wzctx * ctx);
+
+/** Open the wz file through the backend @p io, which is copied.
+ * @note The backend is not closed if the function failed.
+ * @return the wzfile. Return NULL if error occurred. */
+wzfile *     wz_open_io(const wzio * io, wzctx * ctx);
+
+/** Let the wzfile opened by wz_open_mem() take the ownership of its buffer.
+ * The buffer must be allocated by malloc() and will be freed by
+ * wz_close_file().
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_own_mem(wzfile * file);
+
+/** Read the whole subtree of @p node at once, so the wznodes under it can be
+ * opened by wz_open_node() without reading the file. The compressed data of
+ * all canvases in the subtree are read in one batch sorted by position, by
+ * io_uring if the file is not in memory and the kernel allows it, or by a
+ * few threads otherwise, and each canvas is decoded as its read completes.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_load_node(wznode * node);
+
 /** Get the root wznode of wzfile.
  * @return the root wznode. Return NULL if error occurred. */
 wznode *     wz_open_root(wzfile * file);
 
-/** Parse the whole wz file.
+/** Parse the whole wz file, hinting #WZ_ADVICE_SEQUENTIAL, see
+ * wz_parse_file_advised().
  * @note The function is intended for benchmarking the parsing speed.
  * If you want to get data from wz file, please use wz_open_root() instead.
  * @return 0 if succeed, 1 if error occurred. */
 int          wz_parse_file(wzfile * file);
 
+/** Parse the whole wz file like wz_parse_file(). @p advice is given to
+ * wz_advise_file() before parsing. #WZ_ADVICE_SEQUENTIAL and
+ * #WZ_ADVICE_RANDOM are reset to #WZ_ADVICE_NORMAL after parsing.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_parse_file_advised(wzfile * file, int advice);
+
+/** Hint how the whole wzfile will be read. #WZ_ADVICE_RANDOM also stops the
+ * block cache from reading ahead until #WZ_ADVICE_NORMAL or
+ * #WZ_ADVICE_SEQUENTIAL is given. Hints are ignored by the backends which
+ * do not support them.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_advise_file(wzfile * file, int advice);
+
+/** Hint how the image which contains @p node will be read, or the images in
+ * @p node if it is a loaded directory, e.g. #WZ_ADVICE_WILLNEED before
+ * opening a subtree.
+ * @note wz_close_node() gives #WZ_ADVICE_DONTNEED to the large images
+ * it frees.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_advise_node(wznode * node, int advice);
+
+/** Keep the images and audio opened by wz_open_node() afterwards in wz
+ * file if @p raw is non-zero. They are neither read nor decoded, so
+ * wz_get_img() and wz_get_ao() return NULL for them, while wz_get_raw()
+ * still works. Images loaded by wz_load_node() are not affected.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_keep_raw(wzfile * file, int raw);
+
+/** Share the names of the wznodes opened afterwards in wz file if
+ * @p intern is non-zero. A name too long to be embedded in wznode is then
+ * kept once in wz file until wz_close_file() instead of once per wznode,
+ * and wz_open_node() matches it by its address. The shorter names are still
+ * embedded and matched by their bytes.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_intern_names(wzfile * file, int intern);
+
+/** Get the counters of the block cache, which serves the reads of wzfile
+ * if the file is not in memory. @p hits and @p misses are the lookups found
+ * and not found in the cache, @p bytes is the number of bytes read from the
+ * backend. All of them are 0 if the file is in memory.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_get_cache_stats(wz_uint64_t * hits, wz_uint64_t * misses,
+                                wz_uint64_t * bytes, wzfile * file);
+
+/** Get the counters of the reads of wzfile from its backend, including the
+ * blocks read into the cache. A file in memory reads nothing from it.
+ * @note The counters are updated atomically by every thread, but the reads
+ * of several threads interleave, so the seeks count the jumps between them.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_get_io_stats(wzfile * file, struct wz_io_stats * stats);
+
 /** Close the wzfile.
  * @note This function will call wz_close_node() to free all of wznode
  * under the wzfile.
  * @return 0 if succeed, 1 if error occurred. */
 int          wz_close_file(wzfile * file);
 
-/** Initialize the wzctx.
+/** Initialize the wzctx. The keys are generated when the library is built,
+ * unless it is configured with WZ_RUNTIME_KEYS, which expands them on demand
+ * into one copy held by every wzctx of the process.
  * @return the wzctx. Return NULL if error occurred. */
 wzctx *      wz_init_ctx(void);
 
-/** Free the wzctx.
+/** Free the wzctx. The keys expanded at runtime are freed with the last
+ * wzctx.
  * @return 0 if succeed, 1 if error occurred. */
 int          wz_free_ctx(wzctx * ctx);
 
+/** Add the keys of another region to @p ctx. They are expanded at runtime
+ * from @p len ivs, at most 2, and @p aes_key of 32 bytes, or the default aes
+ * key if it is NULL. A file opened by wz_open_file() is matched to the keys
+ * which decode the name of its first directory, by a fingerprint of each
+ * key taken here, and keeps them until it is closed.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_add_keys(wzctx * ctx, const wz_uint32_t * ivs,
+                         wz_uint8_t len, const wz_uint8_t * aes_key);
+
+/** Set how wz_open_file() opens the file. @p open should fill @p io with
+ * the backend of @p filename and return 0, or return 1 if error occurred.
+ * @p user is passed to @p open as is. The default backend, which reads by
+ * stdio and maps the file into memory if possible, is restored if @p open
+ * is NULL.
+ * @return 0 if succeed, 1 if error occurred. */
+int          wz_set_io(wzctx * ctx,
+                       int (* open)(wzio * io, const char * filename,
+                                    void * user),
+                       void * user);
+
 #endif
@@ -0,0 +1,417 @@
+#include "predef.h"
+
+#ifdef WZ_MSVC
+#  pragma warning(push, 3)
+#endif
+
+#ifdef WZ_WINDOWS
+#  include <Windows.h>
+#else
+#  include <time.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef WZ_MSVC
+#  pragma warning(pop)
+#endif
+
+#include "file.c"
+
+/* bench - timing of the reading paths of wz library on a generated file.
+   It builds a wz file of <imgs> images with <props> properties each in
+   memory, then parses it <rounds> times through every backend. With
+   <canvases> canvases in each image, it also opens every canvas one by one
+   and loads every image at once by wz_load_node. At last, it times the
+   expansion of the keys by aes, as done at runtime without generated keys. */
+
+static const char bench_fname[] = "bench.wz";
+
+enum { BENCH_PARSE, BENCH_OPEN, BENCH_LOAD };
+enum { CANVAS_W = 64, CANVAS_H = 64 };
+
+typedef struct {
+  wz_uint8_t * bytes;
+  wz_uint32_t  len;
+  wz_uint32_t  capa;
+} wzbuf;
+
+static void
+put_bytes(wzbuf * buf, const void * bytes, wz_uint32_t len) {
+  if (buf->len + len > buf->capa) {
+    wz_uint32_t capa = buf->capa ? buf->capa : 4096;
+    while (buf->len + len > capa)
+      capa <<= 1;
+    if ((buf->bytes = realloc(buf->bytes, capa)) == NULL)
+      exit(1);
+    buf->capa = capa;
+  }
+  memcpy(buf->bytes + buf->len, bytes, len);
+  buf->len += len;
+}
+
+static void
+put_byte(wzbuf * buf, wz_uint8_t byte) {
+  put_bytes(buf, &byte, 1);
+}
+
+static void
+put_le32(wzbuf * buf, wz_uint32_t le32) {
+  wz_uint8_t bytes[4];
+  bytes[0] = (wz_uint8_t) (le32      );
+  bytes[1] = (wz_uint8_t) (le32 >>  8);
+  bytes[2] = (wz_uint8_t) (le32 >> 16);
+  bytes[3] = (wz_uint8_t) (le32 >> 24);
+  put_bytes(buf, bytes, sizeof(bytes));
+}
+
+static void
+put_int32(wzbuf * buf, wz_uint32_t int32) {
+  if (int32 < 0x80) {
+    put_byte(buf, (wz_uint8_t) int32);
+  } else {
+    put_byte(buf, 0x80);
+    put_le32(buf, int32);
+  }
+}
+
+static void /* short cp1252 string encrypted with the key */
+put_chars(wzbuf * buf, const char * str, const wz_uint8_t * key) {
+  wz_uint8_t mask = 0xaa;
+  wz_uint32_t len = (wz_uint32_t) strlen(str);
+  wz_uint32_t i;
+  put_byte(buf, (wz_uint8_t) (0x100 - len));
+  for (i = 0; i < len; i++)
+    put_byte(buf, (wz_uint8_t) ((wz_uint8_t) str[i] ^ mask++ ^ key[i]));
+}
+
+static wz_uint32_t
+encode_addr(wz_uint32_t val, wz_uint32_t pos,
+            wz_uint32_t start, wz_uint32_t hash) {
+  wz_uint32_t key = 0x581c3f6d;
+  wz_uint32_t x = ~(pos - start) * hash - key;
+  wz_uint32_t n = x & 0x1f;
+  x = (x << n) | (x >> (32 - n)); /* rotate left n bit */
+  return x ^ (val - start * 2);
+}
+
+static void /* a canvas of BGRA8888 compressed without the end of stream */
+put_canvas(wzbuf * buf, const wzbuf * blob, const wz_uint8_t * key) {
+  put_byte(buf, 0x73);
+  put_chars(buf, "Canvas", key);
+  put_byte(buf, 0);
+  put_byte(buf, 0); /* no children */
+  put_int32(buf, CANVAS_W);
+  put_int32(buf, CANVAS_H);
+  put_int32(buf, WZ_COLOR_8888);
+  put_byte(buf, 0); /* scale */
+  put_le32(buf, 0);
+  put_le32(buf, blob->len + 1);
+  put_byte(buf, 0);
+  put_bytes(buf, blob->bytes, blob->len);
+}
+
+static void /* one image with props properties of mixed types */
+put_img(wzbuf * buf, wz_uint32_t props, wz_uint32_t canvases,
+        const wzbuf * blob, const wz_uint8_t * key) {
+  wz_uint32_t addr = buf->len;
+  wz_uint32_t str = 0;
+  wz_uint32_t i;
+  char name[16];
+  put_byte(buf, 0x73);
+  put_chars(buf, "Property", key);
+  put_byte(buf, 0), put_byte(buf, 0);
+  put_int32(buf, props + canvases);
+  for (i = 0; i < props; i++) {
+    sprintf(name, "%"WZ_PRIu32, i);
+    put_byte(buf, 0x00);
+    put_chars(buf, name, key);
+    switch (i % 4) {
+    case 0:
+      put_byte(buf, 0x03);
+      put_int32(buf, i);
+      break;
+    case 1:
+      put_byte(buf, 0x08);
+      put_byte(buf, 0x00);
+      if (!str)
+        str = buf->len - addr;
+      put_chars(buf, "string", key);
+      break;
+    case 2:
+      put_byte(buf, 0x08);
+      if (str) {
+        put_byte(buf, 0x01);
+        put_le32(buf, str);
+      } else {
+        put_byte(buf, 0x00);
+        put_chars(buf, "string", key);
+      }
+      break;
+    default: {
+      wz_uint32_t size_pos;
+      wz_uint32_t size;
+      put_byte(buf, 0x09);
+      size_pos = buf->len;
+      put_le32(buf, 0);
+      put_byte(buf, 0x73);
+      put_chars(buf, "Property", key);
+      put_byte(buf, 0), put_byte(buf, 0);
+      put_int32(buf, 1);
+      put_byte(buf, 0x00);
+      put_chars(buf, "x", key);
+      put_byte(buf, 0x03);
+      put_int32(buf, i);
+      size = WZ_HTOLE32(buf->len - size_pos - 4);
+      memcpy(buf->bytes + size_pos, &size, 4);
+      break;
+    }
+    }
+  }
+  for (i = 0; i < canvases; i++) {
+    wz_uint32_t size_pos;
+    wz_uint32_t size;
+    sprintf(name, "c%"WZ_PRIu32, i);
+    put_byte(buf, 0x00);
+    put_chars(buf, name, key);
+    put_byte(buf, 0x09);
+    size_pos = buf->len;
+    put_le32(buf, 0);
+    put_canvas(buf, blob, key);
+    size = WZ_HTOLE32(buf->len - size_pos - 4);
+    memcpy(buf->bytes + size_pos, &size, 4);
+  }
+}
+
+static void /* deflate a bitmap and stop before the end of the stream */
+build_blob(wzbuf * blob) {
+  static wz_uint8_t pixels[CANVAS_W * CANVAS_H * 4];
+  static wz_uint8_t out[sizeof(pixels) + 1024];
+  z_stream strm;
+  wz_uint32_t i;
+  for (i = 0; i < sizeof(pixels); i++)
+    pixels[i] = (wz_uint8_t) (i % 4 == 3 ? 0xff : (i / 4 % CANVAS_W) ^ i / 64);
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+    exit(1);
+  strm.next_in = pixels;
+  strm.avail_in = sizeof(pixels);
+  strm.next_out = out;
+  strm.avail_out = sizeof(out);
+  if (deflate(&strm, Z_SYNC_FLUSH) != Z_OK)
+    exit(1);
+  put_bytes(blob, out, (wz_uint32_t) strm.total_out);
+  deflateEnd(&strm);
+}
+
+static void
+build(wzbuf * buf, wz_uint32_t imgs, wz_uint32_t props, wz_uint32_t canvases,
+      const wz_uint8_t * key) {
+  static const char copyright[] = "bench";
+  const wz_uint32_t start = 4 + 8 + 4 + sizeof(copyright);
+  wz_uint16_t enc;
+  wz_uint32_t hash;
+  wz_uint32_t * addr_pos;
+  wz_uint32_t i;
+  char name[16];
+  wzbuf blob;
+  blob.bytes = NULL;
+  blob.len = blob.capa = 0;
+  if (canvases)
+    build_blob(&blob);
+  wz_encode_ver(&enc, &hash, 83);
+  if ((addr_pos = malloc(imgs * sizeof(* addr_pos))) == NULL)
+    exit(1);
+  put_bytes(buf, "PKG1", 4);
+  put_le32(buf, 0), put_le32(buf, 0);
+  put_le32(buf, start);
+  put_bytes(buf, copyright, sizeof(copyright));
+  put_byte(buf, (wz_uint8_t) enc), put_byte(buf, (wz_uint8_t) (enc >> 8));
+  put_int32(buf, imgs);
+  for (i = 0; i < imgs; i++) {
+    sprintf(name, "%"WZ_PRIu32".img", i);
+    put_byte(buf, 0x04);
+    put_chars(buf, name, key);
+    put_byte(buf, 0x80), put_le32(buf, 0); /* size */
+    put_int32(buf, 0); /* check */
+    addr_pos[i] = buf->len;
+    put_le32(buf, 0);
+  }
+  for (i = 0; i < imgs; i++) {
+    wz_uint32_t addr = buf->len;
+    wz_uint32_t addr_enc = encode_addr(addr, addr_pos[i], start, hash);
+    wz_uint32_t size;
+    put_img(buf, props, canvases, &blob, key);
+    size = WZ_HTOLE32(buf->len - addr);
+    addr_enc = WZ_HTOLE32(addr_enc);
+    memcpy(buf->bytes + addr_pos[i] - 1 - 4, &size, 4);
+    memcpy(buf->bytes + addr_pos[i], &addr_enc, 4);
+  }
+  free(addr_pos);
+  free(blob.bytes);
+}
+
+static wz_uint64_t
+now(void) {
+#ifdef WZ_WINDOWS
+  LARGE_INTEGER freq;
+  LARGE_INTEGER count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (wz_uint64_t) (count.QuadPart * 1000000000 / freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (wz_uint64_t) ts.tv_sec * 1000000000 + (wz_uint64_t) ts.tv_nsec;
+#endif
+}
+
+static int /* open every image and its canvases one by one or all at once */
+walk(wzfile * file, int mode, wz_uint32_t imgs, wz_uint32_t canvases) {
+  wznode * root;
+  wz_uint32_t i;
+  wz_uint32_t j;
+  char name[16];
+  if ((root = wz_open_root(file)) == NULL)
+    return 1;
+  for (i = 0; i < imgs; i++) {
+    wznode * img;
+    sprintf(name, "%"WZ_PRIu32".img", i);
+    if ((img = wz_open_node(root, name)) == NULL ||
+        (mode == BENCH_LOAD && wz_load_node(img)))
+      return 1;
+    for (j = 0; j < canvases; j++) {
+      wz_uint32_t w;
+      wz_uint32_t h;
+      wznode * canvas;
+      sprintf(name, "c%"WZ_PRIu32, j);
+      if ((canvas = wz_open_node(img, name)) == NULL ||
+          wz_get_img(&w, &h, NULL, NULL, canvas) == NULL)
+        return 1;
+    }
+    if (wz_close_node(img))
+      return 1;
+  }
+  return 0;
+}
+
+static int
+bench(const char * label, const wzbuf * buf, const char * filename,
+      int mode, wz_uint32_t imgs, wz_uint32_t canvases,
+      wz_uint32_t rounds, wzctx * ctx) {
+  wz_uint64_t begin = now();
+  wz_uint64_t duration;
+  wz_uint32_t i;
+  for (i = 0; i < rounds; i++) {
+    wzfile * file = filename != NULL ?
+      wz_open_file(filename, ctx) : wz_open_mem(buf->bytes, buf->len, ctx);
+    if (file == NULL)
+      return fprintf(stderr, "bench: cannot open %s\n", label), 1;
+    if (mode == BENCH_PARSE ?
+        wz_parse_file(file) :
+        walk(file, mode, imgs, canvases))
+      return fprintf(stderr, "bench: cannot read %s\n", label), 1;
+    if (wz_close_file(file))
+      return fprintf(stderr, "bench: cannot close %s\n", label), 1;
+  }
+  duration = (now() - begin) / rounds;
+  printf("%-10s %6"WZ_PRIu64".%03"WZ_PRIu64" ms/round\n", label,
+         duration / 1000000, duration / 1000 % 1000);
+  return 0;
+}
+
+static int /* aes ofb over the keys, as expanded at runtime */
+bench_keys(wz_uint32_t rounds) {
+  static wz_uint8_t key[32] = {
+    0x13, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00,
+    0x06, 0x00, 0x00, 0x00, 0xb4, 0x00, 0x00, 0x00,
+    0x1b, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00,
+    0x33, 0x00, 0x00, 0x00, 0x52, 0x00, 0x00, 0x00
+  };
+  static const wz_uint8_t iv[16] = {
+    0x4d, 0x23, 0xc7, 0x2b, 0x4d, 0x23, 0xc7, 0x2b,
+    0x4d, 0x23, 0xc7, 0x2b, 0x4d, 0x23, 0xc7, 0x2b
+  };
+  wz_uint32_t len = WZ_KEYS_LEN * WZ_KEY_UTF8_MAX_LEN;
+  wz_uint8_t * bytes;
+  wz_uint64_t begin;
+  wz_uint64_t duration;
+  aes256_context aes;
+  wz_uint32_t i;
+  wz_uint32_t j;
+  if ((bytes = malloc(len)) == NULL)
+    return 1;
+  begin = now();
+  for (i = 0; i < rounds; i++) {
+    aes256_init(&aes, key);
+    memcpy(bytes, iv, 16);
+    aes256_encrypt_ecb(&aes, bytes);
+    for (j = 16; j < len; j += 16) {
+      memcpy(bytes + j, bytes + j - 16, 16);
+      aes256_encrypt_ecb(&aes, bytes + j);
+    }
+    aes256_done(&aes);
+  }
+  duration = (now() - begin) / rounds;
+  printf("%-10s %6"WZ_PRIu64".%03"WZ_PRIu64" ms/round, "
+         "%"WZ_PRIu64" MB/s\n", "keys",
+         duration / 1000000, duration / 1000 % 1000,
+         duration ? (wz_uint64_t) len * 1000 / duration : 0);
+  free(bytes);
+  return 0;
+}
+
+int
+main(int argc, char ** argv) {
+  int ret = 1;
+  wz_uint32_t imgs   = argc > 1 ? (wz_uint32_t) atol(argv[1]) :  256;
+  wz_uint32_t props  = argc > 2 ? (wz_uint32_t) atol(argv[2]) : 1024;
+  wz_uint32_t rounds = argc > 3 ? (wz_uint32_t) atol(argv[3]) :   10;
+  wz_uint32_t canvases = argc > 4 ? (wz_uint32_t) atol(argv[4]) :  0;
+  wzctx * ctx;
+  wzbuf buf;
+  FILE * raw;
+  if (!imgs || !props || !rounds) {
+    fprintf(stderr,
+            "usage: bench [<imgs> [<props> [<rounds> [<canvases>]]]]\n");
+    return ret;
+  }
+  if ((ctx = wz_init_ctx()) == NULL)
+    return ret;
+  buf.bytes = NULL;
+  buf.len = buf.capa = 0;
+  build(&buf, imgs, props, canvases,
+        wz_get_key(ctx->profiles[0].keys, 0, WZ_KEY_UTF8_MAX_LEN));
+  printf("%"WZ_PRIu32" images x %"WZ_PRIu32" properties + "
+         "%"WZ_PRIu32" canvases, %"WZ_PRIu32" bytes, %"WZ_PRIu32" rounds\n",
+         imgs, props, canvases, buf.len, rounds);
+  if ((raw = fopen(bench_fname, "wb")) == NULL ||
+      fwrite(buf.bytes, buf.len, 1, raw) != 1 ||
+      fclose(raw))
+    goto free_buf;
+  if (bench("mem", &buf, NULL, BENCH_PARSE, imgs, canvases, rounds, ctx) ||
+      bench("file", &buf, bench_fname, BENCH_PARSE, imgs, canvases,
+            rounds, ctx))
+    goto remove_file;
+  if (canvases &&
+      (bench("mem open", &buf, NULL, BENCH_OPEN, imgs, canvases,
+             rounds, ctx) ||
+       bench("mem load", &buf, NULL, BENCH_LOAD, imgs, canvases,
+             rounds, ctx) ||
+       bench("file open", &buf, bench_fname, BENCH_OPEN, imgs, canvases,
+             rounds, ctx) ||
+       bench("file load", &buf, bench_fname, BENCH_LOAD, imgs, canvases,
+             rounds, ctx)))
+    goto remove_file;
+  if (bench_keys(rounds))
+    goto remove_file;
+  ret = 0;
+remove_file:
+  remove(bench_fname);
+free_buf:
+  free(buf.bytes);
+  wz_free_ctx(ctx);
+  return ret;
+}
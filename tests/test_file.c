@@ -118,6 +118,7 @@ START_TEST(test_node) {
 } END_TEST
 
 static const char tmp_fname[] = "tmpfile";
+static wzstdio tmp_stdio;
 
 static void
 create_file(wzfile * file, const wz_uint8_t * bytes, wz_uint32_t len) {
@@ -127,21 +128,37 @@ create_file(wzfile * file, const wz_uint8_t * bytes, wz_uint32_t len) {
     ck_assert(fwrite(bytes, len, 1, raw) == 1);
     ck_assert(fseek(raw, 0, SEEK_SET) == 0);
   }
-  file->raw = raw;
-  file->pos = 0;
+  tmp_stdio.raw = raw;
+  tmp_stdio.map = NULL;
+  tmp_stdio.size = len;
+  file->io.user = &tmp_stdio;
+  file->io.read_at = wz_stdio_read_at;
+  file->io.size = wz_stdio_size;
+  file->io.map = wz_stdio_map;
+  file->io.advise = NULL;
+  file->io.close = NULL;
+  file->map = NULL;
+  file->cache = NULL;
   file->size = len;
+  file->read_end = 0;
+  file->intern = 0;
+  file->names = NULL;
+  file->refs = NULL;
+  memset(&file->stats, 0, sizeof(file->stats));
 }
 
 static void
 close_file(wzfile * file) {
   ck_assert(memerr() == 0);
-  ck_assert(fclose(file->raw) == 0);
+  (void) file;
+  ck_assert(fclose(tmp_stdio.raw) == 0);
 }
 
 static void
 delete_file(wzfile * file) {
   ck_assert(memerr() == 0);
-  ck_assert(fclose(file->raw) == 0);
+  (void) file;
+  ck_assert(fclose(tmp_stdio.raw) == 0);
   ck_assert(remove(tmp_fname) == 0);
 }
 
@@ -149,18 +166,21 @@ START_TEST(test_read_bytes) {
   static const wz_uint8_t normal[] = {'a', 'b'};
   wz_uint8_t buffer[sizeof(normal)];
   wzfile file;
+  wzcur cur;
   create_file(&file, normal, sizeof(normal));
+  cur.file = &file;
+  cur.pos = 0;
 
   /* It should be ok if len == 0 */
-  ck_assert(wz_read_bytes(buffer, 0, &file) == 0);
+  ck_assert(wz_read_bytes(buffer, 0, &cur) == 0);
 
   /* It should be ok */
-  ck_assert(wz_read_bytes(buffer, sizeof(normal), &file) == 0);
+  ck_assert(wz_read_bytes(buffer, sizeof(normal), &cur) == 0);
   ck_assert(memcmp(buffer, normal, sizeof(normal)) == 0);
 
   /* It should not change position and data if error occured */
-  ck_assert(wz_read_bytes(buffer, sizeof(normal), &file) == 1);
-  ck_assert(file.pos == sizeof(normal));
+  ck_assert(wz_read_bytes(buffer, sizeof(normal), &cur) == 1);
+  ck_assert(cur.pos == sizeof(normal));
   ck_assert(memcmp(buffer, normal, sizeof(normal)) == 0);
 
   delete_file(&file);
@@ -170,15 +190,18 @@ START_TEST(test_read_byte) {
   static const wz_uint8_t normal[] = {'a'};
   wz_uint8_t buffer;
   wzfile file;
+  wzcur cur;
   create_file(&file, normal, sizeof(normal));
+  cur.file = &file;
+  cur.pos = 0;
 
   /* It should be ok */
-  ck_assert(wz_read_byte(&buffer, &file) == 0);
+  ck_assert(wz_read_byte(&buffer, &cur) == 0);
   ck_assert(buffer == normal[0]);
 
   /* It should not change position and data if error occured */
-  ck_assert(wz_read_byte(&buffer, &file) == 1);
-  ck_assert(file.pos == sizeof(normal));
+  ck_assert(wz_read_byte(&buffer, &cur) == 1);
+  ck_assert(cur.pos == sizeof(normal));
   ck_assert(buffer == normal[0]);
 
   delete_file(&file);
@@ -189,16 +212,19 @@ START_TEST(test_read_le16) {
   wz_uint16_t buffer;
   wz_uint16_t copy;
   wzfile file;
+  wzcur cur;
   create_file(&file, normal, sizeof(normal));
+  cur.file = &file;
+  cur.pos = 0;
 
   /* It should be ok */
-  ck_assert(wz_read_le16(&buffer, &file) == 0);
+  ck_assert(wz_read_le16(&buffer, &cur) == 0);
   ck_assert(buffer == 0x2301);
 
   /* It should not change position and data if error occured */
   copy = buffer;
-  ck_assert(wz_read_le16(&buffer, &file) == 1);
-  ck_assert(file.pos == sizeof(normal));
+  ck_assert(wz_read_le16(&buffer, &cur) == 1);
+  ck_assert(cur.pos == sizeof(normal));
   ck_assert(buffer == copy);
 
   delete_file(&file);
@@ -209,16 +235,19 @@ START_TEST(test_read_le32) {
   wz_uint32_t buffer;
   wz_uint32_t copy;
   wzfile file;
+  wzcur cur;
   create_file(&file, normal, sizeof(normal));
+  cur.file = &file;
+  cur.pos = 0;
 
   /* It should be ok */
-  ck_assert(wz_read_le32(&buffer, &file) == 0);
+  ck_assert(wz_read_le32(&buffer, &cur) == 0);
   ck_assert(buffer == 0x67452301);
 
   /* It should not change position and data if error occured */
   copy = buffer;
-  ck_assert(wz_read_le32(&buffer, &file) == 1);
-  ck_assert(file.pos == sizeof(normal));
+  ck_assert(wz_read_le32(&buffer, &cur) == 1);
+  ck_assert(cur.pos == sizeof(normal));
   ck_assert(buffer == copy);
 
   delete_file(&file);
@@ -231,16 +260,19 @@ START_TEST(test_read_le64) {
   wz_uint64_t buffer;
   wz_uint64_t copy;
   wzfile file;
+  wzcur cur;
   create_file(&file, normal, sizeof(normal));
+  cur.file = &file;
+  cur.pos = 0;
 
   /* It should be ok */
-  ck_assert(wz_read_le64(&buffer, &file) == 0);
+  ck_assert(wz_read_le64(&buffer, &cur) == 0);
   ck_assert(buffer == 0xefcdab8967452301);
 
   /* It should not change position and data if error occured */
   copy = buffer;
-  ck_assert(wz_read_le64(&buffer, &file) == 1);
-  ck_assert(file.pos == sizeof(normal));
+  ck_assert(wz_read_le64(&buffer, &cur) == 1);
+  ck_assert(cur.pos == sizeof(normal));
   ck_assert(buffer == copy);
 
   delete_file(&file);
@@ -251,24 +283,27 @@ START_TEST(test_read_int32) {
   wz_uint32_t buffer;
   wz_uint32_t copy;
   wzfile file;
+  wzcur cur;
   create_file(&file, normal, sizeof(normal));
+  cur.file = &file;
+  cur.pos = 0;
 
   /* It should read positive int8 */
-  ck_assert(wz_read_int32(&buffer, &file) == 0);
+  ck_assert(wz_read_int32(&buffer, &cur) == 0);
   ck_assert(buffer == 1);
 
   /* It should read negative int8 */
-  ck_assert(wz_read_int32(&buffer, &file) == 0);
+  ck_assert(wz_read_int32(&buffer, &cur) == 0);
   ck_assert(buffer == 0xfffffffe);
 
   /* It should read postive int32 */
-  ck_assert(wz_read_int32(&buffer, &file) == 0);
+  ck_assert(wz_read_int32(&buffer, &cur) == 0);
   ck_assert(buffer == 0x89674523);
 
   /* It should not change position and data if error occured */
   copy = buffer;
-  ck_assert(wz_read_int32(&buffer, &file) == 1);
-  ck_assert(file.pos == sizeof(normal));
+  ck_assert(wz_read_int32(&buffer, &cur) == 1);
+  ck_assert(cur.pos == sizeof(normal));
   ck_assert(buffer == copy);
 
   delete_file(&file);
@@ -281,24 +316,27 @@ START_TEST(test_read_int64) {
   wz_uint64_t buffer;
   wz_uint64_t copy;
   wzfile file;
+  wzcur cur;
   create_file(&file, normal, sizeof(normal));
+  cur.file = &file;
+  cur.pos = 0;
 
   /* It should read positive int8 */
-  ck_assert(wz_read_int64(&buffer, &file) == 0);
+  ck_assert(wz_read_int64(&buffer, &cur) == 0);
   ck_assert(buffer == 1);
 
   /* It should read negative int8 */
-  ck_assert(wz_read_int64(&buffer, &file) == 0);
+  ck_assert(wz_read_int64(&buffer, &cur) == 0);
   ck_assert(buffer == 0xfffffffffffffffe);
 
   /* It should read postive int64 */
-  ck_assert(wz_read_int64(&buffer, &file) == 0);
+  ck_assert(wz_read_int64(&buffer, &cur) == 0);
   ck_assert(buffer == 0x01efcdab89674523);
 
   /* It should not change position and data if error occured */
   copy = buffer;
-  ck_assert(wz_read_int64(&buffer, &file) == 1);
-  ck_assert(file.pos == sizeof(normal));
+  ck_assert(wz_read_int64(&buffer, &cur) == 1);
+  ck_assert(cur.pos == sizeof(normal));
   ck_assert(buffer == copy);
 
   delete_file(&file);
@@ -326,6 +364,30 @@ keygen(wz_uint8_t * key, wz_uint32_t len) {
     key[i] = numgen((numgen(index++) + offset) ^ 0xdf53971e) & 0xff;
 }
 
+static void /* the first key of len bytes, the others are empty */
+keyset(wzkeys * keys, const wz_uint8_t * key, wz_uint32_t len) {
+  static wz_uint8_t ascii[(WZ_KEY_EMPTY + 1) * WZ_KEY_ASCII_MAX_LEN];
+  static wz_uint8_t utf16[sizeof(ascii)];
+  wz_uint8_t i;
+  if (len > WZ_KEY_ASCII_MAX_LEN)
+    len = WZ_KEY_ASCII_MAX_LEN;
+  memset(ascii, 0, sizeof(ascii));
+  memset(utf16, 0, sizeof(utf16));
+  memcpy(ascii, key, len);
+  memcpy(utf16, key, len);
+  for (i = 0; i <= WZ_KEY_EMPTY; i++) {
+    (void) wz_xor_mask8(ascii + i * WZ_KEY_ASCII_MAX_LEN, NULL,
+                        WZ_KEY_ASCII_MAX_LEN, 0xaa);
+    (void) wz_xor_mask16(utf16 + i * WZ_KEY_ASCII_MAX_LEN, NULL,
+                         WZ_KEY_ASCII_MAX_LEN >> 1, 0xaaaa);
+  }
+  keys->len = WZ_KEY_UTF8_MAX_LEN;
+  keys->full = 1; /* never expanded */
+  keys->bytes = key;
+  keys->ascii = ascii;
+  keys->utf16 = utf16;
+}
+
 static const wz_uint8_t cp1252[] = {
   'f', 'i', 'a', 'n', 'c', 0xe9, 'e'
 };
@@ -380,10 +442,102 @@ utf8_encode(wz_uint8_t * enc,
     enc[i] = dec[i] ^ key[i];
 }
 
+START_TEST(test_xor_mask) {
+  wz_uint8_t key[1 + 100];
+  wz_uint8_t dec[1 + 100];
+  wz_uint8_t enc[1 + 100];
+  wz_uint32_t len;
+  wz_uint32_t i;
+  wz_uint8_t mask_8;
+  wz_uint16_t mask_16;
+  keygen(key, sizeof(key));
+  keygen(dec, sizeof(dec));
+
+  /* It should xor as byte by byte at any length and alignment */
+  for (len = 0; len < 100; len++) {
+    memcpy(enc, dec, sizeof(enc));
+    wz_xor_key(enc + 1, enc + 1, key + 1, len);
+    for (i = 0; i < len; i++)
+      ck_assert(enc[1 + i] == (dec[1 + i] ^ key[1 + i]));
+    ck_assert(enc[1 + len] == dec[1 + len]);
+
+    /* with the mask wrapped around */
+    memcpy(enc, dec, sizeof(enc));
+    ck_assert(wz_xor_mask8(enc + 1, key + 1, len, 0xf0) ==
+              (wz_uint8_t) (0xf0 + len));
+    for (i = 0, mask_8 = 0xf0; i < len; i++, mask_8++)
+      ck_assert(enc[1 + i] == (dec[1 + i] ^ mask_8 ^ key[1 + i]));
+    memcpy(enc, dec, sizeof(enc));
+    (void) wz_xor_mask8(enc + 1, NULL, len, 0xf0);
+    for (i = 0, mask_8 = 0xf0; i < len; i++, mask_8++)
+      ck_assert(enc[1 + i] == (dec[1 + i] ^ mask_8));
+
+    if (1 + len * 2 >= sizeof(enc))
+      continue;
+    memcpy(enc, dec, sizeof(enc));
+    ck_assert(wz_xor_mask16(enc + 1, key + 1, len, 0xfff8) ==
+              (wz_uint16_t) (0xfff8 + len));
+    for (i = 0, mask_16 = 0xfff8; i < len; i++, mask_16++) {
+      ck_assert(enc[1 + i * 2] ==
+                (dec[1 + i * 2] ^ (mask_16 & 0xff) ^ key[1 + i * 2]));
+      ck_assert(enc[2 + i * 2] ==
+                (dec[2 + i * 2] ^ (mask_16 >> 8) ^ key[2 + i * 2]));
+    }
+    ck_assert(enc[1 + len * 2] == dec[1 + len * 2]);
+  }
+} END_TEST
+
+START_TEST(test_to_utf8) {
+  wz_uint8_t cp1252_str[40];
+  wz_uint8_t utf16_str[sizeof(cp1252_str) * 2];
+  wz_uint8_t u8[sizeof(cp1252_str) + 1 + 1];
+  wz_uint8_t expected[sizeof(u8)];
+  wz_uint32_t utf8_len;
+  wz_uint32_t at;
+  wz_uint32_t i;
+
+  /* It should copy the ascii runs around a char which is not ascii */
+  for (at = 0; at <= sizeof(cp1252_str); at++) {
+    wz_uint32_t expected_len = 0;
+    for (i = 0; i < sizeof(cp1252_str); i++) {
+      wz_uint8_t c = (wz_uint8_t) ('0' + i % 64);
+      if (i == at) { /* e with acute accent */
+        cp1252_str[i] = 0xe9;
+        utf16_str[i * 2] = 0xe9, utf16_str[i * 2 + 1] = 0x00;
+        expected[expected_len++] = 0xc3, expected[expected_len++] = 0xa9;
+      } else {
+        cp1252_str[i] = c;
+        utf16_str[i * 2] = c, utf16_str[i * 2 + 1] = 0x00;
+        expected[expected_len++] = c;
+      }
+    }
+    expected[expected_len] = '\0';
+    ck_assert(wz_cp1252_to_utf8(NULL, &utf8_len,
+                                cp1252_str, sizeof(cp1252_str)) == 0);
+    ck_assert(utf8_len == expected_len);
+    ck_assert(wz_cp1252_to_utf8(u8, NULL,
+                                cp1252_str, sizeof(cp1252_str)) == 0);
+    ck_assert(memcmp(u8, expected, expected_len + 1) == 0);
+    ck_assert(wz_utf16le_to_utf8(NULL, &utf8_len,
+                                 utf16_str, sizeof(utf16_str)) == 0);
+    ck_assert(utf8_len == expected_len);
+    ck_assert(wz_utf16le_to_utf8(u8, NULL,
+                                 utf16_str, sizeof(utf16_str)) == 0);
+    ck_assert(memcmp(u8, expected, expected_len + 1) == 0);
+  }
+
+  /* It should not take a unit with the high byte set as ascii */
+  utf16_str[33] = 0x01; /* U+0121 */
+  ck_assert(wz_utf16le_to_utf8(NULL, &utf8_len,
+                               utf16_str, sizeof(utf16_str)) == 0);
+  ck_assert(utf8_len == sizeof(cp1252_str) + 1);
+} END_TEST
+
 START_TEST(test_decode_chars) {
   wz_uint32_t key_len = 0x12000;
   wz_uint32_t dec_len;
   wz_uint8_t * key;
+  wzkeys keys;
   wz_uint8_t * enc;
   wz_uint32_t i;
   wz_uint32_t j;
@@ -391,6 +545,7 @@ START_TEST(test_decode_chars) {
   wz_uint8_t same;
   ck_assert((key = malloc(key_len)) != NULL);
   keygen(key, key_len);
+  keyset(&keys, key, key_len);
   ck_assert((enc = malloc(key_len)) != NULL);
 
   /* It should decode ascii/cp1252 */
@@ -398,13 +553,13 @@ START_TEST(test_decode_chars) {
     cp1252_encode(enc, cp1252, sizeof(cp1252), key);
 
     /* when the first key is used */
-    ck_assert(wz_decode_chars(enc, sizeof(cp1252), 0, key, WZ_ENC_CP1252) == 0);
+    ck_assert(wz_decode_chars(enc, sizeof(cp1252), 0, &keys, WZ_ENC_CP1252) == 0);
     ck_assert(memcmp(enc, cp1252, sizeof(cp1252)) == 0);
 
     cp1252_encode(enc, cp1252, sizeof(cp1252), NULL);
 
     /* when the empty key is used */
-    ck_assert(wz_decode_chars(enc, sizeof(cp1252), 2, key, WZ_ENC_CP1252) == 0);
+    ck_assert(wz_decode_chars(enc, sizeof(cp1252), 2, &keys, WZ_ENC_CP1252) == 0);
     ck_assert(memcmp(enc, cp1252, sizeof(cp1252)) == 0);
 
     mask = 0xaa;
@@ -416,7 +571,7 @@ START_TEST(test_decode_chars) {
 
     /* when len > 0x10000 */
     ck_assert(wz_decode_chars(enc, key_len,
-                              0, key, WZ_ENC_CP1252) == 0);
+                              0, &keys, WZ_ENC_CP1252) == 0);
     mask = 0xaa;
     same = 1;
     for (i = 0; i < key_len; i++)
@@ -433,19 +588,19 @@ START_TEST(test_decode_chars) {
 
     /* when the first key is used */
     ck_assert(wz_decode_chars(enc, sizeof(utf16le),
-                              0, key, WZ_ENC_UTF16LE) == 0);
+                              0, &keys, WZ_ENC_UTF16LE) == 0);
     ck_assert(memcmp(enc, utf16le, sizeof(utf16le)) == 0);
 
     utf16le_encode(enc, utf16le, sizeof(utf16le), NULL);
 
     /* when the empty key is used */
     ck_assert(wz_decode_chars(enc, sizeof(utf16le),
-                              2, key, WZ_ENC_UTF16LE) == 0);
+                              2, &keys, WZ_ENC_UTF16LE) == 0);
     ck_assert(memcmp(enc, utf16le, sizeof(utf16le)) == 0);
 
     /* It should fail when len > 0x10000 */
     ck_assert(wz_decode_chars(enc, key_len,
-                              0, key, WZ_ENC_UTF16LE) == 1);
+                              0, &keys, WZ_ENC_UTF16LE) == 1);
   }
 
   /* It should decode utf8 */
@@ -456,7 +611,7 @@ START_TEST(test_decode_chars) {
 
     /* when len > 0x10000 */
     ck_assert(wz_decode_chars(enc, dec_len,
-                              0, key, WZ_ENC_UTF8) == 0);
+                              0, &keys, WZ_ENC_UTF8) == 0);
     same = 1;
     for (i = 0; i < dec_len;) {
       for (j = 0; j < sizeof(utf8); j++) {
@@ -544,14 +699,17 @@ utf16le_long(wz_uint8_t * str, wz_uint32_t * size,
 
 START_TEST(test_read_chars) {
   wz_uint8_t key[KEY_BUF_SIZE];
+  wzkeys keys;
   wz_uint8_t * str;
   wz_uint32_t size;
   wz_uint8_t * bytes;
   wz_uint32_t len;
   wz_uint8_t encoding;
   wzfile file;
+  wzcur cur;
 
   keygen(key, KEY_BUF_SIZE);
+  keyset(&keys, key, KEY_BUF_SIZE);
 
   /* It should be ok */
   {
@@ -561,10 +719,12 @@ START_TEST(test_read_chars) {
     ck_assert((str = malloc(size)) != NULL);
     cp1252_short(str, NULL, enc, sizeof(enc));
     create_file(&file, str, size);
+    cur.file = &file;
+    cur.pos = 0;
 
     /* when it is a short cp1252/ascii/utf8 string */
     ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
-                            WZ_LV0_NAME, 0xff, NULL, &file) == 0);
+                            WZ_LV0_NAME, 0xff, NULL, &cur) == 0);
     ck_assert(len == sizeof(enc));
     ck_assert(memcmp(bytes, enc, sizeof(enc)) == 0);
     ck_assert(bytes[sizeof(enc)] == '\0');
@@ -583,10 +743,12 @@ START_TEST(test_read_chars) {
     ck_assert((str = malloc(size)) != NULL);
     cp1252_long(str, NULL, enc, sizeof(enc));
     create_file(&file, str, size);
+    cur.file = &file;
+    cur.pos = 0;
 
     /* when it is a long cp1252/ascii/utf8 string */
     ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
-                            WZ_LV0_NAME, 0xff, NULL, &file) == 0);
+                            WZ_LV0_NAME, 0xff, NULL, &cur) == 0);
     ck_assert(len == sizeof(enc));
     ck_assert(memcmp(bytes, enc, sizeof(enc)) == 0);
     ck_assert(bytes[sizeof(enc)] == '\0');
@@ -605,10 +767,12 @@ START_TEST(test_read_chars) {
     ck_assert((str = malloc(size)) != NULL);
     utf16le_short(str, NULL, enc, sizeof(enc));
     create_file(&file, str, size);
+    cur.file = &file;
+    cur.pos = 0;
 
     /* when it is a short utf16le string */
     ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
-                            WZ_LV0_NAME, 0xff, NULL, &file) == 0);
+                            WZ_LV0_NAME, 0xff, NULL, &cur) == 0);
     ck_assert(len == sizeof(enc));
     ck_assert(memcmp(bytes, enc, sizeof(enc)) == 0);
     ck_assert(bytes[sizeof(enc)] == '\0');
@@ -627,10 +791,12 @@ START_TEST(test_read_chars) {
     ck_assert((str = malloc(size)) != NULL);
     utf16le_long(str, NULL, enc, sizeof(enc));
     create_file(&file, str, size);
+    cur.file = &file;
+    cur.pos = 0;
 
     /* when it is a long utf16le string */
     ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
-                            WZ_LV0_NAME, 0xff, NULL, &file) == 0);
+                            WZ_LV0_NAME, 0xff, NULL, &cur) == 0);
     ck_assert(len == sizeof(enc));
     ck_assert(memcmp(bytes, enc, sizeof(enc)) == 0);
     ck_assert(bytes[sizeof(enc)] == '\0');
@@ -650,10 +816,12 @@ START_TEST(test_read_chars) {
     cp1252_short(str, NULL, cp1252, sizeof(cp1252));
     cp1252_encode(str + 1, cp1252, sizeof(cp1252), key);
     create_file(&file, str, size);
+    cur.file = &file;
+    cur.pos = 0;
 
     /* when it is a cp1252 string */
     ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
-                            WZ_LV0_NAME, 0, key, &file) == 0);
+                            WZ_LV0_NAME, 0, &keys, &cur) == 0);
     ck_assert(len == sizeof(cp1252_u8));
     ck_assert(memcmp(bytes, cp1252_u8, sizeof(cp1252_u8)) == 0);
     ck_assert(bytes[sizeof(cp1252_u8)] == '\0');
@@ -671,10 +839,12 @@ START_TEST(test_read_chars) {
     utf16le_short(str, NULL, utf16le, sizeof(utf16le));
     utf16le_encode(str + 1, utf16le, sizeof(utf16le), key);
     create_file(&file, str, size);
+    cur.file = &file;
+    cur.pos = 0;
 
     /* when it is a utf16le string */
     ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
-                            WZ_LV0_NAME, 0, key, &file) == 0);
+                            WZ_LV0_NAME, 0, &keys, &cur) == 0);
     ck_assert(len == sizeof(utf16le_u8));
     ck_assert(memcmp(bytes, utf16le_u8, sizeof(utf16le_u8)) == 0);
     ck_assert(bytes[sizeof(utf16le_u8)] == '\0');
@@ -686,6 +856,117 @@ START_TEST(test_read_chars) {
     delete_file(&file);
     free(str);
   }
+
+  /* It should decode a string referenced only once */
+  {
+    wz_uint8_t buf[1 + 1 + sizeof(cp1252) + (1 + 4) * 2];
+    wz_uint64_t read;
+    wz_uint8_t i;
+
+    buf[0] = 0x00;
+    cp1252_short(buf + 1, NULL, cp1252, sizeof(cp1252));
+    cp1252_encode(buf + 2, cp1252, sizeof(cp1252), key);
+    for (i = 0; i < 2; i++) {
+      wz_uint8_t * ref = buf + 2 + sizeof(cp1252) + i * (1 + 4);
+      ref[0] = 0x01; /* not inplace */
+      ref[1] = 0x01; /* offset */
+      ref[2] = ref[3] = ref[4] = 0;
+    }
+    create_file(&file, buf, sizeof(buf));
+    ck_assert((file.refs = wz_init_refs()) != NULL);
+    cur.file = &file;
+    cur.pos = 2 + sizeof(cp1252);
+
+    /* when it is referenced the first time */
+    ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
+                            WZ_LV1_NAME, 0, &keys, &cur) == 0);
+    ck_assert(len == sizeof(cp1252_u8));
+    ck_assert(memcmp(bytes, cp1252_u8, sizeof(cp1252_u8)) == 0);
+    ck_assert(encoding == WZ_ENC_CP1252);
+    ck_assert(cur.pos == 2 + sizeof(cp1252) + 1 + 4);
+    wz_free_chars(bytes);
+
+    /* when it is referenced again */
+    read = file.stats.bytes;
+    ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
+                            WZ_LV1_NAME, 0, &keys, &cur) == 0);
+    ck_assert(file.stats.bytes - read == 1 + 4);
+    ck_assert(len == sizeof(cp1252_u8));
+    ck_assert(memcmp(bytes, cp1252_u8, sizeof(cp1252_u8)) == 0);
+    ck_assert(bytes[sizeof(cp1252_u8)] == '\0');
+    ck_assert(encoding == WZ_ENC_CP1252);
+    ck_assert(cur.pos == sizeof(buf));
+    ck_assert(memused() == sizeof(* file.refs) + sizeof(cp1252_u8) + 1);
+    wz_free_chars(bytes);
+
+    /* when it is decoded by the other key */
+    cur.pos = 2 + sizeof(cp1252);
+    ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
+                            WZ_LV1_NAME, 0xff, &keys, &cur) == 0);
+    ck_assert(len == sizeof(cp1252));
+    ck_assert(memcmp(bytes, buf + 2, sizeof(cp1252)) == 0);
+    wz_free_chars(bytes);
+
+    ck_assert(wz_free_refs(file.refs) == 0);
+    ck_assert(memused() == 0);
+    delete_file(&file);
+  }
+
+  /* It should convert a long string in one pass */
+  {
+    enum {N = 43};
+    wz_uint8_t dec[N * sizeof(cp1252)];
+    wz_uint8_t * exp;
+    wz_uint32_t i;
+    for (i = 0; i < N; i++)
+      memcpy(dec + i * sizeof(cp1252), cp1252, sizeof(cp1252));
+    cp1252_long(NULL, &size, dec, sizeof(dec));
+    ck_assert((str = malloc(size)) != NULL);
+    cp1252_long(str, NULL, dec, sizeof(dec));
+    cp1252_encode(str + 5, dec, sizeof(dec), NULL);
+    create_file(&file, str, size);
+    cur.file = &file;
+    cur.pos = 0;
+
+    /* when it is a cp1252 string */
+    ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
+                            WZ_LV0_NAME, WZ_KEY_EMPTY, &keys, &cur) == 0);
+    ck_assert(len == N * sizeof(cp1252_u8));
+    for (i = 0, exp = bytes; i < N; i++, exp += sizeof(cp1252_u8))
+      ck_assert(memcmp(exp, cp1252_u8, sizeof(cp1252_u8)) == 0);
+    ck_assert(bytes[len] == '\0');
+    ck_assert(memused() == len + 1);
+    wz_free_chars(bytes);
+    ck_assert(memused() == 0);
+
+    delete_file(&file);
+    free(str);
+
+    for (i = 0; i < N * sizeof(cp1252) / sizeof(utf16le); i++)
+      memcpy(dec + i * sizeof(utf16le), utf16le, sizeof(utf16le));
+    utf16le_long(NULL, &size, dec, i * sizeof(utf16le));
+    ck_assert((str = malloc(size)) != NULL);
+    utf16le_long(str, NULL, dec, i * sizeof(utf16le));
+    utf16le_encode(str + 5, dec, i * sizeof(utf16le), NULL);
+    create_file(&file, str, size);
+    cur.file = &file;
+    cur.pos = 0;
+
+    /* when it is a utf16le string */
+    ck_assert(wz_read_chars(&bytes, &len, &encoding, 0, 0,
+                            WZ_LV0_NAME, WZ_KEY_EMPTY, &keys, &cur) == 0);
+    ck_assert(len == i * sizeof(utf16le_u8));
+    for (exp = bytes; exp < bytes + len; exp += sizeof(utf16le_u8))
+      ck_assert(memcmp(exp, utf16le_u8, sizeof(utf16le_u8)) == 0);
+    ck_assert(bytes[len] == '\0');
+    ck_assert(encoding == WZ_ENC_UTF16LE);
+    ck_assert(memused() == len + 1);
+    wz_free_chars(bytes);
+    ck_assert(memused() == 0);
+
+    delete_file(&file);
+    free(str);
+  }
 } END_TEST
 
 static void
@@ -709,32 +990,464 @@ START_TEST(test_decode_addr) {
   ck_assert(enc != dec);
   wz_decode_addr(&enc, enc, pos, start, hash);
   ck_assert(enc == 0x2ed);
+
+  /* It should decode every address as one by one */
+  {
+    wz_uint32_t vals[37];
+    wz_uint32_t offs[sizeof(vals) / sizeof(* vals)];
+    wz_uint32_t i;
+    for (i = 0; i < sizeof(vals) / sizeof(* vals); i++) {
+      offs[i] = i * 0x1357 + 1;
+      wz_encode_addr(&vals[i], dec + i, start + offs[i], start, hash + i);
+    }
+    for (hash = 0x713; hash < 0x713 + 32; hash++) { /* every rotation */
+      wz_uint32_t exp[sizeof(vals) / sizeof(* vals)];
+      for (i = 0; i < sizeof(vals) / sizeof(* vals); i++) {
+        vals[i] = i * 0x9e3779b9;
+        wz_decode_addr(&exp[i], vals[i], start + offs[i], start, hash);
+      }
+      wz_decode_addrs(vals, offs, sizeof(vals) / sizeof(* vals),
+                      start, hash);
+      ck_assert(memcmp(vals, exp, sizeof(vals)) == 0);
+    }
+  }
 } END_TEST
 
 START_TEST(test_seek) {
   static const wz_uint8_t str[] = {0x01, 0x23, 0x45, 0x67, 0x89};
   wzfile file;
+  wzcur cur;
   create_file(&file, str, sizeof(str));
+  cur.file = &file;
+  cur.pos = 0;
 
   /* It should seek relative address */
-  ck_assert(wz_seek(3, SEEK_CUR, &file) == 0);
-  ck_assert(wz_seek(1, SEEK_CUR, &file) == 0);
-  ck_assert(ftell(file.raw) == 4);
-  ck_assert(file.pos == 4);
+  ck_assert(wz_seek(3, SEEK_CUR, &cur) == 0);
+  ck_assert(wz_seek(1, SEEK_CUR, &cur) == 0);
+  ck_assert(cur.pos == 4);
 
   /* It should seek absolute address */
-  ck_assert(wz_seek(2, SEEK_SET, &file) == 0);
-  ck_assert(ftell(file.raw) == 2);
-  ck_assert(file.pos == 2);
+  ck_assert(wz_seek(2, SEEK_SET, &cur) == 0);
+  ck_assert(cur.pos == 2);
 
   /* It should not seek invalid address */
-  ck_assert(wz_seek(sizeof(str) + 1, SEEK_SET, &file) == 1);
-  ck_assert(ftell(file.raw) == 2);
-  ck_assert(file.pos == 2);
+  ck_assert(wz_seek(sizeof(str) + 1, SEEK_SET, &cur) == 1);
+  ck_assert(cur.pos == 2);
+
+  delete_file(&file);
+} END_TEST
+
+static const wz_uint64_t wide_base = (wz_uint64_t) 1 << 32;
+
+static int
+wide_read_at(void * user, void * buf, wz_uint32_t len, wz_uint64_t pos) {
+  ck_assert(pos >= wide_base && pos - wide_base + len <= 4);
+  memcpy(buf, (wz_uint8_t *) user + (pos - wide_base), len);
+  return 0;
+}
+
+START_TEST(test_read_wide) {
+  static wz_uint8_t str[] = {0x01, 0x23, 0x45, 0x67};
+  wz_uint32_t le32;
+  wzfile file;
+  wzcur cur;
+  file.io.user = str;
+  file.io.read_at = wide_read_at;
+  file.map = NULL;
+  file.cache = NULL;
+  file.size = wide_base + sizeof(str);
+  file.read_end = 0;
+  memset(&file.stats, 0, sizeof(file.stats));
+  cur.file = &file;
+  cur.pos = 0;
+
+  /* It should seek and read beyond 4 GiB */
+  ck_assert(wz_seek(wide_base, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_le32(&le32, &cur) == 0);
+  ck_assert(le32 == 0x67452301);
+  ck_assert(cur.pos == wide_base + sizeof(str));
+
+  /* It should not read beyond the end */
+  ck_assert(wz_read_le32(&le32, &cur) == 1);
+  ck_assert(wz_seek(1, SEEK_CUR, &cur) == 1);
+} END_TEST
+
+START_TEST(test_read_at) {
+  static const wz_uint8_t str[] = {0x01, 0x23, 0x45, 0x67, 0x89};
+  wz_uint8_t byte;
+  wzfile file;
+  wzcur a;
+  wzcur b;
+  create_file(&file, str, sizeof(str));
+  a.file = &file;
+  a.pos = 0;
+  b.file = &file;
+  b.pos = 3;
+
+  /* It should read at the cursor position regardless of the stream */
+  ck_assert(wz_read_byte(&byte, &b) == 0);
+  ck_assert(byte == 0x67);
+  ck_assert(wz_read_byte(&byte, &a) == 0);
+  ck_assert(byte == 0x01);
+  ck_assert(wz_read_byte(&byte, &b) == 0);
+  ck_assert(byte == 0x89);
+  ck_assert(wz_read_byte(&byte, &a) == 0);
+  ck_assert(byte == 0x23);
+  ck_assert(a.pos == 2 && b.pos == 5);
+  ck_assert(ftell(tmp_stdio.raw) == 0);
+
+  delete_file(&file);
+} END_TEST
+
+START_TEST(test_io_stats) {
+  enum { len = 0x300 };
+  wz_uint8_t * str;
+  wz_uint8_t buffer[4];
+  struct wz_io_stats stats;
+  wzfile file;
+  wzcur cur;
+  ck_assert((str = malloc(len)) != NULL);
+  memset(str, 0, len);
+  create_file(&file, str, len);
+  cur.file = &file;
+  cur.pos = 0;
+
+  /* It should not count the reads which follow the previous one as seeks */
+  ck_assert(wz_read_bytes(buffer, 4, &cur) == 0);
+  ck_assert(wz_read_byte(buffer, &cur) == 0);
+  ck_assert(wz_get_io_stats(&file, &stats) == 0);
+  ck_assert(stats.reads == 2 && stats.bytes == 5);
+  ck_assert(stats.forward == 0 && stats.backward == 0);
+
+  /* It should count the seeks by direction and distance */
+  ck_assert(wz_seek(0x205, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_byte(buffer, &cur) == 0);
+  ck_assert(wz_seek(0x1f6, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_bytes(buffer, 4, &cur) == 0);
+  ck_assert(wz_seek(2, SEEK_CUR, &cur) == 0);
+  ck_assert(wz_read_byte(buffer, &cur) == 0);
+  ck_assert(wz_get_io_stats(&file, &stats) == 0);
+  ck_assert(stats.reads == 5 && stats.bytes == 11);
+  ck_assert(stats.forward == 2 && stats.backward == 1);
+  ck_assert(stats.seeks[0] == 1 && stats.seeks[1] == 1);
+  ck_assert(stats.seeks[2] == 1 && stats.seeks[3] == 0);
+
+  /* It should not count the reads which failed */
+  ck_assert(wz_read_bytes(buffer, 4, &cur) == 0);
+  ck_assert(wz_seek(len, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_byte(buffer, &cur) == 1);
+  ck_assert(wz_get_io_stats(&file, &stats) == 0);
+  ck_assert(stats.reads == 6 && stats.bytes == 15);
+  file.size = len + 4; /* the backend fails beyond its end */
+  ck_assert(wz_read_bytes(buffer, 4, &cur) == 1);
+  ck_assert(wz_get_io_stats(&file, &stats) == 0);
+  ck_assert(stats.reads == 6 && stats.bytes == 15);
+  file.size = len;
+
+  /* It should not count the reads which do not reach the backend */
+  file.map = str;
+  ck_assert(wz_seek(0, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_bytes(buffer, 4, &cur) == 0);
+  ck_assert(wz_read_byte(buffer, &cur) == 0);
+  ck_assert(wz_get_io_stats(&file, &stats) == 0);
+  ck_assert(stats.reads == 6 && stats.bytes == 15);
+  file.map = NULL;
+
+  delete_file(&file);
+  free(str);
+} END_TEST
+
+START_TEST(test_read_cache) {
+  const wz_uint32_t len = WZ_CACHE_BLOCK_LEN * 8 + 3;
+  wz_uint8_t * str;
+  wz_uint8_t * buffer;
+  wz_uint8_t byte;
+  wz_uint64_t hits = 0;
+  wz_uint64_t misses = 0;
+  wz_uint64_t bytes = 0;
+  wz_uint32_t i;
+  wzfile file;
+  wzcur cur;
+  ck_assert((str = malloc(len)) != NULL);
+  ck_assert((buffer = malloc(WZ_CACHE_BLOCK_LEN)) != NULL);
+  for (i = 0; i < len; i++)
+    str[i] = (wz_uint8_t) (i * 7);
+  create_file(&file, str, len);
+  ck_assert((file.cache = wz_init_cache()) != NULL);
+  cur.file = &file;
+  cur.pos = 0;
+
+  /* It should read a whole block once and serve the rest from it */
+  ck_assert(wz_read_bytes(buffer, 3, &cur) == 0);
+  ck_assert(memcmp(buffer, str, 3) == 0);
+  ck_assert(wz_read_byte(&byte, &cur) == 0);
+  ck_assert(byte == str[3]);
+  ck_assert(wz_get_cache_stats(&hits, &misses, &bytes, &file) == 0);
+  ck_assert(hits == 1 && misses == 1 && bytes == WZ_CACHE_BLOCK_LEN);
+
+  /* It should read ahead more blocks if the reads are sequential */
+  ck_assert(wz_seek(WZ_CACHE_BLOCK_LEN - 1, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_bytes(buffer, 2, &cur) == 0);
+  ck_assert(memcmp(buffer, str + WZ_CACHE_BLOCK_LEN - 1, 2) == 0);
+  ck_assert(wz_get_cache_stats(&hits, &misses, &bytes, &file) == 0);
+  ck_assert(hits == 2 && misses == 2 && bytes == WZ_CACHE_BLOCK_LEN * 3);
+  ck_assert(wz_seek(WZ_CACHE_BLOCK_LEN * 3 - 1, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_byte(&byte, &cur) == 0);
+  ck_assert(byte == str[WZ_CACHE_BLOCK_LEN * 3 - 1]);
+  ck_assert(wz_get_cache_stats(&hits, &misses, &bytes, &file) == 0);
+  ck_assert(hits == 3 && misses == 2);
+
+  /* It should read only one block if the read is random */
+  ck_assert(wz_seek(len - 2, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_bytes(buffer, 2, &cur) == 0);
+  ck_assert(memcmp(buffer, str + len - 2, 2) == 0);
+  ck_assert(wz_get_cache_stats(&hits, &misses, &bytes, &file) == 0);
+  ck_assert(misses == 3 && bytes == WZ_CACHE_BLOCK_LEN * 3 + 3);
+
+  /* It should not cache a large read */
+  ck_assert(wz_seek(1, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_bytes(buffer, WZ_CACHE_BLOCK_LEN, &cur) == 0);
+  ck_assert(memcmp(buffer, str + 1, WZ_CACHE_BLOCK_LEN) == 0);
+  ck_assert(wz_get_cache_stats(&hits, &misses, &bytes, &file) == 0);
+  ck_assert(misses == 4 && bytes == WZ_CACHE_BLOCK_LEN * 4 + 3);
+
+  ck_assert(wz_free_cache(file.cache) == 0);
+  delete_file(&file);
+  free(buffer);
+  free(str);
+} END_TEST
+
+START_TEST(test_map_file) {
+  static const wz_uint8_t str[] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x80
+  };
+  wz_uint8_t byte;
+  wz_uint16_t le16;
+  wz_uint32_t le32;
+  wz_uint8_t buffer[2];
+  wzfile file;
+  wzcur cur;
+  create_file(&file, str, sizeof(str));
+  cur.file = &file;
+  cur.pos = 0;
+
+#ifndef WZ_NO_MMAP
+  /* It should map the whole file */
+  ck_assert(wz_map_stdio(&tmp_stdio) == 0);
+  ck_assert((file.map = file.io.map(file.io.user)) != NULL);
+  ck_assert(memcmp(file.map, str, sizeof(str)) == 0);
+
+  /* It should read from the mapped memory */
+  ck_assert(wz_read_byte(&byte, &cur) == 0);
+  ck_assert(byte == 0x01);
+  ck_assert(wz_read_le16(&le16, &cur) == 0);
+  ck_assert(le16 == 0x4523);
+  ck_assert(wz_seek(2, SEEK_CUR, &cur) == 0);
+  ck_assert(wz_read_le32(&le32, &cur) == 0);
+  ck_assert(le32 == 0x80efcdab);
+  ck_assert(cur.pos == sizeof(str));
+
+  /* It should not read beyond the mapped memory */
+  ck_assert(wz_read_bytes(buffer, 1, &cur) == 1);
+  ck_assert(cur.pos == sizeof(str));
+
+  /* It should seek absolute address without touching the stream */
+  ck_assert(wz_seek(1, SEEK_SET, &cur) == 0);
+  ck_assert(wz_read_bytes(buffer, sizeof(buffer), &cur) == 0);
+  ck_assert(buffer[0] == 0x23 && buffer[1] == 0x45);
+
+  ck_assert(wz_unmap_stdio(&tmp_stdio) == 0);
+  ck_assert(file.io.map(file.io.user) == NULL);
+#else
+  (void) cur;
+  (void) byte;
+  (void) le16;
+  (void) le32;
+  (void) buffer;
+  ck_assert(wz_map_stdio(&tmp_stdio) == 1);
+#endif
+
+  delete_file(&file);
+} END_TEST
+
+static wz_uint8_t * batch_str;
+static wz_uint32_t batch_done;
+
+static int
+done_req(wzreq * req, wzfile * file) {
+  (void) file;
+  ck_assert(req->read == req->len);
+  ck_assert(memcmp(req->bytes, batch_str + req->pos, req->len) == 0);
+  req->bytes = NULL;
+  batch_done++;
+  return 0;
+}
+
+START_TEST(test_read_batch) {
+  enum { len = 0x30000 + 0x123, reqs_len = 9 };
+  wz_uint8_t * str;
+  wz_uint8_t * bufs;
+  wzreq reqs[reqs_len];
+  wz_uint32_t i;
+  wz_uint8_t j;
+  wzfile file;
+  ck_assert((str = malloc(len)) != NULL);
+  ck_assert((bufs = malloc(reqs_len * 0x8000)) != NULL);
+  for (i = 0; i < len; i++)
+    str[i] = (wz_uint8_t) (i ^ (i >> 8));
+  batch_str = str;
+  create_file(&file, str, len);
+
+  for (j = 0; j < 2; j++) {
+    /* It should read every request from the backend or the memory */
+    file.map = j ? str : NULL;
+    for (i = 0; i < reqs_len; i++) {
+      reqs[i].pos = i * 0x5000;
+      reqs[i].len = 0x8000 - i;
+      reqs[i].read = 0;
+      reqs[i].bytes = bufs + i * 0x8000;
+    }
+    batch_done = 0;
+    ck_assert(wz_read_batch(reqs, reqs_len, &file, done_req) == 0);
+    ck_assert(batch_done == reqs_len);
+    for (i = 0; i < reqs_len; i++)
+      ck_assert(reqs[i].bytes == NULL);
+  }
+
+  /* It should not pass the request which is not read */
+  file.map = NULL;
+  reqs[0].pos = len - 1;
+  reqs[0].len = 2;
+  reqs[0].read = 0;
+  reqs[0].bytes = bufs;
+  batch_done = 0;
+  ck_assert(wz_read_batch(reqs, 1, &file, done_req) == 1);
+  ck_assert(batch_done == 0);
+  ck_assert(reqs[0].bytes == bufs);
+
+  delete_file(&file);
+  free(bufs);
+  free(str);
+} END_TEST
+
+START_TEST(test_get_raw) {
+  static const wz_uint8_t str[] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x80
+  };
+  const wz_uint8_t * bytes;
+  wz_uint32_t size;
+  wznode root;
+  wznode node;
+  wzimg img;
+  wzao ao;
+  wz_uint8_t j;
+  wzfile file;
+  create_file(&file, str, sizeof(str));
+  root.n.root.file = &file;
+  node.n.root.node = &root;
+  img.pos = 2;
+  img.size = 5;
+  img.data = NULL;
+  ao.pos = 3;
+  ao.size = WZ_AUDIO_PCM_SIZE + 4;
+  ao.format = WZ_AUDIO_PCM;
+  ao.data = NULL;
+
+  for (j = 0; j < 2; j++) {
+    /* It should read the bytes of image or point into the memory */
+    file.map = j ? str : NULL;
+    node.n.info = WZ_LEVEL | WZ_IMG;
+    node.n.val.img = &img;
+    ck_assert(wz_get_raw(&bytes, &size, &node) == 0);
+    ck_assert(size == 5);
+    ck_assert(memcmp(bytes, str + 2, 5) == 0);
+    ck_assert((bytes == str + 2) == j);
+    ck_assert(wz_free_raw(bytes, &node) == 0);
+
+    /* It should not include the header of pcm */
+    node.n.info = WZ_LEVEL | WZ_AO;
+    node.n.val.ao = &ao;
+    ck_assert(wz_get_raw(&bytes, &size, &node) == 0);
+    ck_assert(size == 4);
+    ck_assert(memcmp(bytes, str + 3, 4) == 0);
+    ck_assert(wz_free_raw(bytes, &node) == 0);
+  }
+
+  /* It should not get the bytes of other types */
+  node.n.info = WZ_LEVEL | WZ_VEX;
+  ck_assert(wz_get_raw(&bytes, &size, &node) == 1);
+
+  /* It should not read beyond the file */
+  file.map = NULL;
+  node.n.info = WZ_LEVEL | WZ_IMG;
+  node.n.val.img = &img;
+  img.size = sizeof(str);
+  ck_assert(wz_get_raw(&bytes, &size, &node) == 1);
 
   delete_file(&file);
 } END_TEST
 
+static struct {
+  wz_uint64_t pos;
+  wz_uint64_t len;
+  int advice;
+  wz_uint8_t _[sizeof(wz_uint64_t) - sizeof(int)]; /* padding */
+} advised;
+
+static int
+io_advise(void * user, wz_uint64_t pos, wz_uint64_t len, int advice) {
+  (void) user;
+  advised.pos = pos;
+  advised.len = len;
+  advised.advice = advice;
+  return 0;
+}
+
+START_TEST(test_intern_name) {
+  enum {N = WZ_NAMES_SLOTS_MIN * 8};
+  wznames * names;
+  wz_uint8_t * first;
+  wz_uint8_t * name;
+  const wz_uint8_t * found;
+  wz_uint8_t bytes[32];
+  wz_uint32_t i;
+
+  /* It should be ok */
+  ck_assert((names = wz_init_names()) != NULL);
+  ck_assert(wz_intern_name(&first, cp1252, sizeof(cp1252), names) == 0);
+  ck_assert(memcmp(first, cp1252, sizeof(cp1252)) == 0);
+  ck_assert(first[sizeof(cp1252)] == '\0');
+
+  /* It should share the name interned already */
+  ck_assert(wz_intern_name(&name, cp1252, sizeof(cp1252), names) == 0);
+  ck_assert(name == first);
+  ck_assert(wz_lookup_name(&found, cp1252, sizeof(cp1252), names) == 0);
+  ck_assert(found == first);
+
+  /* It should not find the name never interned */
+  ck_assert(wz_lookup_name(&found, cp1252, sizeof(cp1252) - 1, names) == 0);
+  ck_assert(found == NULL);
+
+  /* It should keep the names while the table and the arena grow */
+  memset(bytes, 'x', sizeof(bytes));
+  for (i = 0; i < N; i++) {
+    memcpy(bytes, &i, sizeof(i));
+    ck_assert(wz_intern_name(&name, bytes, sizeof(bytes), names) == 0);
+  }
+  ck_assert(names->len == N + 1);
+  ck_assert(names->capa > WZ_NAMES_SLOTS_MIN);
+  for (i = 0; i < N; i++) {
+    memcpy(bytes, &i, sizeof(i));
+    ck_assert(wz_lookup_name(&found, bytes, sizeof(bytes), names) == 0);
+    ck_assert(found != NULL);
+    ck_assert(memcmp(found, bytes, sizeof(bytes)) == 0);
+  }
+  ck_assert(wz_lookup_name(&found, cp1252, sizeof(cp1252), names) == 0);
+  ck_assert(found == first);
+  ck_assert(wz_free_names(names) == 0);
+  ck_assert(memused() == 0);
+} END_TEST
+
 START_TEST(test_read_lv0) {
   wz_uint8_t head[5];
   const wz_uint32_t root_addr = sizeof(head);
@@ -745,6 +1458,7 @@ START_TEST(test_read_lv0) {
   wz_uint32_t addr_enc;
   wz_uint8_t offset;
   wz_uint8_t key[KEY_BUF_SIZE];
+  wzkeys keys;
   wz_uint8_t enc[KEY_BUF_SIZE];
   wz_uint8_t i;
   wz_uint32_t child_addr;
@@ -759,6 +1473,7 @@ START_TEST(test_read_lv0) {
   node.n.info = WZ_EMBED;
   node.na_e.addr = root_addr;
   keygen(key, KEY_BUF_SIZE);
+  keyset(&keys, key, KEY_BUF_SIZE);
   file.key = 0;
   file.start = start;
   file.hash = hash;
@@ -778,7 +1493,7 @@ START_TEST(test_read_lv0) {
 
     /* It should read type 1 */
     ck_assert(memused() == 0);
-    ck_assert(wz_read_lv0(&node, &file, key) == 0);
+    ck_assert(wz_read_lv0(&node, &file, &keys) == 0);
     ck_assert(memused() != 0);
     ck_assert(node.n.val.ary != NULL);
     ck_assert(node.n.val.ary->len == 1);
@@ -823,7 +1538,7 @@ START_TEST(test_read_lv0) {
 
     /* It should read type 2 */
     ck_assert(memused() == 0);
-    ck_assert(wz_read_lv0(&node, &file, key) == 0);
+    ck_assert(wz_read_lv0(&node, &file, &keys) == 0);
     ck_assert(memused() != 0);
     ck_assert(node.n.val.ary != NULL);
     ck_assert(node.n.val.ary->len == 1);
@@ -875,7 +1590,7 @@ START_TEST(test_read_lv0) {
 
     /* It should read type 3 */
     ck_assert(memused() == 0);
-    ck_assert(wz_read_lv0(&node, &file, key) == 0);
+    ck_assert(wz_read_lv0(&node, &file, &keys) == 0);
     ck_assert(memused() != 0);
     ck_assert(node.n.val.ary != NULL);
     ck_assert(node.n.val.ary->len == 1);
@@ -927,7 +1642,7 @@ START_TEST(test_read_lv0) {
 
     /* It should read type 4 */
     ck_assert(memused() == 0);
-    ck_assert(wz_read_lv0(&node, &file, key) == 0);
+    ck_assert(wz_read_lv0(&node, &file, &keys) == 0);
     ck_assert(memused() != 0);
     ck_assert(node.n.val.ary != NULL);
     ck_assert(node.n.val.ary->len == 1);
@@ -1035,7 +1750,7 @@ START_TEST(test_read_lv0) {
     free(str);
 
     ck_assert(memused() == 0);
-    ck_assert(wz_read_lv0(&node, &file, key) == 0);
+    ck_assert(wz_read_lv0(&node, &file, &keys) == 0);
     ck_assert(memused() != 0);
     ck_assert(node.n.val.ary != NULL);
     ck_assert(node.n.val.ary->len == 4);
@@ -1111,6 +1826,147 @@ START_TEST(test_read_lv0) {
     ck_assert(child->n.val.ary == NULL);
     child++;
 
+    /* It should hint the range of the image */
+    file.size = addr_dec + 1;
+    file.io.advise = io_advise;
+    advised.len = 0;
+    child = node.n.val.ary->nodes;
+    ck_assert(wz_advise_node(child, WZ_ADVICE_WILLNEED) == 0);
+    ck_assert(advised.len == 0);
+    ck_assert(wz_advise_node(child + 1, WZ_ADVICE_WILLNEED) == 0);
+    ck_assert(advised.pos == addr_dec);
+    ck_assert(advised.len == 1);
+    ck_assert(advised.advice == WZ_ADVICE_WILLNEED);
+    ck_assert(wz_advise_node(child + 1, WZ_ADVICE_DONTNEED + 1) == 1);
+    file.size = str_len;
+    file.io.advise = NULL;
+
+    wz_free_lv0(&node);
+    ck_assert(memused() == 0);
+
+    delete_file(&file);
+  }
+
+  {
+    enum {ENTRIES = 64, LINKS = 4, NAME_LEN = 40};
+    static wz_uint8_t str[5 + 1 + (ENTRIES - LINKS) * (1 + 1 + NAME_LEN + 6) +
+                          LINKS * (1 + 4 + 6)];
+    wz_uint8_t dec[NAME_LEN];
+    wz_uint8_t dec_enc[NAME_LEN];
+    wz_uint32_t str_i = sizeof(head);
+    wz_uint32_t n;
+
+    for (i = 0; i < sizeof(head); i++)
+      str[i] = head[i];
+    for (i = 0; i < NAME_LEN; i++)
+      dec[i] = (wz_uint8_t) ('a' + i % 26);
+    cp1252_encode(dec_enc, dec, NAME_LEN, NULL); /* longer than the key */
+    str[str_i++] = ENTRIES; /* len */
+    for (n = 0; n < ENTRIES; n++) {
+      if (n < ENTRIES - LINKS) {
+        str[str_i++] = 0x03; /* type */
+        str[str_i++] = (~NAME_LEN + 1) & 0xff;
+        for (i = 0; i < NAME_LEN; i++)
+          str[str_i++] = dec_enc[i];
+      } else {
+        str[str_i++] = 0x02; /* type */
+        str[str_i++] = (wz_uint8_t) (sizeof(head) + 1 - start); /* offset */
+        str[str_i++] = 0;
+        str[str_i++] = 0;
+        str[str_i++] = 0;
+      }
+      str[str_i++] = 0x01; /* size */
+      str[str_i++] = 0x23; /* check */
+      wz_encode_addr(&addr_enc, addr_dec + n, str_i, start, hash);
+      str[str_i++] = (addr_enc      ) & 0xff; /* addr */
+      str[str_i++] = (addr_enc >>  8) & 0xff;
+      str[str_i++] = (addr_enc >> 16) & 0xff;
+      str[str_i++] = (wz_uint8_t) (addr_enc >> 24);
+    }
+    ck_assert(str_i == sizeof(str));
+
+    create_file(&file, str, sizeof(str));
+
+    /* It should read the directory larger than its first window */
+    ck_assert(sizeof(str) > ENTRIES * WZ_LV0_ENTRY_LEN + WZ_LV0_ENTRY_MAX);
+    file.key = WZ_KEY_EMPTY;
+    ck_assert(memused() == 0);
+    ck_assert(wz_read_lv0(&node, &file, &keys) == 0);
+    file.key = 0;
+    ck_assert(node.n.val.ary->len == ENTRIES);
+    for (n = 0; n < ENTRIES; n++) {
+      child = node.n.val.ary->nodes + n;
+      ck_assert((child->n.info & WZ_TYPE) == WZ_ARY);
+      ck_assert(child->n.name_len == NAME_LEN);
+      ck_assert(memcmp(child->n.info & WZ_EMBED ?
+                       child->n.name_e : child->n.name, dec, NAME_LEN) == 0);
+      ck_assert((child->n.info & WZ_EMBED ?
+                 child->na_e.addr : child->na.addr) == addr_dec + n);
+    }
+    wz_free_lv0(&node);
+    ck_assert(memused() == 0);
+
+    delete_file(&file);
+  }
+
+  {
+    enum {ENTRIES = 64, NAME_LEN = 40, ENTRY = 1 + 1 + NAME_LEN + 6,
+          TARGET = 48}; /* the entry cut off by the end of the window */
+    static wz_uint8_t str[5 + 1 + 1 + 4 + 6 + (ENTRIES - 1) * ENTRY];
+    const wz_uint32_t win_end = 5 + 1 + ENTRIES * WZ_LV0_ENTRY_LEN +
+                                WZ_LV0_ENTRY_MAX;
+    wz_uint32_t target = 5 + 1 + 1 + 4 + 6 + TARGET * ENTRY;
+    wz_uint8_t dec[NAME_LEN];
+    wz_uint8_t dec_enc[NAME_LEN];
+    wz_uint32_t str_i = sizeof(head);
+    wz_uint32_t n;
+
+    for (i = 0; i < sizeof(head); i++)
+      str[i] = head[i];
+    for (i = 0; i < NAME_LEN; i++)
+      dec[i] = (wz_uint8_t) ('a' + i % 26);
+    cp1252_encode(dec_enc, dec, NAME_LEN, NULL);
+    str[str_i++] = ENTRIES; /* len */
+    for (n = 0; n < ENTRIES; n++) {
+      if (n) {
+        str[str_i++] = 0x03; /* type */
+        str[str_i++] = (~NAME_LEN + 1) & 0xff;
+        for (i = 0; i < NAME_LEN; i++)
+          str[str_i++] = dec_enc[i];
+      } else {
+        str[str_i++] = 0x02; /* type */
+        str[str_i++] = ((target - start)      ) & 0xff; /* offset */
+        str[str_i++] = ((target - start) >>  8) & 0xff;
+        str[str_i++] = 0;
+        str[str_i++] = 0;
+      }
+      str[str_i++] = 0x01; /* size */
+      str[str_i++] = 0x23; /* check */
+      wz_encode_addr(&addr_enc, addr_dec + n, str_i, start, hash);
+      str[str_i++] = (addr_enc      ) & 0xff; /* addr */
+      str[str_i++] = (addr_enc >>  8) & 0xff;
+      str[str_i++] = (addr_enc >> 16) & 0xff;
+      str[str_i++] = (wz_uint8_t) (addr_enc >> 24);
+    }
+    ck_assert(str_i == sizeof(str));
+
+    create_file(&file, str, sizeof(str));
+
+    /* It should read the link whose name runs out of the window */
+    ck_assert(target < win_end && win_end - target < WZ_LV0_ENTRY_MAX);
+    ck_assert(target + 2 + NAME_LEN > win_end);
+    ck_assert(sizeof(str) > win_end);
+    file.key = WZ_KEY_EMPTY;
+    ck_assert(wz_read_lv0(&node, &file, &keys) == 0);
+    file.key = 0;
+    ck_assert(node.n.val.ary->len == ENTRIES);
+    child = node.n.val.ary->nodes;
+    ck_assert((child->n.info & WZ_TYPE) == WZ_ARY);
+    ck_assert(child->n.name_len == NAME_LEN);
+    ck_assert(memcmp(child->n.info & WZ_EMBED ?
+                     child->n.name_e : child->n.name, dec, NAME_LEN) == 0);
+    ck_assert((child->n.info & WZ_EMBED ?
+               child->na_e.addr : child->na.addr) == addr_dec);
     wz_free_lv0(&node);
     ck_assert(memused() == 0);
 
@@ -1130,13 +1986,32 @@ START_TEST(test_read_lv0) {
 
     /* It should not read type 5 */
     ck_assert(memused() == 0);
-    ck_assert(wz_read_lv0(&node, &file, key) == 1);
+    ck_assert(wz_read_lv0(&node, &file, &keys) == 1);
     ck_assert(memused() == 0);
 
     delete_file(&file);
   }
 } END_TEST
 
+START_TEST(test_get_lv1_type) {
+#define type(str) wz_get_lv1_type((const wz_uint8_t *) (str), sizeof(str) - 1)
+  /* It should be ok */
+  ck_assert(type("Property")         == WZ_ARY);
+  ck_assert(type("Canvas")           == WZ_IMG);
+  ck_assert(type("Shape2D#Convex2D") == WZ_VEX);
+  ck_assert(type("Shape2D#Vector2D") == WZ_VEC);
+  ck_assert(type("Sound_DX8")        == WZ_AO);
+  ck_assert(type("UOL")              == WZ_UOL);
+
+  /* It should not know the other types */
+  ck_assert(type("")                 == WZ_UNK);
+  ck_assert(type("UO")               == WZ_UNK);
+  ck_assert(type("Propertz")         == WZ_UNK);
+  ck_assert(type("Shape2D#Vector3D") == WZ_UNK);
+  ck_assert(type("Sound_DX8 ")       == WZ_UNK);
+#undef type
+} END_TEST
+
 START_TEST(test_encode_ver) {
   wz_uint16_t dec = 0x0123;
 
@@ -1148,10 +2023,114 @@ START_TEST(test_encode_ver) {
   ck_assert(hash == 0xd372);
 } END_TEST
 
+START_TEST(test_deduce_key) {
+  static const wz_uint8_t dec[] = {'P', 'r', 'o', 'p', 'e', 'r', 't', 'y'};
+  static const wz_uint8_t bad[] = {'P', 'r', 'o', 'p', 0x01, 'r', 't', 'y'};
+  wz_uint8_t key[sizeof(dec)];
+  wzkeys keys;
+  wz_uint8_t enc[sizeof(dec)];
+  wz_uint8_t str[sizeof(dec)];
+  wz_uint8_t ret_key;
+  keygen(key, sizeof(key));
+  keyset(&keys, key, sizeof(key));
+
+  /* It should decode with the hint */
+  cp1252_encode(enc, dec, sizeof(dec), key);
+  memcpy(str, enc, sizeof(str));
+  ck_assert(wz_deduce_key(&ret_key, str, sizeof(str), 0, &keys) == 0);
+  ck_assert(ret_key == 0);
+  ck_assert(memcmp(str, dec, sizeof(dec)) == 0);
+
+  /* It should fall back to the other keys if the hint is wrong */
+  memcpy(str, enc, sizeof(str));
+  ck_assert(wz_deduce_key(&ret_key, str, sizeof(str), 2, &keys) == 0);
+  ck_assert(ret_key == 0);
+  ck_assert(memcmp(str, dec, sizeof(dec)) == 0);
+
+  /* It should try the hint first (key 1 is empty as well in keyset) */
+  cp1252_encode(enc, dec, sizeof(dec), NULL);
+  memcpy(str, enc, sizeof(str));
+  ck_assert(wz_deduce_key(&ret_key, str, sizeof(str), WZ_KEY_EMPTY,
+                          &keys) == 0);
+  ck_assert(ret_key == WZ_KEY_EMPTY);
+  ck_assert(memcmp(str, dec, sizeof(dec)) == 0);
+
+  /* It should keep the string if no key is found */
+  cp1252_encode(enc, bad, sizeof(bad), key);
+  memcpy(str, enc, sizeof(str));
+  ck_assert(wz_deduce_key(&ret_key, str, sizeof(str), 0, &keys) == 1);
+  ck_assert(memcmp(str, enc, sizeof(enc)) == 0);
+} END_TEST
+
+START_TEST(test_match_keys) {
+  static const wz_uint8_t dec[] = {
+    'C', 'h', 'a', 'r', 'a', 'c', 't', 'e', 'r'
+  };
+  static const wz_uint32_t ivs[] = {0x7e81dc4b, 0x3bc5d10a};
+  wz_uint8_t aes_key[32];
+  wz_uint8_t str[sizeof(dec)];
+  wzctx * ctx;
+  wzkeys * added;
+  wzkeys * ret_keys;
+  const wz_uint8_t * mask;
+  wz_uint8_t ret_key;
+  wz_uint8_t i;
+  ck_assert((ctx = wz_init_ctx()) != NULL);
+  for (i = 0; i < sizeof(aes_key); i++)
+    aes_key[i] = (wz_uint8_t) (i * 7);
+
+  /* It should not add the keys without ivs or with too many ivs */
+  ck_assert(wz_add_keys(ctx, ivs, 0, aes_key) == 1);
+  ck_assert(wz_add_keys(ctx, ivs, WZ_KEYS_LEN + 1, aes_key) == 1);
+  ck_assert(ctx->profiles_len == 1);
+
+  /* It should fingerprint every key once it is added */
+  ck_assert(wz_add_keys(ctx, ivs, 1, aes_key) == 0);
+  ck_assert(ctx->profiles_len == 2);
+  added = ctx->profiles[1].keys;
+  ck_assert(added->ivs[1] == ivs[0]);
+  for (i = 0; i <= WZ_KEY_EMPTY; i++) {
+    ck_assert((mask = wz_get_mask(added, i, WZ_ENC_CP1252, 8)) != NULL);
+    ck_assert(ctx->profiles[1].prints[i] == wz_print_name(mask, 8));
+  }
+
+  /* It should match the name to the keys which decode it */
+  ck_assert((mask = wz_get_mask(added, 0, WZ_ENC_CP1252,
+                                sizeof(dec))) != NULL);
+  for (i = 0; i < sizeof(dec); i++)
+    str[i] = dec[i] ^ mask[i];
+  ck_assert(wz_match_keys(&ret_keys, &ret_key, str, sizeof(str), ctx) == 0);
+  ck_assert(ret_keys == added);
+  ck_assert(ret_key == 0);
+  ck_assert(memcmp(str, dec, sizeof(dec)) == 0);
+
+  /* It should match the built in keys first */
+  ck_assert((mask = wz_get_mask(ctx->profiles[0].keys, 1, WZ_ENC_CP1252,
+                                sizeof(dec))) != NULL);
+  for (i = 0; i < sizeof(dec); i++)
+    str[i] = dec[i] ^ mask[i];
+  ck_assert(wz_match_keys(&ret_keys, &ret_key, str, sizeof(str), ctx) == 0);
+  ck_assert(ret_keys == ctx->profiles[0].keys);
+  ck_assert(ret_key == 1);
+  ck_assert(memcmp(str, dec, sizeof(dec)) == 0);
+
+  /* It should fail if no keys decode the name */
+  for (i = 0; i < sizeof(str); i++)
+    str[i] = (wz_uint8_t) (0xaa + i); /* zeros by the empty key */
+  ck_assert(wz_match_keys(&ret_keys, &ret_key, str, sizeof(str), ctx) == 1);
+
+  ck_assert(wz_free_ctx(ctx) == 0);
+  ck_assert(memerr() == 0);
+} END_TEST
+
 START_TEST(test_deduce_ver) {
   static const wz_uint8_t str_dec[] = {'a', 'b'};
   wz_uint8_t str_enc[sizeof(str_dec)];
   wz_uint8_t key[sizeof(str_dec)];
+  wzkeys keys;
+  wzprofile profile;
+  wzctx ctx;
+  wzkeys * ret_keys = NULL;
   wz_uint8_t head[5];
   wz_uint8_t str1[1 + 1 + 1 + sizeof(str_dec) + 1 + 1 + 4];
   wz_uint32_t str_i;
@@ -1168,11 +2147,22 @@ START_TEST(test_deduce_ver) {
   wz_uint16_t ret_dec;
   wz_uint32_t ret_hash;
   wz_uint8_t ret_key = 1;
+  wz_uint16_t ver;
   wzfile file;
 
+  /* It should encode every version as the table */
+  for (ver = 0; ver < sizeof(wz_ver_encs); ver++) {
+    wz_encode_ver(&enc, &hash, ver);
+    ck_assert(enc == wz_ver_encs[ver]);
+  }
+
   for (i = 0; i < sizeof(head); i++)
     head[i] = i;
   keygen(key, sizeof(str_dec));
+  keyset(&keys, key, sizeof(str_dec));
+  ck_assert(wz_init_profile(&profile, &keys) == 0);
+  ctx.profiles = &profile;
+  ctx.profiles_len = 1;
   cp1252_encode(str_enc, str_dec, sizeof(str_dec), key);
 
   wz_encode_ver(&enc, &hash, dec);
@@ -1199,15 +2189,23 @@ START_TEST(test_deduce_ver) {
   create_file(&file, str, sizeof(str));
 
   /* It should be ok */
-  ck_assert(wz_deduce_ver(&ret_dec, &ret_hash, &ret_key, enc,
-                          root_addr, start, sizeof(str), file.raw, key) == 0);
+  ck_assert(wz_deduce_ver(&ret_dec, &ret_hash, &ret_keys, &ret_key, enc,
+                          root_addr, start, &file, &ctx) == 0);
   ck_assert(ret_dec == dec);
   ck_assert(ret_hash == hash);
+  ck_assert(ret_keys == &keys);
   ck_assert(ret_key == 0);
 
   delete_file(&file);
 } END_TEST
 
+static const wz_uint8_t aes_cipher[32] = {
+  0x96, 0xae, 0x3f, 0xa4, 0x48, 0xfa, 0xdd, 0x90,
+  0x46, 0x76, 0x05, 0x61, 0x97, 0xce, 0x78, 0x68,
+  0x2b, 0xa0, 0x44, 0x8f, 0xc1, 0x56, 0x7e, 0x32,
+  0xfc, 0xe1, 0xf5, 0xb3, 0x14, 0x14, 0xc5, 0x22
+};
+
 START_TEST(test_encode_aes) {
   static const wz_uint8_t iv[16] = {
     0x4d, 0x23, 0xc7, 0x2b, 0x4d, 0x23, 0xc7, 0x2b,
@@ -1219,19 +2217,118 @@ START_TEST(test_encode_aes) {
     0x1b, 0x00, 0x00, 0x00, 0x0f, 0x00, 0x00, 0x00,
     0x33, 0x00, 0x00, 0x00, 0x52, 0x00, 0x00, 0x00
   };
-  wz_uint8_t cipher[32];
-  static const wz_uint8_t expected[sizeof(cipher)] = {
-    0x96, 0xae, 0x3f, 0xa4, 0x48, 0xfa, 0xdd, 0x90,
-    0x46, 0x76, 0x05, 0x61, 0x97, 0xce, 0x78, 0x68,
-    0x2b, 0xa0, 0x44, 0x8f, 0xc1, 0x56, 0x7e, 0x32,
-    0xfc, 0xe1, 0xf5, 0xb3, 0x14, 0x14, 0xc5, 0x22
-  };
+  wz_uint8_t cipher[sizeof(aes_cipher)];
+  aes256_context ctx;
+  wz_uint8_t block[16];
+  wz_uint8_t ni;
+  wz_uint8_t i;
 
   /* It shoule be ok */
   wz_encode_aes(cipher, sizeof(cipher), key, iv);
-  ck_assert(memcmp(cipher, expected, sizeof(cipher)) == 0);
+  ck_assert(memcmp(cipher, aes_cipher, sizeof(cipher)) == 0);
+
+  /* It should give the same blocks by the tables and by AES-NI if any */
+  aes256_init(&ctx, key);
+  ni = ctx.ni;
+  for (ctx.ni = 0; ctx.ni <= ni; ctx.ni++) {
+    memcpy(block, iv, sizeof(block));
+    for (i = 0; i < sizeof(aes_cipher); i += sizeof(block)) {
+      aes256_encrypt_ecb(&ctx, block);
+      ck_assert(memcmp(block, aes_cipher + i, sizeof(block)) == 0);
+    }
+  }
+  aes256_done(&ctx);
+} END_TEST
+
+START_TEST(test_expand_keys) {
+  wzkeys * part;
+  wzkeys * full;
+  const wz_uint8_t * key;
+  wz_uint8_t i;
+
+  /* It should expand nothing until the keys are used */
+  ck_assert((part = wz_init_keys(wz_aes_ivs, NULL)) != NULL);
+  ck_assert(part->len == 0);
+
+  /* It should expand a chunk of each key */
+  ck_assert((key = wz_get_key(part, 0, sizeof(aes_cipher))) != NULL);
+  ck_assert(part->len == WZ_KEY_CHUNK_LEN);
+  ck_assert(memcmp(key, aes_cipher, sizeof(aes_cipher)) == 0);
+
+  /* It should go on from the expanded chunks */
+  ck_assert(wz_get_key(part, 1, WZ_KEY_CHUNK_LEN + 1) != NULL);
+  ck_assert(part->len == WZ_KEY_CHUNK_LEN * 2);
+  ck_assert((full = wz_init_keys(wz_aes_ivs, NULL)) != NULL);
+  ck_assert(wz_get_key(full, 0, WZ_KEY_UTF8_MAX_LEN) != NULL);
+  ck_assert(full->len == WZ_KEY_UTF8_MAX_LEN);
+  for (i = 0; i < WZ_KEYS_LEN; i++)
+    ck_assert(memcmp(wz_get_key(part, i, 0), wz_get_key(full, i, 0),
+                     WZ_KEY_CHUNK_LEN * 2) == 0);
+
+  /* It should not expand beyond the keys */
+  ck_assert(wz_get_key(part, 0, WZ_KEY_UTF8_MAX_LEN + 1) == NULL);
+
+  ck_assert(wz_free_keys(full) == 0);
+  ck_assert(wz_free_keys(part) == 0);
+  ck_assert(memerr() == 0);
 } END_TEST
 
+START_TEST(test_init_ctx) {
+  wzctx * ctx;
+  wzctx * other;
+  wzkeys * keys;
+  const wz_uint8_t * key;
+  const wz_uint8_t * ascii;
+  const wz_uint8_t * utf16;
+  wz_uint8_t i;
+
+  /* It should expand or generate the same keys */
+  ck_assert((ctx = wz_init_ctx()) != NULL);
+  keys = ctx->profiles[0].keys;
+  ck_assert(memcmp(wz_get_key(keys, 0, sizeof(aes_cipher)),
+                   aes_cipher, sizeof(aes_cipher)) == 0);
+
+  /* It should combine the masks with the keys */
+  ck_assert((key = wz_get_key(keys, 1, 32)) != NULL);
+  ck_assert((ascii = wz_get_mask(keys, 1, WZ_ENC_CP1252, 32)) != NULL);
+  ck_assert((utf16 = wz_get_mask(keys, 1, WZ_ENC_UTF16LE, 32)) != NULL);
+  for (i = 0; i < 32; i++)
+    ck_assert(ascii[i] == (wz_uint8_t) ((0xaa + i) ^ key[i]));
+  for (i = 0; i < 32; i += 2) {
+    ck_assert(utf16[i] == (wz_uint8_t) ((0xaa + i / 2) ^ key[i]));
+    ck_assert(utf16[i + 1] == (0xaa ^ key[i + 1]));
+  }
+  ck_assert((ascii = wz_get_mask(keys, WZ_KEY_EMPTY, WZ_ENC_CP1252,
+                                 32)) != NULL);
+  for (i = 0; i < 32; i++)
+    ck_assert(ascii[i] == (wz_uint8_t) (0xaa + i));
+
+  /* It should share the keys between contexts */
+  ck_assert((other = wz_init_ctx()) != NULL);
+  ck_assert(other->profiles[0].keys == keys);
+  ck_assert(wz_free_ctx(ctx) == 0);
+  keys = other->profiles[0].keys;
+  ck_assert(memcmp(wz_get_key(keys, 0, sizeof(aes_cipher)),
+                   aes_cipher, sizeof(aes_cipher)) == 0);
+  ck_assert(wz_free_ctx(other) == 0);
+  ck_assert(memerr() == 0);
+} END_TEST
+
+static wz_uint32_t io_len;
+
+static int
+io_read_at(void * user, void * buf, wz_uint32_t len, wz_uint64_t pos) {
+  ck_assert(pos <= io_len && len <= io_len - pos);
+  memcpy(buf, (wz_uint8_t *) user + pos, len);
+  return 0;
+}
+
+static int
+io_size(void * user, wz_uint64_t * size) {
+  (void) user;
+  return * size = io_len, 0;
+}
+
 START_TEST(test_open_file) {
   const wz_uint16_t dec = 0x00ce;
   wz_uint32_t hash;
@@ -1242,11 +2339,12 @@ START_TEST(test_open_file) {
   const wz_uint8_t start = sizeof(head) - 2;
   static const wz_uint8_t str_dec[] = {'c', 'd'};
   wz_uint8_t str_enc[sizeof(str_dec)];
-  wz_uint8_t * key;
+  const wz_uint8_t * key;
   wz_uint8_t str1[1 + 1 + 1 + sizeof(str_dec) + 1 + 1 + 4];
   wz_uint32_t str_len = sizeof(head) + sizeof(str1);
   wz_uint32_t str_i;
   wz_uint8_t * str;
+  wz_uint8_t * owned;
   const wz_uint32_t addr_pos = str_len - 4;
   const wz_uint32_t addr_dec = root_addr;
   wz_uint32_t addr_enc;
@@ -1258,6 +2356,8 @@ START_TEST(test_open_file) {
   wzctx * ctx;
   wzfile created;
   wzfile * file;
+  FILE * raw;
+  wzio io;
   wznode * root;
   wznode * node;
 
@@ -1287,7 +2387,8 @@ START_TEST(test_open_file) {
   ck_assert((ctx = wz_init_ctx()) != NULL);
   ck_assert(memused() != 0);
   mem_size_ctx = memused();
-  key = ctx->keys;
+  ck_assert((key = wz_get_key(ctx->profiles[0].keys, 0,
+                             sizeof(str_dec))) != NULL);
 
   cp1252_encode(str_enc, str_dec, sizeof(str_dec), key);
   wz_encode_addr(&addr_enc, addr_dec, addr_pos, start, hash);
@@ -1346,9 +2447,500 @@ START_TEST(test_open_file) {
 
   ck_assert(wz_close_file(file) == 0);
 
+  /* It should open the same bytes from memory */
+  ck_assert(memused() == mem_size_ctx);
+  ck_assert((raw = fopen(tmp_fname, "rb")) != NULL);
+  ck_assert((str = malloc(str_len)) != NULL);
+  ck_assert(fread(str, str_len, 1, raw) == 1);
+  ck_assert(fclose(raw) == 0);
+  ck_assert((file = wz_open_mem(str, str_len, ctx)) != NULL);
+  ck_assert(file->io.close == wz_mem_close);
+  ck_assert(file->map == str);
+  ck_assert(file->size == str_len);
+  ck_assert(file->start == start);
+  ck_assert(file->hash == hash);
+  ck_assert(file->root.na_e.addr == root_addr);
+  ck_assert((root = wz_open_root(file)) != NULL);
+  ck_assert((node = wz_open_node(root, "cd")) != NULL);
+  ck_assert(wz_close_file(file) == 0);
+
+  /* It should open the same bytes through a custom backend */
+  io.user = str;
+  io.read_at = io_read_at;
+  io.size = io_size;
+  io.map = NULL;
+  io.advise = io_advise;
+  io.close = NULL;
+  io_len = str_len;
+  ck_assert((file = wz_open_io(&io, ctx)) != NULL);
+  ck_assert(file->map == NULL);
+  ck_assert(file->root.na_e.addr == root_addr);
+  ck_assert((root = wz_open_root(file)) != NULL);
+  ck_assert((node = wz_open_node(root, "cd")) != NULL);
+
+  /* It should stop reading ahead if the file is read randomly */
+  ck_assert(wz_advise_file(file, WZ_ADVICE_RANDOM) == 0);
+  ck_assert(advised.pos == 0);
+  ck_assert(advised.len == str_len);
+  ck_assert(advised.advice == WZ_ADVICE_RANDOM);
+  ck_assert(file->cache->ahead_max == 1);
+  ck_assert(wz_advise_file(file, WZ_ADVICE_NORMAL) == 0);
+  ck_assert(advised.advice == WZ_ADVICE_NORMAL);
+  ck_assert(file->cache->ahead_max == WZ_CACHE_AHEAD_MAX);
+  ck_assert(wz_close_file(file) == 0);
+
+  /* It should free the buffer if it takes the ownership */
+  ck_assert((owned = wrap_malloc(str_len)) != NULL); /* freed by the file */
+  memcpy(owned, str, str_len);
+  free(str);
+  ck_assert((file = wz_open_mem(owned, str_len, ctx)) != NULL);
+  ck_assert(wz_own_mem(file) == 0);
+  ck_assert(wz_close_file(file) == 0);
+
   ck_assert(memused() == mem_size_ctx);
   ck_assert(wz_free_ctx(ctx) == 0);
   ck_assert(memused() == 0);
+  ck_assert(memerr() == 0);
+} END_TEST
+
+typedef struct { /* a wz file being built by the tests below */
+  wz_uint8_t * bytes;
+  wz_uint32_t  len;
+  wz_uint32_t  capa;
+} wzbuf;
+
+enum { BUF_START = 4 + 4 + 4 + 4 + 2 }; /* the header ends with "t" */
+
+static void
+put_bytes(wzbuf * buf, const void * bytes, wz_uint32_t len) {
+  if (buf->len + len > buf->capa) {
+    wz_uint32_t capa = buf->capa ? buf->capa : 0x100;
+    while (buf->len + len > capa)
+      capa <<= 1;
+    ck_assert((buf->bytes = realloc(buf->bytes, capa)) != NULL);
+    buf->capa = capa;
+  }
+  if (len)
+    memcpy(buf->bytes + buf->len, bytes, len);
+  buf->len += len;
+}
+
+static void
+put_byte(wzbuf * buf, wz_uint8_t byte) {
+  put_bytes(buf, &byte, 1);
+}
+
+static void
+set_le32(wzbuf * buf, wz_uint32_t pos, wz_uint32_t le32) {
+  buf->bytes[pos    ] = (wz_uint8_t) (le32      );
+  buf->bytes[pos + 1] = (wz_uint8_t) (le32 >>  8);
+  buf->bytes[pos + 2] = (wz_uint8_t) (le32 >> 16);
+  buf->bytes[pos + 3] = (wz_uint8_t) (le32 >> 24);
+}
+
+static wz_uint32_t /* the position of the le32 */
+put_le32(wzbuf * buf, wz_uint32_t le32) {
+  static const wz_uint8_t zeros[4];
+  put_bytes(buf, zeros, sizeof(zeros));
+  set_le32(buf, buf->len - 4, le32);
+  return buf->len - 4;
+}
+
+static void
+put_int32(wzbuf * buf, wz_uint32_t int32) {
+  if (int32 < 0x80) {
+    put_byte(buf, (wz_uint8_t) int32);
+  } else {
+    put_byte(buf, 0x80);
+    (void) put_le32(buf, int32);
+  }
+}
+
+static void /* short cp1252 string encrypted with the key */
+put_chars(wzbuf * buf, const char * str, const wz_uint8_t * key) {
+  wz_uint8_t enc[0x7f];
+  wz_uint32_t len = (wz_uint32_t) strlen(str);
+  ck_assert(len <= sizeof(enc));
+  cp1252_encode(enc, (const wz_uint8_t *) str, len, key);
+  put_byte(buf, (wz_uint8_t) (0x100 - len));
+  put_bytes(buf, enc, len);
+}
+
+static void /* the header and the length of the directory of images */
+put_head(wzbuf * buf, wz_uint16_t enc, wz_uint32_t len) {
+  put_bytes(buf, "PKG1", 4);
+  (void) put_le32(buf, 0), (void) put_le32(buf, 0); /* size */
+  (void) put_le32(buf, BUF_START);
+  put_bytes(buf, "t", 2);
+  put_byte(buf, (wz_uint8_t) enc), put_byte(buf, (wz_uint8_t) (enc >> 8));
+  put_int32(buf, len);
+}
+
+static wz_uint32_t /* an image of the directory, written later by put_img */
+put_entry(wzbuf * buf, const char * name, const wz_uint8_t * key) {
+  put_byte(buf, 0x04);
+  put_chars(buf, name, key);
+  put_byte(buf, 0x80), (void) put_le32(buf, 0); /* size */
+  put_int32(buf, 0); /* check */
+  return put_le32(buf, 0);
+}
+
+static void /* a property of len children */
+put_prop(wzbuf * buf, wz_uint32_t len, const wz_uint8_t * key) {
+  put_byte(buf, 0x73);
+  put_chars(buf, "Property", key);
+  put_byte(buf, 0), put_byte(buf, 0);
+  put_int32(buf, len);
+}
+
+static wz_uint32_t /* the image of the entry, ended by end_img */
+put_img(wzbuf * buf, wz_uint32_t entry, wz_uint32_t hash, wz_uint32_t len,
+        const wz_uint8_t * key) {
+  wz_uint32_t addr = buf->len;
+  wz_uint32_t addr_enc;
+  wz_encode_addr(&addr_enc, addr, entry, BUF_START, hash);
+  set_le32(buf, entry, addr_enc);
+  put_prop(buf, len, key);
+  return addr;
+}
+
+static void
+end_img(wzbuf * buf, wz_uint32_t entry, wz_uint32_t addr) {
+  set_le32(buf, entry - 1 - 4, buf->len - addr); /* before the check */
+}
+
+static void
+put_int(wzbuf * buf, const char * name, wz_uint32_t val,
+        const wz_uint8_t * key) {
+  put_byte(buf, 0x00);
+  put_chars(buf, name, key);
+  put_byte(buf, 0x03);
+  put_int32(buf, val);
+}
+
+static wz_uint32_t /* an object child, ended by end_obj */
+put_obj(wzbuf * buf, const char * name, const wz_uint8_t * key) {
+  put_byte(buf, 0x00);
+  put_chars(buf, name, key);
+  put_byte(buf, 0x09);
+  return put_le32(buf, 0);
+}
+
+static void
+end_obj(wzbuf * buf, wz_uint32_t size_pos) {
+  set_le32(buf, size_pos, buf->len - size_pos - 4);
+}
+
+static wz_uint32_t /* a canvas of BGRA8888, the position of its size */
+put_canvas(wzbuf * buf, wz_uint32_t w, wz_uint32_t h, const wzbuf * blob,
+           const wz_uint8_t * key) {
+  wz_uint32_t size_pos;
+  put_byte(buf, 0x73);
+  put_chars(buf, "Canvas", key);
+  put_byte(buf, 0);
+  put_byte(buf, 0); /* no children */
+  put_int32(buf, w);
+  put_int32(buf, h);
+  put_int32(buf, WZ_COLOR_8888);
+  put_byte(buf, 0); /* scale */
+  (void) put_le32(buf, 0);
+  size_pos = put_le32(buf, blob->len + 1);
+  put_byte(buf, 0);
+  put_bytes(buf, blob->bytes, blob->len);
+  return size_pos;
+}
+
+static void /* an mp3 sound without header */
+put_sound(wzbuf * buf, const wz_uint8_t * bytes, wz_uint32_t len,
+          wz_uint32_t ms, const wz_uint8_t * key) {
+  static const wz_uint8_t guids[1 + 16 * 2 + 2 + 16]; /* the last is empty */
+  put_byte(buf, 0x73);
+  put_chars(buf, "Sound_DX8", key);
+  put_byte(buf, 0);
+  put_int32(buf, len);
+  put_int32(buf, ms);
+  put_bytes(buf, guids, sizeof(guids));
+  put_bytes(buf, bytes, len);
+}
+
+static void /* deflate the pixels and stop before the end of the stream */
+put_pixels(wzbuf * blob, wz_uint8_t * pixels, wz_uint32_t len) {
+  static wz_uint8_t out[0x400];
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  ck_assert(deflateInit(&strm, Z_DEFAULT_COMPRESSION) == Z_OK);
+  strm.next_in = pixels;
+  strm.avail_in = len;
+  strm.next_out = out;
+  strm.avail_out = sizeof(out);
+  ck_assert(deflate(&strm, Z_SYNC_FLUSH) == Z_OK);
+  put_bytes(blob, out, (wz_uint32_t) strm.total_out);
+  deflateEnd(&strm);
+}
+
+START_TEST(test_load_node) {
+  enum { W = 8, H = 8 };
+  wz_uint8_t pixels[W * H * 4];
+  wz_uint16_t enc;
+  wz_uint32_t hash;
+  const wz_uint8_t * key;
+  wz_uint32_t entries[2];
+  wz_uint32_t addr;
+  wz_uint32_t obj;
+  wz_uint32_t sub;
+  wz_uint32_t w;
+  wz_uint32_t h;
+  wz_uint8_t * data;
+  wz_uint32_t i;
+  wz_uint8_t mapped;
+  size_t mem_size_ctx;
+  wzbuf blob;
+  wzbuf buf;
+  wzctx * ctx;
+  wzfile created;
+  wzfile * file;
+  wznode * root;
+  wzary * ary;
+  wznode * node;
+
+  for (i = 0; i < sizeof(pixels); i++)
+    pixels[i] = (wz_uint8_t) (i * 7);
+  ck_assert((ctx = wz_init_ctx()) != NULL);
+  ck_assert((key = wz_get_key(ctx->profiles[0].keys, 0, 0x7f)) != NULL);
+  wz_encode_ver(&enc, &hash, 83);
+  blob.bytes = NULL, blob.len = blob.capa = 0;
+  put_pixels(&blob, pixels, sizeof(pixels));
+  buf.bytes = NULL, buf.len = buf.capa = 0;
+  put_head(&buf, enc, 2);
+  entries[0] = put_entry(&buf, "a.img", key);
+  entries[1] = put_entry(&buf, "b.img", key);
+  addr = put_img(&buf, entries[0], hash, 2, key);
+  obj = put_obj(&buf, "c", key);
+  (void) put_canvas(&buf, W, H, &blob, key);
+  end_obj(&buf, obj);
+  put_int(&buf, "n", 1, key);
+  end_img(&buf, entries[0], addr);
+  addr = put_img(&buf, entries[1], hash, 1, key);
+  obj = put_obj(&buf, "d", key);
+  put_prop(&buf, 1, key);
+  sub = put_obj(&buf, "c", key);
+  (void) put_canvas(&buf, W, H, &blob, key);
+  end_obj(&buf, sub);
+  end_obj(&buf, obj);
+  end_img(&buf, entries[1], addr);
+  free(blob.bytes);
+  create_file(&created, buf.bytes, buf.len);
+  mem_size_ctx = memused();
+
+  /* It should load every canvas of the subtree at once */
+  for (mapped = 0; mapped < 2; mapped++) {
+    ck_assert((file = (mapped ?
+                       wz_open_mem(buf.bytes, buf.len, ctx) :
+                       wz_open_io(&created.io, ctx))) != NULL);
+    ck_assert((file->map != NULL) == mapped);
+    ck_assert((root = wz_open_root(file)) != NULL);
+    ck_assert(wz_load_node(root) == 0);
+    ary = root->n.val.ary;
+    ck_assert(ary != NULL && ary->len == 2);
+    for (i = 0; i < ary->len; i++)
+      ck_assert(ary->nodes[i].n.val.ary != NULL); /* without wz_open_node */
+    ck_assert((node = wz_open_node(root, "a.img/c")) != NULL);
+    ck_assert((data = wz_get_img(&w, &h, NULL, NULL, node)) != NULL);
+    ck_assert(w == W && h == H);
+    ck_assert(memcmp(data, pixels, sizeof(pixels)) == 0);
+    ck_assert((node = wz_open_node(root, "b.img/d/c")) != NULL);
+    ck_assert((data = wz_get_img(&w, &h, NULL, NULL, node)) != NULL);
+    ck_assert(memcmp(data, pixels, sizeof(pixels)) == 0);
+
+    /* It should free everything it loaded */
+    ck_assert(wz_close_file(file) == 0);
+    ck_assert(memused() == mem_size_ctx);
+  }
+
+  delete_file(&created);
+  free(buf.bytes);
+  ck_assert(wz_free_ctx(ctx) == 0);
+  ck_assert(memused() == 0);
+} END_TEST
+
+START_TEST(test_keep_raw) {
+  enum { W = 4, H = 4 };
+  static const wz_uint8_t mp3[] = {0xff, 0xfb, 0x90, 0x44, 0x00};
+  wz_uint8_t pixels[W * H * 4];
+  wz_uint16_t enc;
+  wz_uint32_t hash;
+  const wz_uint8_t * key;
+  wz_uint32_t entry;
+  wz_uint32_t addr;
+  wz_uint32_t obj;
+  wz_uint32_t size_pos;
+  const wz_uint8_t * bytes;
+  wz_uint32_t size;
+  wz_uint32_t w;
+  wz_uint32_t h;
+  wz_uint32_t ms;
+  wz_uint16_t format;
+  wz_uint32_t i;
+  wz_uint8_t mapped;
+  size_t mem_size_ctx;
+  wzbuf blob;
+  wzbuf buf;
+  wzctx * ctx;
+  wzfile created;
+  wzfile * file;
+  wznode * root;
+  wznode * node;
+
+  for (i = 0; i < sizeof(pixels); i++)
+    pixels[i] = (wz_uint8_t) (i * 5);
+  ck_assert((ctx = wz_init_ctx()) != NULL);
+  ck_assert((key = wz_get_key(ctx->profiles[0].keys, 0, 0x7f)) != NULL);
+  wz_encode_ver(&enc, &hash, 83);
+  blob.bytes = NULL, blob.len = blob.capa = 0;
+  put_pixels(&blob, pixels, sizeof(pixels));
+  buf.bytes = NULL, buf.len = buf.capa = 0;
+  put_head(&buf, enc, 1);
+  entry = put_entry(&buf, "a.img", key);
+  addr = put_img(&buf, entry, hash, 3, key);
+  obj = put_obj(&buf, "c", key);
+  (void) put_canvas(&buf, W, H, &blob, key);
+  end_obj(&buf, obj);
+  obj = put_obj(&buf, "s", key);
+  put_sound(&buf, mp3, sizeof(mp3), 1234, key);
+  end_obj(&buf, obj);
+  obj = put_obj(&buf, "big", key);
+  size_pos = put_canvas(&buf, W, H, &blob, key);
+  end_obj(&buf, obj);
+  end_img(&buf, entry, addr);
+  set_le32(&buf, size_pos, blob.len + 2); /* one byte beyond the file */
+  create_file(&created, buf.bytes, buf.len);
+  mem_size_ctx = memused();
+
+  for (mapped = 0; mapped < 2; mapped++) {
+    ck_assert((file = (mapped ?
+                       wz_open_mem(buf.bytes, buf.len, ctx) :
+                       wz_open_io(&created.io, ctx))) != NULL);
+    ck_assert(wz_keep_raw(file, 1) == 0);
+    ck_assert((root = wz_open_root(file)) != NULL);
+
+    /* It should neither read nor decode the canvas */
+    ck_assert((node = wz_open_node(root, "a.img/c")) != NULL);
+    ck_assert(wz_get_img(&w, &h, NULL, NULL, node) == NULL);
+    ck_assert(w == W && h == H);
+    ck_assert(wz_get_raw(&bytes, &size, node) == 0);
+    ck_assert(size == blob.len);
+    ck_assert(memcmp(bytes, blob.bytes, size) == 0);
+    ck_assert(mapped == (bytes >= buf.bytes && bytes < buf.bytes + buf.len));
+    ck_assert(wz_free_raw(bytes, node) == 0);
+
+    /* It should neither read nor copy the sound */
+    ck_assert((node = wz_open_node(root, "a.img/s")) != NULL);
+    ck_assert(wz_get_ao(&size, &ms, &format, node) == NULL);
+    ck_assert(size == sizeof(mp3) && ms == 1234);
+    ck_assert(format == WZ_AUDIO_MP3);
+    ck_assert(wz_get_raw(&bytes, &size, node) == 0);
+    ck_assert(size == sizeof(mp3));
+    ck_assert(memcmp(bytes, mp3, size) == 0);
+    ck_assert(wz_free_raw(bytes, node) == 0);
+
+    /* It should not accept a canvas beyond the end of the file */
+    ck_assert(wz_open_node(root, "a.img/big") == NULL);
+
+    ck_assert(wz_close_file(file) == 0);
+    ck_assert(memused() == mem_size_ctx);
+  }
+
+  free(blob.bytes);
+  delete_file(&created);
+  free(buf.bytes);
+  ck_assert(wz_free_ctx(ctx) == 0);
+  ck_assert(memused() == 0);
+} END_TEST
+
+START_TEST(test_intern_names) {
+#define LONG_NAME "a_name_longer_than_any_buffer"
+  wz_uint16_t enc;
+  wz_uint32_t hash;
+  const wz_uint8_t * key;
+  wz_uint32_t entries[2];
+  wz_uint32_t addr;
+  wz_uint32_t obj;
+  wz_int32_t val;
+  size_t mem_size_ctx;
+  wzbuf buf;
+  wzctx * ctx;
+  wzfile * file;
+  wznode * root;
+  wznode * img;
+  wznode * a;
+  wznode * b;
+  wznode * node;
+
+  ck_assert((ctx = wz_init_ctx()) != NULL);
+  ck_assert((key = wz_get_key(ctx->profiles[0].keys, 0, 0x7f)) != NULL);
+  wz_encode_ver(&enc, &hash, 83);
+  buf.bytes = NULL, buf.len = buf.capa = 0;
+  put_head(&buf, enc, 2);
+  entries[0] = put_entry(&buf, "first_image.img", key);
+  entries[1] = put_entry(&buf, "second_image.img", key);
+  addr = put_img(&buf, entries[0], hash, 3, key);
+  put_int(&buf, LONG_NAME, 1, key);
+  obj = put_obj(&buf, "ninechars", key); /* too long for na_e */
+  put_prop(&buf, 1, key);
+  put_int(&buf, LONG_NAME, 2, key);
+  end_obj(&buf, obj);
+  put_int(&buf, "x", 3, key);
+  end_img(&buf, entries[0], addr);
+  addr = put_img(&buf, entries[1], hash, 2, key);
+  put_int(&buf, LONG_NAME, 4, key);
+  put_int(&buf, "ninechars", 5, key); /* short enough for n32_e */
+  end_img(&buf, entries[1], addr);
+  mem_size_ctx = memused();
+
+  ck_assert((file = wz_open_mem(buf.bytes, buf.len, ctx)) != NULL);
+  ck_assert(wz_intern_names(file, 1) == 0);
+  ck_assert((root = wz_open_root(file)) != NULL);
+
+  /* It should share the long names of the images and their children */
+  ck_assert((img = wz_open_node(root, "first_image.img")) != NULL);
+  ck_assert(img->n.info & WZ_INTERN);
+  ck_assert((a = wz_open_node(root, "first_image.img/" LONG_NAME)) != NULL);
+  ck_assert((b = wz_open_node(root, "second_image.img/" LONG_NAME)) != NULL);
+  ck_assert(a != b && (a->n.info & WZ_INTERN) && (b->n.info & WZ_INTERN));
+  ck_assert(wz_get_name(a) == wz_get_name(b));
+  ck_assert(wz_get_int(&val, a) == 0 && val == 1);
+  ck_assert(wz_get_int(&val, b) == 0 && val == 4);
+  ck_assert((node = wz_open_node(img, "ninechars/" LONG_NAME)) != NULL);
+  ck_assert(wz_get_name(node) == wz_get_name(a));
+  ck_assert(wz_get_int(&val, node) == 0 && val == 2);
+
+  /* It should find the embedded names among the interned ones */
+  ck_assert((node = wz_open_node(img, "ninechars")) != NULL);
+  ck_assert(node->n.info & WZ_INTERN);
+  ck_assert((node = wz_open_node(root, "second_image.img/ninechars")) !=
+            NULL);
+  ck_assert(node->n.info & WZ_EMBED);
+  ck_assert(wz_get_int(&val, node) == 0 && val == 5);
+  ck_assert((node = wz_open_node(img, "x")) != NULL);
+  ck_assert(node->n.info & WZ_EMBED);
+  ck_assert(wz_get_int(&val, node) == 0 && val == 3);
+
+  /* It should keep the names in the file when the image is closed */
+  ck_assert(wz_close_node(img) == 0);
+  ck_assert(wz_open_node(root, "second_image.img/" LONG_NAME) == b);
+  ck_assert(strcmp(wz_get_name(b), LONG_NAME) == 0);
+
+  /* It should free the names with the file */
+  ck_assert(wz_close_file(file) == 0);
+  ck_assert(memused() == mem_size_ctx);
+
+  free(buf.bytes);
+  ck_assert(wz_free_ctx(ctx) == 0);
+  ck_assert(memused() == 0);
+  ck_assert(memerr() == 0);
+#undef LONG_NAME
 } END_TEST
 
 TCase *
@@ -1362,14 +2954,32 @@ create_tcase_file(void) {
   tcase_add_test(tcase, test_read_le64);
   tcase_add_test(tcase, test_read_int32);
   tcase_add_test(tcase, test_read_int64);
+  tcase_add_test(tcase, test_xor_mask);
+  tcase_add_test(tcase, test_to_utf8);
   tcase_add_test(tcase, test_decode_chars);
   tcase_add_test(tcase, test_read_chars);
   tcase_add_test(tcase, test_decode_addr);
   tcase_add_test(tcase, test_seek);
+  tcase_add_test(tcase, test_read_at);
+  tcase_add_test(tcase, test_read_wide);
+  tcase_add_test(tcase, test_io_stats);
+  tcase_add_test(tcase, test_read_cache);
+  tcase_add_test(tcase, test_map_file);
+  tcase_add_test(tcase, test_read_batch);
+  tcase_add_test(tcase, test_get_raw);
+  tcase_add_test(tcase, test_intern_name);
   tcase_add_test(tcase, test_read_lv0);
+  tcase_add_test(tcase, test_get_lv1_type);
   tcase_add_test(tcase, test_encode_ver);
+  tcase_add_test(tcase, test_deduce_key);
+  tcase_add_test(tcase, test_match_keys);
   tcase_add_test(tcase, test_deduce_ver);
   tcase_add_test(tcase, test_encode_aes);
+  tcase_add_test(tcase, test_expand_keys);
+  tcase_add_test(tcase, test_init_ctx);
   tcase_add_test(tcase, test_open_file);
+  tcase_add_test(tcase, test_load_node);
+  tcase_add_test(tcase, test_keep_raw);
+  tcase_add_test(tcase, test_intern_names);
   return tcase;
 }